@@ -2181,6 +2181,17 @@ static void summary(struct io_data *io_data, __maybe_unused SOCKETTYPE c, __mayb
 	root = api_add_int(root, "Stale", &(total_stale), true);
 	root = api_add_uint(root, "Get Failures", &(total_go), true);
 	root = api_add_uint(root, "Local Work", &(local_work), true);
+	root = api_add_double(root, "Local Work/s", &(local_work_rate), true);
+	root = api_add_uint64(root, "Staged Locks", &(stgd_locked), true);
+	root = api_add_uint64(root, "Staged Lock Contended", &(stgd_contended), true);
+	root = api_add_uint64(root, "Local Pops", &(local_pops), true);
+	root = api_add_uint64(root, "Work Steals", &(work_steals), true);
+	root = api_add_uint64(root, "Work Allocs", &(work_allocs), true);
+	root = api_add_uint64(root, "Work Mallocs", &(work_mallocs), true);
+	root = api_add_uint64(root, "Job Allocs", &(job_allocs), true);
+	root = api_add_uint64(root, "Job Refs", &(job_refs), true);
+	root = api_add_int(root, "Net Threads", &(net_threads), true);
+	root = api_add_uint64(root, "Net Wakeups", &(net_wakeups), true);
 	root = api_add_uint(root, "Remote Failures", &(total_ro), true);
 	root = api_add_uint(root, "Network Blocks", &(new_blocks), true);
 	root = api_add_mhtotal(root, "Total MH", &(total_mhashes_done), true);
@@ -2995,7 +3006,11 @@ void dosave(struct io_data *io_data, __maybe_unused SOCKETTYPE c, char *param, b
 static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_stats *stats, struct cgminer_pool_stats *pool_stats, struct api_data *extra, struct cgpu_info *cgpu, bool isjson)
 {
 	struct api_data *root = NULL;
-	char buf[TMPBUFSIZ];
+	/* Per chip stats of a big bitfury board outgrow TMPBUFSIZ */
+	char *buf = malloc(SOCKBUFSIZ);
+
+	if (unlikely(!buf))
+		quit(1, "Failed to malloc itemstats buf");
 
 	root = api_add_int(root, "STATS", &i, false);
 	root = api_add_string(root, "ID", id, false);
@@ -3027,6 +3042,9 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 		root = api_add_uint64(root, "Bytes Recv", &(pool_stats->bytes_received), false);
 		root = api_add_uint64(root, "Net Bytes Sent", &(pool_stats->net_bytes_sent), false);
 		root = api_add_uint64(root, "Net Bytes Recv", &(pool_stats->net_bytes_received), false);
+		root = api_add_double(root, "Connect Time", &(pool_stats->cnx_setup), false);
+		root = api_add_uint32(root, "Standby Failovers", &(pool_stats->standby_failovers), false);
+		root = api_add_double(root, "Standby Saved", &(pool_stats->standby_saved), false);
 	}
 
 	if (extra)
@@ -3062,6 +3080,7 @@ static int itemstats(struct io_data *io_data, int i, char *id, struct cgminer_st
 
 	root = print_data(root, buf, isjson, isjson && (i > 0));
 	io_add(io_data, buf);
+	free(buf);
 
 	return ++i;
 }
@@ -0,0 +1,334 @@
+/*
+ *   bench-notify.c - time turning a mining.notify into the stratum template
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 3 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+*/
+
+/* Times turning a mining.notify into the compiled stratum template, the way
+ * cgminer did it before stratum_scan (jansson, strdup of every field and
+ * sscanf per hex byte, copied below) and the way util.c does it now.
+ *
+ * Compile, from a configured tree:
+ *   gcc -O2 -I . -I compat/jansson bench-notify.c sha2.c memutil.c \
+ *	compat/jansson/libjansson.a -lcurl -lpthread -o bench-notify
+ */
+
+#include "util.c"
+
+/* The parts of cgminer.c and logging.c util.c needs */
+bool opt_debug, opt_log_output, use_syslog;
+int opt_log_level = LOG_NOTICE;
+bool opt_protocol, opt_delaynet, opt_version_rolling;
+char *opt_socks_proxy;
+int opt_scantime = 60;
+int swork_id, total_getworks;
+unsigned long long global_hashrate;
+pthread_rwlock_t netacc_lock;
+
+void _applog(int prio, const char *str)
+{
+	if (prio <= LOG_ERR)
+		fprintf(stderr, "%s\n", str);
+}
+
+void _quit(int status)
+{
+	exit(status);
+}
+
+struct work_job *make_work_job(const char *job_id, const char *nonce1)
+{
+	size_t id_len = strlen(job_id) + 1, n1_len = nonce1 ? strlen(nonce1) + 1 : 0;
+	struct work_job *job = safe_calloc(1, sizeof(*job) + id_len + n1_len, "work job");
+
+	job->refs = 1;
+	job->job_id = (char *)(job + 1);
+	memcpy(job->job_id, job_id, id_len);
+	if (nonce1) {
+		job->nonce1 = job->job_id + id_len;
+		memcpy(job->nonce1, nonce1, n1_len);
+	}
+	return job;
+}
+
+void free_work_job(struct work_job *job)
+{
+	if (job && !--job->refs)
+		free(job);
+}
+
+/* The notify path as it was before stratum_scan, only renamed */
+static bool old_hex2bin(unsigned char *p, const char *hexstr, size_t len)
+{
+	bool ret = false;
+
+	while (*hexstr && len) {
+		char hex_byte[4];
+		unsigned int v;
+
+		if (unlikely(!hexstr[1])) {
+			applog(LOG_ERR, "hex2bin str truncated");
+			return ret;
+		}
+
+		memset(hex_byte, 0, 4);
+		hex_byte[0] = hexstr[0];
+		hex_byte[1] = hexstr[1];
+
+		if (unlikely(sscanf(hex_byte, "%x", &v) != 1)) {
+			applog(LOG_INFO, "hex2bin sscanf '%s' failed", hex_byte);
+			return ret;
+		}
+
+		*p = (unsigned char) v;
+
+		p++;
+		hexstr += 2;
+		len--;
+	}
+
+	if (likely(len == 0 && *hexstr == 0))
+		ret = true;
+	return ret;
+}
+
+static bool old_stratum_template(struct pool *pool)
+{
+	struct stratum_work *swork = &pool->swork;
+	unsigned char *hdr = swork->header_bin;
+	size_t tail;
+	uint64_t bits;
+	int i;
+
+	free_work_job(swork->job);
+	swork->job = make_work_job(swork->job_id, pool->nonce1);
+
+	swork->cb_len = swork->cb1_len + pool->n1_len + pool->n2size + swork->cb2_len;
+	swork->nonce2_offset = swork->cb1_len + pool->n1_len;
+	swork->cb_bin = realloc(swork->cb_bin, swork->cb_len);
+	if (unlikely(!swork->cb_bin))
+		quit(1, "Failed to realloc cb_bin in stratum_template");
+	memset(swork->cb_bin + swork->nonce2_offset, 0, pool->n2size);
+	if (!old_hex2bin(swork->cb_bin, swork->coinbase1, swork->cb1_len) ||
+	    !old_hex2bin(swork->cb_bin + swork->cb1_len, pool->nonce1, pool->n1_len) ||
+	    !old_hex2bin(swork->cb_bin + swork->nonce2_offset + pool->n2size, swork->coinbase2, swork->cb2_len))
+		return false;
+	sha2_starts(&swork->cb_ctx);
+	sha2_update(&swork->cb_ctx, swork->cb_bin, swork->nonce2_offset);
+
+	swork->cb_tail_n2 = swork->nonce2_offset % 64;
+	tail = swork->cb_len - (swork->nonce2_offset - swork->cb_tail_n2);
+	swork->cb_tail_len = (tail + 1 + 8 + 63) / 64 * 64;
+	swork->cb_tail = realloc(swork->cb_tail, swork->cb_tail_len);
+	if (unlikely(!swork->cb_tail))
+		quit(1, "Failed to realloc cb_tail in stratum_template");
+	memset(swork->cb_tail, 0, swork->cb_tail_len);
+	memcpy(swork->cb_tail, swork->cb_bin + swork->cb_len - tail, tail);
+	swork->cb_tail[tail] = 0x80;
+	bits = htobe64((uint64_t)swork->cb_len * 8);
+	memcpy(swork->cb_tail + swork->cb_tail_len - 8, &bits, 8);
+
+	if (swork->merkles) {
+		swork->merkle_bin = realloc(swork->merkle_bin, 32 * swork->merkles);
+		if (unlikely(!swork->merkle_bin))
+			quit(1, "Failed to realloc merkle_bin in stratum_template");
+	}
+	for (i = 0; i < swork->merkles; i++) {
+		if (!old_hex2bin(swork->merkle_bin + 32 * i, swork->merkle[i], 32))
+			return false;
+	}
+
+	memset(hdr, 0, 128);
+	if (!old_hex2bin(hdr, swork->bbversion, 4) ||
+	    !old_hex2bin(hdr + 4, swork->prev_hash, 32) ||
+	    !old_hex2bin(hdr + STRATUM_HDR_NTIME, swork->ntime, 4) ||
+	    !old_hex2bin(hdr + STRATUM_HDR_NTIME + 4, swork->nbit, 4))
+		return false;
+	hdr[83] = 0x80;
+	hdr[124] = 0x80;
+	hdr[125] = 0x02;
+	return true;
+}
+
+static bool old_parse_notify(struct pool *pool, json_t *val)
+{
+	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
+	bool clean, ret = false;
+	int merkles, i;
+	json_t *arr;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		goto out;
+
+	merkles = json_array_size(arr);
+
+	job_id = json_array_string(val, 0);
+	prev_hash = json_array_string(val, 1);
+	coinbase1 = json_array_string(val, 2);
+	coinbase2 = json_array_string(val, 3);
+	bbversion = json_array_string(val, 5);
+	nbit = json_array_string(val, 6);
+	ntime = json_array_string(val, 7);
+	clean = json_is_true(json_array_get(val, 8));
+
+	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
+		free(job_id);
+		free(prev_hash);
+		free(coinbase1);
+		free(coinbase2);
+		free(bbversion);
+		free(nbit);
+		free(ntime);
+		goto out;
+	}
+
+	cg_wlock(&pool->data_lock);
+	free(pool->swork.job_id);
+	free(pool->swork.prev_hash);
+	free(pool->swork.coinbase1);
+	free(pool->swork.coinbase2);
+	free(pool->swork.bbversion);
+	free(pool->swork.nbit);
+	free(pool->swork.ntime);
+	pool->swork.job_id = job_id;
+	pool->swork.prev_hash = prev_hash;
+	pool->swork.coinbase1 = coinbase1;
+	pool->swork.cb1_len = strlen(coinbase1) / 2;
+	pool->swork.coinbase2 = coinbase2;
+	pool->swork.cb2_len = strlen(coinbase2) / 2;
+	pool->swork.bbversion = bbversion;
+	pool->swork.nbit = nbit;
+	pool->swork.ntime = ntime;
+	pool->swork.clean = clean;
+	pool->swork.cb_len = pool->swork.cb1_len + pool->n1_len + pool->n2size + pool->swork.cb2_len;
+
+	for (i = 0; i < pool->swork.merkles; i++)
+		free(pool->swork.merkle[i]);
+	if (merkles) {
+		pool->swork.merkle = realloc(pool->swork.merkle, sizeof(char *) * merkles + 1);
+		for (i = 0; i < merkles; i++)
+			pool->swork.merkle[i] = json_array_string(arr, i);
+	}
+	pool->swork.merkles = merkles;
+	if (clean) {
+		pool->nonce2 = 0;
+		pool->nonce2_epoch++;
+	}
+	if (unlikely(!old_stratum_template(pool))) {
+		cg_wunlock(&pool->data_lock);
+		goto out;
+	}
+	cg_wunlock(&pool->data_lock);
+
+	pool->getwork_requested++;
+	total_getworks++;
+	ret = true;
+out:
+	return ret;
+}
+
+static bool old_parse_method(struct pool *pool, char *s)
+{
+	json_t *val, *method;
+	json_error_t err;
+	bool ret = false;
+	char *buf;
+
+	val = JSON_LOADS(s, &err);
+	if (!val)
+		return false;
+	method = json_object_get(val, "method");
+	buf = (char *)json_string_value(method);
+	if (buf && !strncasecmp(buf, "mining.notify", 13))
+		pool->stratum_notify = ret = old_parse_notify(pool, json_object_get(val, "params"));
+	json_decref(val);
+	return ret;
+}
+
+static struct pool *bench_pool(void)
+{
+	struct pool *pool = calloc(sizeof(struct pool), 1);
+
+	if (unlikely(!pool))
+		quit(1, "Failed to calloc pool in bench_pool");
+	cglock_init(&pool->data_lock);
+	pool->nonce1 = strdup("f8002c90");
+	pool->n1_len = 4;
+	pool->n2size = 4;
+	return pool;
+}
+
+static double bench(bool (*parse)(struct pool *, char *), struct pool *pool,
+		    char *line, int rounds)
+{
+	struct timeval start, end;
+	int i;
+
+	cgtime(&start);
+	for (i = 0; i < rounds; i++)
+		parse(pool, line);
+	cgtime(&end);
+	return us_tdiff(&end, &start) / rounds;
+}
+
+static bool new_template(struct pool *pool, char __maybe_unused *line)
+{
+	bool ret;
+
+	cg_wlock(&pool->data_lock);
+	ret = stratum_template(pool);
+	cg_wunlock(&pool->data_lock);
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	int merkles = 12, rounds = 100000, i;
+	struct pool *old_pool, *pool;
+	char line[4096], *p = line;
+	double old_us, json_us, scan_us, tmpl_us;
+
+	if (argc > 1)
+		merkles = atoi(argv[1]);
+	if (argc > 2)
+		rounds = atoi(argv[2]);
+	if (merkles < 0 || merkles > 32 || rounds < 1) {
+		fprintf(stderr, "Usage: %s [merkles (0-32)] [rounds]\n", argv[0]);
+		return 1;
+	}
+
+	p += sprintf(p, "{\"params\": [\"1f8d\", \"4d16b6f85af6e2198f44ae2a6de67f78487ae5611b77c6c0440b921e00000000\", "
+		     "\"01000000010000000000000000000000000000000000000000000000000000000000000000ffffffff20020862062f503253482f04b8864e5008\", "
+		     "\"072f736c7573682f000000000100f2052a010000001976a914d23fcdf86f7e756a64a7a9688ef9903327048ed988ac00000000\", [");
+	for (i = 0; i < merkles; i++)
+		p += sprintf(p, "%s\"%064x\"", i ? ", " : "", i * 0x1010101);
+	sprintf(p, "], \"00000002\", \"1c2ac4af\", \"504e86b9\", false], \"id\": null, \"method\": \"mining.notify\"}");
+
+	old_pool = bench_pool();
+	pool = bench_pool();
+	old_us = bench(old_parse_method, old_pool, line, rounds);
+	json_us = bench(parse_method_json, pool, line, rounds);
+	scan_us = bench(parse_method, pool, line, rounds);
+	tmpl_us = bench(new_template, pool, line, rounds);
+
+	printf("mining.notify with %d merkles, %d bytes, %s\n", merkles, (int)strlen(line),
+	       old_pool->stratum_notify && pool->stratum_notify ? "parsed" : "FAILED");
+	if (memcmp(old_pool->swork.header_bin, pool->swork.header_bin, 128) ||
+	    old_pool->swork.cb_len != pool->swork.cb_len ||
+	    memcmp(old_pool->swork.cb_bin, pool->swork.cb_bin, pool->swork.cb_len) ||
+	    (merkles && memcmp(old_pool->swork.merkle_bin, pool->swork.merkle_bin, 32 * merkles)))
+		printf("  templates DIFFER\n");
+	printf("  before (jansson, sscanf hex2bin): %.3f us\n", old_us);
+	printf("  jansson:                          %.3f us\n", json_us);
+	printf("  stratum_scan:                     %.3f us\n", scan_us);
+	printf("  template part:                    %.3f us of each\n", tmpl_us);
+	return 0;
+}
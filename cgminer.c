@@ -38,6 +38,10 @@
 #ifndef WIN32
 #include <sys/resource.h>
 #endif
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 #include <ccan/opt/opt.h>
 #include <jansson.h>
 #include <curl/curl.h>
@@ -52,6 +56,7 @@
 #include "bench_block.h"
 #include "scrypt.h"
 #include "memutil.h"
+#include "sha2_lanes.h"
 
 #ifdef USE_AVALON
 #include "driver-avalon.h"
@@ -92,6 +97,10 @@ const int opt_cutofftemp = 95;
 int opt_log_interval = 5;
 int opt_queue = 1;
 int opt_scantime = -1;
+int opt_stratum_batch = 8;
+int opt_stratum_roll = 60;
+int opt_stratum_submit = 1000;
+int opt_standby_pools;
 int opt_expiry = 120;
 static const bool opt_time = true;
 unsigned long long global_hashrate;
@@ -108,6 +117,7 @@ bool opt_scrypt;
 #endif
 #endif
 bool opt_restart = true;
+bool opt_version_rolling = true;
 static bool opt_nogpu;
 
 struct list_head scan_devices;
@@ -152,6 +162,10 @@ char *opt_avalon_options = NULL;
 #ifdef USE_BITFURY
 char *opt_bitfury_clockbits = NULL;
 int  spi_clock = 500000;
+bool opt_bitfury_spi_batch;
+bool opt_bitfury_pipeline;
+int opt_bitfury_emulate;
+int opt_bitfury_emu_mhz = 250;
 #endif
 #ifdef USE_USBUTILS
 char *opt_usb_select = NULL;
@@ -224,12 +238,16 @@ int hw_errors;
 int total_accepted, total_rejected, total_diff1;
 int total_getworks, total_stale, total_discarded;
 double total_diff_accepted, total_diff_rejected, total_diff_stale;
-static int staged_rollable;
 unsigned int new_blocks;
 static unsigned int work_block;
 unsigned int found_blocks;
 
 unsigned int local_work;
+double local_work_rate;
+uint64_t stgd_locked, stgd_contended, local_pops, work_steals;
+uint64_t work_allocs, work_mallocs, job_allocs, job_refs;
+int net_threads;
+uint64_t net_wakeups;
 unsigned int total_go, total_ro;
 
 struct pool **pools;
@@ -279,6 +297,7 @@ struct stratum_share {
 	struct work *work;
 	int id;
 	time_t sshare_time;
+	struct stratum_share *next; /* in a chain waiting to be sent */
 };
 
 static struct stratum_share *stratum_shares = NULL;
@@ -309,7 +328,27 @@ static int alloc_works = 0;
 static int freed_works = 0;
 static int total_work;
 static int total_queued;
-struct work *staged_work = NULL;
+
+/* Staged work waits in two binary min-heaps on tv_staged, both under
+ * stgd_lock: rollable masters kept back for cloning, and everything else
+ * which hash_pop hands out first */
+struct staged_heap {
+	struct work **works;
+	int count;
+	int size;
+};
+
+static struct staged_heap staged_clones, staged_masters;
+
+/* stgd_lock with contention accounting, the counters only change under it */
+static void lock_staged(void)
+{
+	if (mutex_trylock(stgd_lock)) {
+		mutex_lock(stgd_lock);
+		stgd_contended++;
+	}
+	stgd_locked++;
+}
 
 // #define STATIC_WORKS 2048
 #ifdef  STATIC_WORKS
@@ -600,6 +639,16 @@ static char *set_int_1_to_10(const char *arg, int *i)
 	return set_int_range(arg, i, 1, 10);
 }
 
+static char *set_int_0_to_7000(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 0, 7000);
+}
+
+static char *set_int_1_to_64(const char *arg, int *i)
+{
+	return set_int_range(arg, i, 1, MAX_STRATUM_BATCH);
+}
+
 #ifdef USE_FPGA_SERIAL
 static char *add_serial(char *arg)
 {
@@ -1113,6 +1162,18 @@ static struct opt_table opt_config_table[] = {
     OPT_WITH_ARG("--bitfury-spiclock",
              opt_set_intval, NULL, &spi_clock,
              "Set bitfury device SPI clock, default 500000 (0.5Mhz) "),
+	OPT_WITH_ARG("--bitfury-emulate",
+		     set_int_0_to_9999, opt_show_intval, &opt_bitfury_emulate,
+		     "Emulate this many bitfury chips in software instead of SPI/I2C hardware, for benchmarking"),
+	OPT_WITH_ARG("--bitfury-emu-mhz",
+		     set_int_1_to_65535, opt_show_intval, &opt_bitfury_emu_mhz,
+		     "Set clock of emulated bitfury chips in Mhz"),
+	OPT_WITHOUT_ARG("--bitfury-spi-batch",
+			opt_set_bool, &opt_bitfury_spi_batch,
+			"Send jobs to all chips of bitfury bank in single SPI transaction"),
+	OPT_WITHOUT_ARG("--bitfury-pipeline",
+			opt_set_bool, &opt_bitfury_pipeline,
+			"Run bitfury SPI transfers and I2C telemetry on own threads, overlapped with nonce verification"),
 #endif
 	OPT_WITHOUT_ARG("--load-balance",
 		     set_loadbalance, &pool_strategy,
@@ -1150,6 +1211,9 @@ static struct opt_table opt_config_table[] = {
 			opt_hidden
 #endif
 	),
+	OPT_WITHOUT_ARG("--no-version-rolling",
+			opt_set_invbool, &opt_version_rolling,
+		        "Don't ask stratum pools for BIP310 version rolling"),
 	OPT_WITHOUT_ARG("--no-submit-stale",
 			opt_set_invbool, &opt_submit_stale,
 		        "Don't submit shares if they are detected as stale"),
@@ -1217,6 +1281,18 @@ static struct opt_table opt_config_table[] = {
 	OPT_WITH_ARG("--socks-proxy",
 		     opt_set_charp, NULL, &opt_socks_proxy,
 		     "Set socks4 proxy (host:port)"),
+	OPT_WITH_ARG("--standby-pools",
+		     set_int_0_to_9999, opt_show_intval, &opt_standby_pools,
+		     "Backup stratum pools to keep connected and authorised for instant failover"),
+	OPT_WITH_ARG("--stratum-batch",
+		     set_int_1_to_64, opt_show_intval, &opt_stratum_batch,
+		     "Stratum works generated per batch when the queue runs low (1 - 64)"),
+	OPT_WITH_ARG("--stratum-roll",
+		     set_int_0_to_7000, opt_show_intval, &opt_stratum_roll,
+		     "Seconds stratum work ntime may be rolled past the job's ntime, 0 disables (0 - 7000)"),
+	OPT_WITH_ARG("--stratum-submit",
+		     set_int_0_to_9999, opt_show_intval, &opt_stratum_submit,
+		     "Microseconds to wait for more shares to send in the same write as a stratum share (0 - 9999)"),
 #ifdef HAVE_SYSLOG_H
 	OPT_WITHOUT_ARG("--syslog",
 			opt_set_bool, &use_syslog,
@@ -1527,32 +1603,189 @@ static bool jobj_binary(const json_t *obj, const char *key,
 	return true;
 }
 
+static const uint32_t sha256_h0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+	0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
+/* Midstates of the first header block of n works, in SIMD lanes. Works with
+ * version rolled variants get the midstate of each variant as well, all works
+ * of the call have the same number of them */
+static void calc_midstates(struct work **works, int n)
+{
+	uint32_t state[MAX_STRATUM_BATCH][8], block[MAX_STRATUM_BATCH][16];
+	int i, j, v, variants = MAX(works[0]->vversions, 1);
+
+	for (v = 0; v < variants; v++) {
+		for (j = 0; j < n; j++) {
+			/* Header words are kept byte swapped, as flip64 undoes */
+			for (i = 0; i < 16; i++)
+				block[j][i] = le32toh(((uint32_t *)works[j]->data)[i]);
+			if (works[j]->vversions)
+				block[j][0] = le32toh(htobe32(works[j]->vversion[v]));
+			memcpy(state[j], sha256_h0, 32);
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, n);
+
+		for (j = 0; j < n; j++) {
+			struct work *work = works[j];
+
+			if (!v) {
+				memcpy(work->midstate, state[j], 32);
+				endian_flip32(work->midstate, work->midstate);
+			}
+			if (work->vversions) {
+				memcpy(work->vmidstate[v], state[j], 32);
+				endian_flip32(work->vmidstate[v], work->vmidstate[v]);
+			}
+		}
+	}
+}
+
 static void calc_midstate(struct work *work)
 {
-	unsigned char data[64];
-	uint32_t *data32 = (uint32_t *)data;
-	sha2_context ctx;
+	calc_midstates(&work, 1);
+}
 
-	flip64(data32, work->data);
-	sha2_starts(&ctx);
-	sha2_update(&ctx, data, 64);
-	memcpy(work->midstate, ctx.state, 32);
-	endian_flip32(work->midstate, work->midstate);
+/* Switches work to its version rolled header variant, for a clone or for a
+ * driver submitting a nonce found on that variant's midstate */
+void set_work_version(struct work *work, int variant)
+{
+	*(uint32_t *)work->data = htobe32(work->vversion[variant]);
+	memcpy(work->midstate, work->vmidstate[variant], 32);
 }
 
 /* This is the central place all work that is about to be retired should be
  * cleaned to remove any dynamically allocated arrays within the struct */
 void clean_work(struct work *work)
 {
-    free(work->job_id);
-    free(work->nonce2);
-    free(work->ntime);
+    free_work_job(work->job);
     free(work->gbt_coinbase);
-    free(work->nonce1);
     memset(work, 0, sizeof(struct work));
     work->debug_stage = -1;
 }
 
+/* Makes the shared strings of a job in one allocation, nonce1 may be NULL */
+struct work_job *make_work_job(const char *job_id, const char *nonce1)
+{
+	size_t id_len = strlen(job_id) + 1, n1_len = nonce1 ? strlen(nonce1) + 1 : 0;
+	struct work_job *job = safe_calloc(1, sizeof(*job) + id_len + n1_len, "work job");
+
+	job->refs = 1;
+	job->job_id = (char *)(job + 1);
+	memcpy(job->job_id, job_id, id_len);
+	if (nonce1) {
+		job->nonce1 = job->job_id + id_len;
+		memcpy(job->nonce1, nonce1, n1_len);
+	}
+	__atomic_add_fetch(&job_allocs, 1, __ATOMIC_RELAXED);
+
+	return job;
+}
+
+struct work_job *ref_work_job(struct work_job *job)
+{
+	__atomic_add_fetch(&job->refs, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&job_refs, 1, __ATOMIC_RELAXED);
+
+	return job;
+}
+
+void free_work_job(struct work_job *job)
+{
+	if (job && !__atomic_sub_fetch(&job->refs, 1, __ATOMIC_ACQ_REL))
+		free(job);
+}
+
+#ifndef STATIC_WORKS
+/* Freed works go to a per-thread cache. A full cache spills half of it to
+ * the shared depot and an empty one refills half from it, the depot grows by
+ * WORK_SLAB works at once and never shrinks. Works are made by the scheduler
+ * and freed by the mining and submit threads, so they flow through the depot
+ * in batches and calloc is only reached while the depot grows. A thread
+ * exiting returns its whole cache to the depot. */
+#define WORK_CACHE 32
+#define WORK_SLAB 64
+
+static __thread struct work *work_cache;
+static __thread int work_cached;
+static struct work *work_depot;
+static pthread_mutex_t work_depot_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t work_cache_key;
+static pthread_once_t work_cache_once = PTHREAD_ONCE_INIT;
+
+/* pthread key destructor, run as a thread holding a cache exits */
+static void work_cache_flush(void __maybe_unused *arg)
+{
+	struct work *work;
+
+	mutex_lock(&work_depot_lock);
+	while ((work = work_cache)) {
+		work_cache = work->slab_next;
+		work->slab_next = work_depot;
+		work_depot = work;
+	}
+	work_cached = 0;
+	mutex_unlock_noyield(&work_depot_lock);
+}
+
+static void work_cache_key_init(void)
+{
+	if (unlikely(pthread_key_create(&work_cache_key, work_cache_flush)))
+		quit(1, "Failed to create work_cache_key");
+}
+
+/* Called while the cache is empty, before it takes any works */
+static void work_cache_keep(void)
+{
+	pthread_once(&work_cache_once, work_cache_key_init);
+	if (!pthread_getspecific(work_cache_key))
+		pthread_setspecific(work_cache_key, &work_cache);
+}
+
+static void work_depot_get(void)
+{
+	struct work *work;
+	int i;
+
+	work_cache_keep();
+	mutex_lock(&work_depot_lock);
+	if (!work_depot) {
+		struct work *slab = safe_calloc(WORK_SLAB, sizeof(struct work), "work slab");
+
+		for (i = 0; i < WORK_SLAB; i++) {
+			slab[i].slab_next = work_depot;
+			work_depot = &slab[i];
+		}
+		work_mallocs += WORK_SLAB;
+	}
+	for (i = 0; i < WORK_CACHE / 2 && work_depot; i++) {
+		work = work_depot;
+		work_depot = work->slab_next;
+		work->slab_next = work_cache;
+		work_cache = work;
+		work_cached++;
+	}
+	mutex_unlock_noyield(&work_depot_lock);
+}
+
+static void work_depot_put(void)
+{
+	struct work *work;
+	int i;
+
+	mutex_lock(&work_depot_lock);
+	for (i = 0; i < WORK_CACHE / 2; i++) {
+		work = work_cache;
+		work_cache = work->slab_next;
+		work->slab_next = work_depot;
+		work_depot = work;
+	}
+	work_cached -= WORK_CACHE / 2;
+	mutex_unlock_noyield(&work_depot_lock);
+}
+#endif
+
 
 static struct work *make_work(void)
 {
@@ -1602,7 +1835,15 @@ static struct work *make_work(void)
 
 
 #else
-    struct work *work = safe_calloc(1, sizeof(struct work), "work");
+    struct work *work;
+
+    if (!work_cache)
+        work_depot_get();
+    work = work_cache;
+    work_cache = work->slab_next;
+    work->slab_next = NULL;
+    work_cached--;
+    __atomic_add_fetch(&work_allocs, 1, __ATOMIC_RELAXED);
     alloc_works ++;
     if (alloc_works - freed_works >= 1000) {
         applog (LOG_WARNING, "#MEM_LEAK?: alloc_works = %5d, freed_works = %5d ", alloc_works, freed_works );
@@ -1625,7 +1866,12 @@ void free_work(struct work *work)
 	clean_work(work);
 #ifdef STATIC_WORKS
 #else
-    cfree(work);
+    if (!work_cache)
+        work_cache_keep();
+    work->slab_next = work_cache;
+    work_cache = work;
+    if (++work_cached > WORK_CACHE)
+        work_depot_put();
     freed_works ++;
 #endif
 }
@@ -1802,8 +2048,10 @@ static void gen_gbt_work(struct pool *pool, struct work *work)
 	/* For encoding the block data on submission */
 	work->gbt_txns = pool->gbt_txns + 1;
 
-	if (pool->gbt_workid)
-		work->job_id = strdup(pool->gbt_workid);
+	if (pool->gbt_workid) {
+		work->job = make_work_job(pool->gbt_workid, NULL);
+		work->job_id = work->job->job_id;
+	}
 	cg_runlock(&pool->gbt_lock);
 
 	memcpy(work->data + 4 + 32, merkleroot, 32);
@@ -1982,20 +2230,182 @@ void decay_time(double *f, double fadd, double fsecs)
 
 static int __total_staged(void)
 {
-	return HASH_COUNT(staged_work);
+	return staged_clones.count + staged_masters.count;
 }
 
 static int total_staged(void)
 {
 	int ret;
 
-	mutex_lock(stgd_lock);
+	lock_staged();
 	ret = __total_staged();
 	mutex_unlock(stgd_lock);
 
 	return ret;
 }
 
+static inline bool staged_before(struct staged_heap *heap, int a, int b)
+{
+	return timercmp(&heap->works[a]->tv_staged, &heap->works[b]->tv_staged, <);
+}
+
+static inline void staged_swap(struct staged_heap *heap, int a, int b)
+{
+	struct work *work = heap->works[a];
+
+	heap->works[a] = heap->works[b];
+	heap->works[b] = work;
+}
+
+static void staged_sift_down(struct staged_heap *heap, int i)
+{
+	int child;
+
+	while ((child = 2 * i + 1) < heap->count) {
+		if (child + 1 < heap->count && staged_before(heap, child + 1, child))
+			child++;
+		if (!staged_before(heap, child, i))
+			break;
+		staged_swap(heap, i, child);
+		i = child;
+	}
+}
+
+static void staged_heap_push(struct staged_heap *heap, struct work *work)
+{
+	int i, parent;
+
+	if (heap->count == heap->size) {
+		heap->size = heap->size ? heap->size * 2 : 64;
+		heap->works = realloc(heap->works, sizeof(struct work *) * heap->size);
+		if (unlikely(!heap->works))
+			quit(1, "Failed to realloc staged heap");
+	}
+	i = heap->count++;
+	heap->works[i] = work;
+	while (i) {
+		parent = (i - 1) / 2;
+		if (!staged_before(heap, i, parent))
+			break;
+		staged_swap(heap, i, parent);
+		i = parent;
+	}
+}
+
+/* Oldest staged work of the heap */
+static struct work *staged_heap_pop(struct staged_heap *heap)
+{
+	struct work *work;
+
+	if (!heap->count)
+		return NULL;
+	work = heap->works[0];
+	heap->works[0] = heap->works[--heap->count];
+	staged_sift_down(heap, 0);
+	return work;
+}
+
+/* Takes out every work remove() returns true for, which then owns it.
+ * Rebuilding the heap afterwards is linear */
+static int staged_heap_remove(struct staged_heap *heap, bool (*remove)(struct work *, void *), void *arg)
+{
+	int i, kept = 0, removed;
+
+	for (i = 0; i < heap->count; i++) {
+		if (!remove(heap->works[i], arg))
+			heap->works[kept++] = heap->works[i];
+	}
+	removed = heap->count - kept;
+	heap->count = kept;
+	for (i = kept / 2 - 1; i >= 0; i--)
+		staged_sift_down(heap, i);
+	return removed;
+}
+
+/* Oldest work of the thread's own deque */
+static struct work *local_pop(struct thr_info *thr)
+{
+	struct work_deque *dq = &thr->workq;
+	struct work *work = NULL;
+
+	mutex_lock(&dq->lock);
+	if (dq->count) {
+		work = dq->works[dq->head];
+		dq->head = (dq->head + 1) % LOCAL_WORKS;
+		dq->count--;
+	}
+	mutex_unlock_noyield(&dq->lock);
+
+	if (work)
+		__atomic_add_fetch(&local_pops, 1, __ATOMIC_RELAXED);
+	return work;
+}
+
+/* Only the owner fills its deque, and only once it ran empty */
+static void local_fill(struct thr_info *thr, struct work **works, int n)
+{
+	struct work_deque *dq = &thr->workq;
+	int i;
+
+	mutex_lock(&dq->lock);
+	for (i = 0; i < n; i++)
+		dq->works[(dq->head + dq->count++) % LOCAL_WORKS] = works[i];
+	mutex_unlock_noyield(&dq->lock);
+}
+
+/* Takes the newer half of the first non empty deque after this thread's,
+ * returning one work and keeping the rest */
+static struct work *steal_work(struct thr_info *thr)
+{
+	struct work *works[LOCAL_WORKS];
+	int i, j, n = 0;
+
+	rd_lock(&mining_thr_lock);
+	for (i = 1; i < mining_threads && !n; i++) {
+		struct work_deque *dq = &mining_thr[(thr->id + i) % mining_threads]->workq;
+
+		if (!__atomic_load_n(&dq->count, __ATOMIC_RELAXED))
+			continue;
+		mutex_lock(&dq->lock);
+		n = (dq->count + 1) / 2;
+		for (j = n - 1; j >= 0; j--)
+			works[j] = dq->works[(dq->head + --dq->count) % LOCAL_WORKS];
+		mutex_unlock_noyield(&dq->lock);
+	}
+	rd_unlock(&mining_thr_lock);
+
+	if (!n)
+		return NULL;
+	__atomic_add_fetch(&work_steals, 1, __ATOMIC_RELAXED);
+	local_fill(thr, works + 1, n - 1);
+	return works[0];
+}
+
+/* Takes out of every deque the works remove() returns true for */
+static int local_remove(bool (*remove)(struct work *, void *), void *arg)
+{
+	int i, j, kept, removed = 0;
+
+	rd_lock(&mining_thr_lock);
+	for (i = 0; i < mining_threads; i++) {
+		struct work_deque *dq = &mining_thr[i]->workq;
+
+		mutex_lock(&dq->lock);
+		for (j = kept = 0; j < dq->count; j++) {
+			struct work *work = dq->works[(dq->head + j) % LOCAL_WORKS];
+
+			if (!remove(work, arg))
+				dq->works[(dq->head + kept++) % LOCAL_WORKS] = work;
+		}
+		removed += dq->count - kept;
+		dq->count = kept;
+		mutex_unlock_noyield(&dq->lock);
+	}
+	rd_unlock(&mining_thr_lock);
+
+	return removed;
+}
+
 #ifdef HAVE_CURSES
 WINDOW *mainwin, *statuswin, *logwin;
 #endif
@@ -2432,6 +2842,7 @@ static void reject_pool(struct pool *pool)
 }
 
 static void restart_threads(void);
+static void net_wake(void);
 
 /* Theoretically threads could race when modifying accepted and
  * rejected values but the chance of two submits completing at the
@@ -2562,23 +2973,12 @@ share_result(json_t *val, json_t *res, json_t *err, const struct work *work,
 	}
 }
 
-static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
+/* Builds the JSON-RPC request submitting the work */
+static char *submit_upstream_req(struct work *work)
 {
-	char *hexstr = NULL;
-	json_t *val, *res, *err;
-	char *s;
-	bool rc = false;
-	int thr_id = work->thr_id;
-	struct cgpu_info *cgpu;
 	struct pool *pool = work->pool;
-	int rolltime;
-	struct timeval tv_submit, tv_submit_reply;
-	char hashshow[64 + 4] = "";
-	char worktime[200] = "";
-	struct timeval now;
-	double dev_runtime;
-
-	cgpu = get_thr_cgpu(thr_id);
+	char *hexstr;
+	char *s;
 
 	endian_flip128(work->data, work->data);
 
@@ -2628,12 +3028,26 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 	}
 	applog(LOG_DEBUG, "DBG: sending %s submit RPC call: %s", pool->rpc_url, s);
 	s = realloc_strcat(s, "\n");
+	free(hexstr);
 
-	cgtime(&tv_submit);
-	/* issue JSON-RPC request */
-	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
-	cgtime(&tv_submit_reply);
-	free(s);
+	return s;
+}
+
+/* Takes the reply to a submitted work, false if there was none */
+static bool submit_upstream_result(struct work *work, json_t *val, bool resubmit,
+				   struct timeval *tv_submit, struct timeval *tv_submit_reply)
+{
+	json_t *res, *err;
+	bool rc = false;
+	int thr_id = work->thr_id;
+	struct cgpu_info *cgpu;
+	struct pool *pool = work->pool;
+	char hashshow[64 + 4] = "";
+	char worktime[200] = "";
+	struct timeval now;
+	double dev_runtime;
+
+	cgpu = get_thr_cgpu(thr_id);
 
 	if (unlikely(!val)) {
 		applog(LOG_INFO, "submit_upstream_work json_rpc_call failed");
@@ -2646,7 +3060,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 			}
 			applog(LOG_WARNING, "Pool %d communication failure, caching submissions", pool->pool_no);
 		}
-		nmsleep(5000);
 		goto out;
 	} else if (pool_tclear(pool, &pool->submit_fail))
 		applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
@@ -2677,15 +3090,15 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 							(struct timeval *)&(work->tv_getwork_reply));
 			double work_time = tdiff((struct timeval *)&(work->tv_work_found),
 							(struct timeval *)&(work->tv_work_start));
-			double work_to_submit = tdiff(&tv_submit,
+			double work_to_submit = tdiff(tv_submit,
 							(struct timeval *)&(work->tv_work_found));
-			double submit_time = tdiff(&tv_submit_reply, &tv_submit);
+			double submit_time = tdiff(tv_submit_reply, tv_submit);
 			int diffplaces = 3;
 
 			time_t tmp_time = work->tv_getwork.tv_sec;
 			tm = localtime(&tmp_time);
 			memcpy(&tm_getwork, tm, sizeof(struct tm));
-			tmp_time = tv_submit_reply.tv_sec;
+			tmp_time = tv_submit_reply->tv_sec;
 			tm = localtime(&tmp_time);
 			memcpy(&tm_submit_reply, tm, sizeof(struct tm));
 
@@ -2739,7 +3152,6 @@ static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
 
 	rc = true;
 out:
-	free(hexstr);
 	return rc;
 }
 
@@ -3185,11 +3597,15 @@ static inline bool should_roll(struct work *work)
 }
 
 /* Limit rolls to 7000 to not beyond 2 hours in the future where bitcoind will
- * reject blocks as invalid. */
+ * reject blocks as invalid. Stratum work is only rolled within the
+ * --stratum-roll window past the ntime of its job. */
 static inline bool can_roll(struct work *work)
 {
-	return (!work->stratum && work->pool && work->rolltime && !work->clone &&
-		work->rolls < 7000 && !stale_work(work, false));
+	if (!work->pool || work->clone || stale_work(work, false))
+		return false;
+	if (work->stratum)
+		return work->rolls < opt_stratum_roll;
+	return work->rolltime && work->rolls < 7000;
 }
 
 static void roll_work(struct work *work)
@@ -3201,6 +3617,12 @@ static void roll_work(struct work *work)
 	ntime = be32toh(*work_ntime);
 	ntime++;
 	*work_ntime = htobe32(ntime);
+	if (work->stratum) {
+		/* The ntime submitted with shares has to match the header */
+		__bin2hex(work->ntime, (const unsigned char *)work_ntime, 4);
+		/* Every version variant is fresh again with the new ntime */
+		work->vmidstates = work->vversions;
+	}
 	local_work++;
 	work->rolls++;
 	work->blk.nonce = 0;
@@ -3222,14 +3644,9 @@ void __copy_work(struct work *work, struct work *base_work)
 	/* Keep the unique new id assigned during make_work to prevent copied
 	 * work from having the same id. */
 	work->id = id;
-	if (base_work->job_id)
-		work->job_id = strdup(base_work->job_id);
-	if (base_work->nonce1)
-		work->nonce1 = strdup(base_work->nonce1);
-	if (base_work->nonce2)
-		work->nonce2 = strdup(base_work->nonce2);
-	if (base_work->ntime)
-		work->ntime = strdup(base_work->ntime);
+	/* Shares the job strings, nonce2 and ntime are copied with the struct */
+	if (base_work->job)
+		ref_work_job(base_work->job);
 	if (base_work->gbt_coinbase)
 		work->gbt_coinbase = strdup(base_work->gbt_coinbase);
 }
@@ -3260,18 +3677,37 @@ static struct work *make_clone(struct work *work)
 	return work_clone;
 }
 
+/* Hands out the last version rolled variant the master still covers as a
+ * clone of its own. The midstate of it is known already */
+static struct work *make_vclone(struct work *work)
+{
+	struct work *work_clone = make_clone(work);
+
+	work->vmidstates--;
+	set_work_version(work_clone, work->vmidstates);
+	work_clone->vversions = work_clone->vmidstates = 0;
+	local_work++;
+	applog(LOG_DEBUG, "Cloned version %08x of work", work->vversion[work->vmidstates]);
+
+	return work_clone;
+}
+
 static void stage_work(struct work *work);
 
 static bool clone_available(void)
 {
-	struct work *work_clone = NULL, *work, *tmp;
+	struct work *work_clone = NULL, *work;
 	bool cloned = false;
+	int i;
 
-	mutex_lock(stgd_lock);
-	if (!staged_rollable)
-		goto out_unlock;
-
-	HASH_ITER(hh, staged_work, work, tmp) {
+	lock_staged();
+	for (i = 0; i < staged_masters.count; i++) {
+		work = staged_masters.works[i];
+		if (work->vmidstates > 1 && !stale_work(work, false)) {
+			work_clone = make_vclone(work);
+			cloned = true;
+			break;
+		}
 		if (can_roll(work) && should_roll(work)) {
 			roll_work(work);
 			work_clone = make_clone(work);
@@ -3280,8 +3716,6 @@ static bool clone_available(void)
 			break;
 		}
 	}
-
-out_unlock:
 	mutex_unlock(stgd_lock);
 
 	if (cloned) {
@@ -3434,6 +3868,28 @@ static void rebuild_hash(struct work *work)
 
 static bool cnx_needed(struct pool *pool);
 
+#ifndef HAVE_SYS_EPOLL_H
+static bool submit_upstream_work(struct work *work, CURL *curl, bool resubmit)
+{
+	struct pool *pool = work->pool;
+	struct timeval tv_submit, tv_submit_reply;
+	char *s = submit_upstream_req(work);
+	json_t *val;
+	int rolltime;
+	bool rc;
+
+	cgtime(&tv_submit);
+	/* issue JSON-RPC request */
+	val = json_rpc_call(curl, pool->rpc_url, pool->rpc_userpass, s, false, false, &rolltime, pool, true);
+	cgtime(&tv_submit_reply);
+	free(s);
+
+	rc = submit_upstream_result(work, val, resubmit, &tv_submit, &tv_submit_reply);
+	if (!val && !opt_lowmem)
+		nmsleep(5000);
+	return rc;
+}
+
 static void *submit_work_thread(void *userdata)
 {
 	struct work *work = (struct work *)userdata;
@@ -3442,6 +3898,7 @@ static void *submit_work_thread(void *userdata)
 	struct curl_ent *ce;
 
 	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 
 	RenameThread("submit_work");
 
@@ -3474,8 +3931,10 @@ static void *submit_work_thread(void *userdata)
 	}
 	push_curl_entry(ce, pool);
 
+	__atomic_sub_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 	return NULL;
 }
+#endif
 
 /* Find the pool that currently has the highest priority */
 static struct pool *priority_pool(int choice)
@@ -3511,6 +3970,26 @@ static bool pool_unusable(struct pool *pool)
 	return false;
 }
 
+/* Hot standby pools are the first opt_standby_pools usable stratum pools in
+ * priority order other than cp. They stay connected, authorised and
+ * compiling each notify into their template, but no work is queued from
+ * them until they become the current pool. */
+static bool pool_standby(struct pool *pool, struct pool *cp)
+{
+	int i, standby = 0;
+
+	for (i = 0; i < total_pools && standby < opt_standby_pools; i++) {
+		struct pool *p = priority_pool(i);
+
+		if (p == cp || !p->has_stratum || pool_unusable(p))
+			continue;
+		if (p == pool)
+			return true;
+		standby++;
+	}
+	return false;
+}
+
 void switch_pools(struct pool *selected)
 {
 	struct pool *pool, *last_pool;
@@ -3583,12 +4062,25 @@ void switch_pools(struct pool *selected)
 		applog(LOG_WARNING, "Switching to pool %d %s", pool->pool_no, pool->rpc_url);
 		if (pool_localgen(pool) || opt_fail_only)
 			clear_pool_work(last_pool);
+
+		/* Failing over, work comes from the standby connection right
+		 * away instead of after connecting, subscribing and
+		 * authorising */
+		if (pool_unusable(last_pool) && pool->stratum_active &&
+		    pool_standby(pool, last_pool)) {
+			struct cgminer_pool_stats *pool_stats = &pool->cgminer_pool_stats;
+
+			pool_stats->standby_failovers++;
+			pool_stats->standby_saved += pool_stats->cnx_setup;
+			applog(LOG_INFO, "Pool %d was on standby, saved %.3fs of connecting",
+			       pool->pool_no, pool_stats->cnx_setup);
+		}
 	}
 
 	mutex_lock(&lp_lock);
 	pthread_cond_broadcast(&lp_cond);
 	mutex_unlock(&lp_lock);
-
+	net_wake();
 }
 
 void discard_work(struct work *work)
@@ -3605,24 +4097,28 @@ void discard_work(struct work *work)
 
 static void wake_gws(void)
 {
-	mutex_lock(stgd_lock);
+	lock_staged();
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 }
 
+static bool discard_if_stale(struct work *work, void __maybe_unused *arg)
+{
+	if (!stale_work(work, false))
+		return false;
+	discard_work(work);
+	return true;
+}
+
 static void discard_stale(void)
 {
-	struct work *work, *tmp;
-	int stale = 0;
+	int stale;
 
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (stale_work(work, false)) {
-			HASH_DEL(staged_work, work);
-			discard_work(work);
-			stale++;
-		}
-	}
+	stale = local_remove(discard_if_stale, NULL);
+
+	lock_staged();
+	stale += staged_heap_remove(&staged_clones, discard_if_stale, NULL);
+	stale += staged_heap_remove(&staged_masters, discard_if_stale, NULL);
 	pthread_cond_signal(&gws_cond);
 	mutex_unlock(stgd_lock);
 
@@ -3846,28 +4342,30 @@ out_free:
 	return ret;
 }
 
-static int tv_sort(struct work *worka, struct work *workb)
+static bool work_rollable(struct work *work)
 {
-	return worka->tv_staged.tv_sec - workb->tv_staged.tv_sec;
+	return (!work->clone && (work->rolltime ||
+		(work->stratum && (opt_stratum_roll || work->vversions))));
 }
 
-static bool work_rollable(struct work *work)
+/* Must be entered under stgd_lock */
+static bool __hash_push(struct work *work)
 {
-	return (!work->clone && work->rolltime);
+	if (unlikely(getq->frozen))
+		return false;
+	if (work_rollable(work))
+		staged_heap_push(&staged_masters, work);
+	else
+		staged_heap_push(&staged_clones, work);
+	return true;
 }
 
 static bool hash_push(struct work *work)
 {
-	bool rc = true;
+	bool rc;
 
-	mutex_lock(stgd_lock);
-	if (work_rollable(work))
-		staged_rollable++;
-	if (likely(!getq->frozen)) {
-		HASH_ADD_INT(staged_work, id, work);
-		HASH_SORT(staged_work, tv_sort);
-	} else
-		rc = false;
+	lock_staged();
+	rc = __hash_push(work);
 	pthread_cond_broadcast(&getq->cond);
 	mutex_unlock(stgd_lock);
 
@@ -3918,6 +4416,25 @@ static void stage_work(struct work *work)
 	hash_push(work);
 }
 
+/* Works of one batch share prevhash, so only the first is tested for a new
+ * block, and the batch is staged under one stgd_lock */
+static void stage_works(struct work **works, int n)
+{
+	int i;
+
+	applog(LOG_DEBUG, "Pushing %d works from pool %d to hash queue", n, works[0]->pool->pool_no);
+	works[0]->work_block = work_block;
+	test_work_current(works[0]);
+
+	lock_staged();
+	for (i = 0; i < n; i++) {
+		works[i]->work_block = works[0]->work_block;
+		__hash_push(works[i]);
+	}
+	pthread_cond_broadcast(&getq->cond);
+	mutex_unlock(stgd_lock);
+}
+
 #ifdef HAVE_CURSES
 int curses_int(const char *query)
 {
@@ -4848,6 +5365,21 @@ static void stratum_share_result(json_t *val, json_t *res_val, json_t *err_val,
 	share_result(val, res_val, err_val, work, hashshow, false, "");
 }
 
+/* Accepted shares are nearly all the responses, stratum_scan finds their id
+ * without building a json value */
+static bool scan_accepted(char *s, int *id)
+{
+	struct stratum_scan sc;
+	char *end;
+
+	if (!stratum_scan(&sc, s) || sc.method.s || !sc.id.s || sc.id.str ||
+	    sc.result.str || !stratum_tok_is(&sc.result, "true") ||
+	    (sc.error.s && !stratum_tok_is(&sc.error, "null")))
+		return false;
+	*id = strtol(sc.id.s, &end, 10);
+	return end == sc.id.s + sc.id.len;
+}
+
 /* Parses stratum json responses and tries to find the id that the request
  * matched to and treat it accordingly. */
 static bool parse_stratum_response(struct pool *pool, char *s)
@@ -4858,6 +5390,12 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 	bool ret = false;
 	int id;
 
+	if (scan_accepted(s, &id)) {
+		res_val = json_true();
+		err_val = json_null();
+		goto find;
+	}
+
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -4884,7 +5422,7 @@ static bool parse_stratum_response(struct pool *pool, char *s)
 	}
 
 	id = json_integer_value(id_val);
-
+find:
 	mutex_lock(&sshare_lock);
 	HASH_FIND_INT(stratum_shares, &id, sshare);
 	if (sshare) {
@@ -4965,19 +5503,21 @@ void clear_stratum_shares(struct pool *pool)
 	}
 }
 
+static bool free_if_pool(struct work *work, void *pool)
+{
+	if (work->pool != pool)
+		return false;
+	free_work(work);
+	return true;
+}
+
 static void clear_pool_work(struct pool *pool)
 {
-	struct work *work, *tmp;
-	int cleared = 0;
+	local_remove(free_if_pool, pool);
 
-	mutex_lock(stgd_lock);
-	HASH_ITER(hh, staged_work, work, tmp) {
-		if (work->pool == pool) {
-			HASH_DEL(staged_work, work);
-			free_work(work);
-			cleared++;
-		}
-	}
+	lock_staged();
+	staged_heap_remove(&staged_clones, free_if_pool, pool);
+	staged_heap_remove(&staged_masters, free_if_pool, pool);
 	mutex_unlock(stgd_lock);
 }
 
@@ -5016,6 +5556,8 @@ static bool cnx_needed(struct pool *pool)
 	cp = current_pool();
 	if (cp == pool)
 		return true;
+	if (pool_standby(pool, cp))
+		return true;
 	if (!pool_localgen(cp) && (!opt_fail_only || !cp->hdr_path))
 		return true;
 	/* If we're waiting for a response from shares submitted, keep the
@@ -5032,7 +5574,10 @@ static bool cnx_needed(struct pool *pool)
 	return false;
 }
 
+#ifndef HAVE_SYS_EPOLL_H
 static void wait_lpcurrent(struct pool *pool);
+#endif
+static bool lp_waiting(struct pool *pool);
 static void pool_resus(struct pool *pool);
 static void gen_stratum_work(struct pool *pool, struct work *work);
 
@@ -5057,6 +5602,49 @@ static bool supports_resume(struct pool *pool)
 	return ret;
 }
 
+/* Bookkeeping for a stratum connection found dropped, before reconnecting */
+static void stratum_interrupted(struct pool *pool)
+{
+	applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
+	pool->getfail_occasions++;
+	total_go++;
+
+	/* If the socket to our stratum pool disconnects, all
+	 * tracked submitted shares are lost and we will leak
+	 * the memory if we don't discard their records. */
+	if (!supports_resume(pool) || opt_lowmem)
+		clear_stratum_shares(pool);
+	clear_pool_work(pool);
+	if (pool == current_pool())
+		restart_threads();
+}
+
+/* Handles a clean job flagged by a mining.notify just parsed */
+static void stratum_clean_job(struct pool *pool)
+{
+	struct work *work;
+
+	if (!pool->swork.clean)
+		return;
+
+	work = make_work();
+	/* Generate a single work item to update the current
+	 * block database */
+	pool->swork.clean = false;
+	gen_stratum_work(pool, work);
+	if (test_work_current(work)) {
+		/* Only accept a work restart if this stratum
+		 * connection is from the current pool */
+		if (pool == current_pool()) {
+			restart_threads();
+			applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
+		}
+	} else
+		applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
+	free_work(work);
+}
+
+#ifndef HAVE_SYS_EPOLL_H
 /* One stratum receive thread per pool that has stratum waits on the socket
  * checking for new messages and for the integrity of the socket connection. We
  * reset the connection based on the integrity of the receive side only as the
@@ -5067,6 +5655,7 @@ static void *stratum_rthread(void *userdata)
 	char threadname[16];
 
 	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 
 	snprintf(threadname, 16, "StratumR/%d", pool->pool_no);
 	RenameThread(threadname);
@@ -5113,19 +5702,9 @@ static void *stratum_rthread(void *userdata)
 			s = NULL;
 		} else
 			s = recv_line(pool);
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
 		if (!s) {
-			applog(LOG_NOTICE, "Stratum connection to pool %d interrupted", pool->pool_no);
-			pool->getfail_occasions++;
-			total_go++;
-
-			/* If the socket to our stratum pool disconnects, all
-			 * tracked submitted shares are lost and we will leak
-			 * the memory if we don't discard their records. */
-			if (!supports_resume(pool) || opt_lowmem)
-				clear_stratum_shares(pool);
-			clear_pool_work(pool);
-			if (pool == current_pool())
-				restart_threads();
+			stratum_interrupted(pool);
 
 			if (restart_stratum(pool))
 				continue;
@@ -5146,31 +5725,152 @@ static void *stratum_rthread(void *userdata)
 
 		if (!parse_method(pool, s) && !parse_stratum_response(pool, s))
 			applog(LOG_INFO, "Unknown stratum msg: %s", s);
-		free(s);
-		if (pool->swork.clean) {
-			struct work *work = make_work();
-
-			/* Generate a single work item to update the current
-			 * block database */
-			pool->swork.clean = false;
-			gen_stratum_work(pool, work);
-			if (test_work_current(work)) {
-				/* Only accept a work restart if this stratum
-				 * connection is from the current pool */
-				if (pool == current_pool()) {
-					restart_threads();
-					applog(LOG_NOTICE, "Stratum from pool %d requested work restart", pool->pool_no);
-				}
-			} else
-				applog(LOG_NOTICE, "Stratum from pool %d detected new block", pool->pool_no);
-			free_work(work);
-		}
+		stratum_clean_job(pool);
 	}
 
 out:
+	__atomic_sub_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 	return NULL;
 }
+#endif
+
+/* Writes the mining.submit message of a share to s */
+static void stratum_share_msg(struct pool *pool, struct stratum_share *sshare, char *s)
+{
+	struct work *work = sshare->work;
+	uint32_t nonce;
+	char *noncehex;
+
+	nonce = *((uint32_t *)(work->data + 76));
+	noncehex = bin2hex((const unsigned char *)&nonce, 4);
+	memset(s, 0, 1024);
+
+	if (work->version_mask) {
+		/* BIP310 submit carries the rolled version bits */
+		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\", \"%08x\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex,
+			be32toh(*(uint32_t *)work->data) & work->version_mask, sshare->id);
+	} else {
+		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
+			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, sshare->id);
+	}
+	free(noncehex);
+}
+
+/* Makes the share record of work */
+static struct stratum_share *new_stratum_share(struct pool *pool, struct work *work)
+{
+	struct stratum_share *sshare;
+	uint32_t *hash32;
+
+	sshare = safe_calloc(sizeof(struct stratum_share), 1, "share in new_stratum_share");
+	hash32 = (uint32_t *)work->hash;
+
+	sshare->sshare_time = time(NULL);
+	/* This work item is freed in parse_stratum_response */
+	sshare->work = work;
+
+	mutex_lock(&sshare_lock);
+	/* Give the stratum share a unique id */
+	sshare->id = swork_id++;
+	mutex_unlock(&sshare_lock);
+
+	applog(LOG_INFO, "Submitting share %08lx to pool %d",
+				(long unsigned int)htole32(hash32[6]), pool->pool_no);
+
+	return sshare;
+}
+
+/* Most shares coalesced into one write */
+#define SUBMIT_BATCH 16
+
+/* Decides the fate of a share that failed to send. It is retried every 5
+ * seconds for up to 2 minutes, as long as the pool nonce1 still matches
+ * suggesting we may be able to resume, and dropped otherwise. */
+static bool retry_stratum_share(struct pool *pool, struct stratum_share *sshare)
+{
+	struct work *work = sshare->work;
+	bool sessionid_match;
+
+	if (opt_lowmem) {
+		applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
+		goto drop;
+	}
+
+	cg_rlock(&pool->data_lock);
+	sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
+	cg_runlock(&pool->data_lock);
 
+	if (!sessionid_match) {
+		applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+		goto drop;
+	}
+	if (time(NULL) + 5 < sshare->sshare_time + 120)
+		return true;
+drop:
+	applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
+	free_work(work);
+	cfree(sshare);
+	pool->stale_shares++;
+	total_stale++;
+	return false;
+}
+
+/* Sends a chain of shares, up to SUBMIT_BATCH of them per write. Sent shares
+ * go to the stratum_shares db to wait for the pool's response. Once a write
+ * fails the rest of the chain is not tried, returns the shares to retry. */
+static struct stratum_share *submit_stratum_shares(struct pool *pool, struct stratum_share *sshare)
+{
+	struct stratum_share *retry = NULL, **rtail = &retry;
+	char buf[SUBMIT_BATCH * 1024];
+
+	while (sshare) {
+		struct stratum_share *next, *batch = sshare;
+		int count = 0;
+		size_t len = 0;
+
+		/* Each message is under 1024 bytes with its \n */
+		do {
+			stratum_share_msg(pool, sshare, buf + len);
+			len += strlen(buf + len);
+			buf[len++] = '\n';
+			sshare = sshare->next;
+		} while (sshare && ++count < SUBMIT_BATCH);
+
+		if (likely(stratum_send_lines(pool, buf, len))) {
+			if (pool_tclear(pool, &pool->submit_fail))
+					applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+
+			mutex_lock(&sshare_lock);
+			for (; batch != sshare; batch = next) {
+				next = batch->next;
+				HASH_ADD_INT(stratum_shares, id, batch);
+				pool->sshares++;
+			}
+			mutex_unlock(&sshare_lock);
+
+			applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
+			continue;
+		}
+		if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
+			applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
+			total_ro++;
+			pool->remotefail_occasions++;
+		}
+
+		for (sshare = batch; sshare; sshare = next) {
+			next = sshare->next;
+			if (retry_stratum_share(pool, sshare)) {
+				*rtail = sshare;
+				rtail = &sshare->next;
+			}
+		}
+	}
+	*rtail = NULL;
+	return retry;
+}
+
+#ifndef HAVE_SYS_EPOLL_H
 /* Each pool has one stratum send thread for sending shares to avoid many
  * threads being created for submission since all sends need to be serialised
  * anyway. */
@@ -5180,6 +5880,7 @@ static void *stratum_sthread(void *userdata)
 	char threadname[16];
 
 	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 
 	snprintf(threadname, 16, "StratumS/%d", pool->pool_no);
 	RenameThread(threadname);
@@ -5189,12 +5890,11 @@ static void *stratum_sthread(void *userdata)
 		quit(1, "Failed to create stratum_q in stratum_sthread");
 
 	while (42) {
-		struct stratum_share *sshare;
-		uint32_t *hash32, nonce;
+		struct stratum_share *sshare, **tail = &sshare;
+		struct timeval now, then, tdiff;
+		struct timespec abstime;
 		struct work *work;
-		bool submitted;
-		char *noncehex;
-		char s[1024];
+		int count = 0;
 
 		if (unlikely(pool->removed))
 			break;
@@ -5202,97 +5902,931 @@ static void *stratum_sthread(void *userdata)
 		work = tq_pop(pool->stratum_q, NULL);
 		if (unlikely(!work))
 			quit(1, "Stratum q returned empty work");
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
+
+		/* Gather what else is queued or arrives within
+		 * opt_stratum_submit microseconds into the same write */
+		tdiff.tv_sec = 0;
+		tdiff.tv_usec = opt_stratum_submit;
+		cgtime(&now);
+		timeradd(&now, &tdiff, &then);
+		abstime.tv_sec = then.tv_sec;
+		abstime.tv_nsec = then.tv_usec * 1000;
+		do {
+			*tail = new_stratum_share(pool, work);
+			tail = &(*tail)->next;
+		} while (++count < SUBMIT_BATCH && (work = tq_pop(pool->stratum_q, &abstime)));
+		*tail = NULL;
+
+		while ((sshare = submit_stratum_shares(pool, sshare)))
+			sleep(5);
+	}
 
-        sshare = safe_calloc(sizeof(struct stratum_share), 1, "share in stratum_sthread");
-		hash32 = (uint32_t *)work->hash;
-		submitted = false;
+	/* Freeze the work queue but don't free up its memory in case there is
+	 * work still trying to be submitted to the removed pool. */
+	tq_freeze(pool->stratum_q);
 
-		sshare->sshare_time = time(NULL);
-		/* This work item is freed in parse_stratum_response */
-		sshare->work = work;
-		nonce = *((uint32_t *)(work->data + 76));
-		noncehex = bin2hex((const unsigned char *)&nonce, 4);
-		memset(s, 0, 1024);
+	__atomic_sub_fetch(&net_threads, 1, __ATOMIC_RELAXED);
+	return NULL;
+}
 
-		mutex_lock(&sshare_lock);
-		/* Give the stratum share a unique id */
-		sshare->id = swork_id++;
-		mutex_unlock(&sshare_lock);
+static void init_stratum_threads(struct pool *pool)
+{
+	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
+		quit(1, "Failed to create stratum sthread");
+	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
+		quit(1, "Failed to create stratum rthread");
+}
 
-		sprintf(s, "{\"params\": [\"%s\", \"%s\", \"%s\", \"%s\", \"%s\"], \"id\": %d, \"method\": \"mining.submit\"}",
-			pool->rpc_user, work->job_id, work->nonce2, work->ntime, noncehex, sshare->id);
-		free(noncehex);
+static void net_wake(void)
+{
+}
 
-		applog(LOG_INFO, "Submitting share %08lx to pool %d",
-					(long unsigned int)htole32(hash32[6]), pool->pool_no);
+static void *longpoll_thread(void *userdata);
 
-		/* Try resubmitting for up to 2 minutes if we fail to submit
-		 * once and the stratum pool nonce1 still matches suggesting
-		 * we may be able to resume. */
-		while (time(NULL) < sshare->sshare_time + 120) {
-			bool sessionid_match;
+static void start_longpoll(struct pool *pool)
+{
+	if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
+		quit(1, "Failed to create pool longpoll thread");
+}
 
-			if (likely(stratum_send(pool, s, strlen(s)))) {
-				if (pool_tclear(pool, &pool->submit_fail))
-						applog(LOG_WARNING, "Pool %d communication resumed, submitting work", pool->pool_no);
+/* Getwork and GBT shares are each submitted by a thread of their own */
+static void submit_http_work(struct work *work)
+{
+	pthread_t submit_thread;
 
-				mutex_lock(&sshare_lock);
-				HASH_ADD_INT(stratum_shares, id, sshare);
-				pool->sshares++;
-				mutex_unlock(&sshare_lock);
+	if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
+		quit(1, "Failed to create submit_work_thread");
+}
+#else
+/* Instead of a receive and a send thread per stratum pool, one network
+ * reactor thread owns the connections of all of them. It waits on their
+ * sockets with epoll, splits what they receive into lines, sends the shares
+ * queued in each pool's stratum_q and keeps the receive timeouts. It never
+ * waits on a socket, what one doesn't take at once stays in the pool's
+ * net_out until EPOLLOUT. The lines go through net_parse_q to a parse
+ * thread, which takes in new jobs, restarts work and counts share results,
+ * so none of that holds up the sockets of the other pools. Connecting and
+ * authorising block, so they are left to NET_CONNECTORS connect threads,
+ * which take the current pool first, then the hot standby pools, then the
+ * rest in priority order, one of them kept for the current pool alone. A
+ * pool that fails to connect goes back to the reactor to be retried 30
+ * seconds later. pool->net_state tells which thread owns a pool's
+ * connection at any time. */
+#define NET_EVENTS 16
+#define NET_CONNECTORS 4
+
+static int net_epfd = -1, net_wakefd = -1;
+static struct pool *net_connect_list;
+static pthread_mutex_t net_connect_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t net_connect_cond = PTHREAD_COND_INITIALIZER;
+static int net_connect_idle;
+static struct thread_q *net_parse_q;
+static const struct timespec tq_nowait;
+
+/* A line received, for the parse thread. The lines of one read go to it
+ * together, as a list. */
+struct net_line {
+	struct net_line *next;
+	struct pool *pool;
+	unsigned int gen;		/* sock_gen it was read from */
+	char s[];
+};
 
-				applog(LOG_DEBUG, "Successfully submitted, adding to stratum_shares db");
-				submitted = true;
-				break;
-			}
-			if (!pool_tset(pool, &pool->submit_fail) && cnx_needed(pool)) {
-				applog(LOG_WARNING, "Pool %d stratum share submission failure", pool->pool_no);
-				total_ro++;
-				pool->remotefail_occasions++;
-			}
+/* Gets the reactor to look at the pools again, for shares queued and for
+ * pools whose connection may be needed now */
+static void net_wake(void)
+{
+	uint64_t one = 1;
 
-			if (opt_lowmem) {
-				applog(LOG_DEBUG, "Lowmem option prevents resubmitting stratum share");
-				break;
+	if (net_wakefd >= 0 && write(net_wakefd, &one, sizeof(one)) < 0)
+		applog(LOG_DEBUG, "Failed to wake network reactor");
+}
+
+/* Called by a connect thread for a pool just connected and authorised */
+static void net_add(struct pool *pool)
+{
+	struct epoll_event ev;
+
+	ev.events = EPOLLIN;
+	ev.data.ptr = pool;
+	pool->net_gen = pool->sock_gen;
+	pool->net_deadline = time(NULL) + 90;
+	pool->net_pollout = false;
+	if (unlikely(epoll_ctl(net_epfd, EPOLL_CTL_ADD, pool->sock, &ev)))
+		applog(LOG_ERR, "Failed to add pool %d sock to epoll", pool->pool_no);
+	__atomic_store_n(&pool->net_state, NET_LIVE, __ATOMIC_RELEASE);
+	net_wake();
+}
+
+/* Closes a live connection. A sock closed already by a failed send left
+ * the epoll set by itself, and its fd may belong to another pool by now, so
+ * only the registered and still open sock is removed */
+static void net_close(struct pool *pool)
+{
+	if (pool->sock && pool->sock_gen == pool->net_gen)
+		epoll_ctl(net_epfd, EPOLL_CTL_DEL, pool->sock, NULL);
+	suspend_stratum(pool);
+}
+
+static void net_connect(struct pool *pool)
+{
+	__atomic_store_n(&pool->net_state, NET_CONNECT, __ATOMIC_RELEASE);
+	mutex_lock(&net_connect_lock);
+	if (!pool->net_queued) {
+		pool->net_queued = true;
+		pool->net_connect_next = net_connect_list;
+		net_connect_list = pool;
+	}
+	pthread_cond_signal(&net_connect_cond);
+	mutex_unlock(&net_connect_lock);
+}
+
+/* The pool a connect thread takes next: the current pool, then hot standby
+ * pools, then the rest by priority. Connecting to a pool that doesn't answer
+ * can take a minute, so one connect thread is always left idle for the
+ * current pool. Waits recheck once a second, the current pool may change
+ * while queued. */
+static struct pool *net_connect_next(void)
+{
+	struct pool *pool, **pp, **best;
+	int rank, best_rank;
+	struct pool *cp;
+
+	mutex_lock(&net_connect_lock);
+	net_connect_idle++;
+	while (42) {
+		struct timeval now, then, tdiff = {1, 0};
+		struct timespec abstime;
+
+		best = NULL;
+		best_rank = 0;
+		cp = current_pool();
+		for (pp = &net_connect_list; (pool = *pp); pp = &pool->net_connect_next) {
+			if (pool == cp)
+				rank = -1;
+			else if (pool_standby(pool, cp))
+				rank = 0;
+			else
+				rank = 1 + pool->prio;
+			if (!best || rank < best_rank) {
+				best = pp;
+				best_rank = rank;
 			}
+		}
+		if (best && (best_rank < 0 || net_connect_idle > 1))
+			break;
+
+		cgtime(&now);
+		timeradd(&now, &tdiff, &then);
+		abstime.tv_sec = then.tv_sec;
+		abstime.tv_nsec = then.tv_usec * 1000;
+		pthread_cond_timedwait(&net_connect_cond, &net_connect_lock, &abstime);
+	}
+	pool = *best;
+	*best = pool->net_connect_next;
+	pool->net_queued = false;
+	net_connect_idle--;
+	mutex_unlock(&net_connect_lock);
+
+	return pool;
+}
+
+/* Watches for room to write while the pool's net_out holds anything */
+static void net_want_out(struct pool *pool)
+{
+	bool want = pool->net_out_len > 0;
+	struct epoll_event ev;
+
+	if (want == pool->net_pollout || !pool->sock || pool->sock_gen != pool->net_gen)
+		return;
+	ev.events = want ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	ev.data.ptr = pool;
+	if (likely(!epoll_ctl(net_epfd, EPOLL_CTL_MOD, pool->sock, &ev)))
+		pool->net_pollout = want;
+}
+
+static void net_interrupted(struct pool *pool)
+{
+	net_close(pool);
+	stratum_interrupted(pool);
+	net_connect(pool);
+}
+
+/* Hands the complete lines in the pool sockbuf to the parse thread */
+static void net_lines(struct pool *pool)
+{
+	struct net_line *lines = NULL, **tail = &lines;
+	size_t len;
+	char *s;
+
+	while ((s = read_line(pool))) {
+		len = strlen(s) + 1;
+		*tail = malloc(sizeof(**tail) + len);
+		if (unlikely(!*tail))
+			quit(1, "Failed to malloc line in net_lines");
+		(*tail)->pool = pool;
+		(*tail)->gen = pool->net_gen;
+		memcpy((*tail)->s, s, len);
+		tail = &(*tail)->next;
+	}
+	*tail = NULL;
+	if (lines)
+		tq_push(net_parse_q, lines);
+}
+
+static void net_read(struct pool *pool, time_t now)
+{
+	if (unlikely(pool->removed)) {
+		net_close(pool);
+		tq_freeze(pool->stratum_q);
+		__atomic_store_n(&pool->net_state, NET_PARKED, __ATOMIC_RELEASE);
+		return;
+	}
+	if (!recv_sock(pool)) {
+		net_interrupted(pool);
+		return;
+	}
+	pool->net_deadline = now + 90;
+	net_lines(pool);
+}
+
+static void net_write(struct pool *pool)
+{
+	if (!stratum_flush(pool)) {
+		net_interrupted(pool);
+		return;
+	}
+	net_want_out(pool);
+}
+
+/* Collects the shares queued for the pool and sends them once SUBMIT_BATCH
+ * are waiting or opt_stratum_submit microseconds after the first arrived.
+ * Shares that failed to send go out again 5 seconds later, with any queued
+ * since. Returns the ms until the next send, -1 with nothing waiting. */
+static int net_submit(struct pool *pool, struct timeval *now)
+{
+	struct stratum_share *sshare, **tail = &pool->net_sshare;
+	struct work *work;
+	int count = 0;
+
+	/* Shares wait in stratum_q until net_add, a connect thread may still
+	 * be authorising the sock and take a share's reply for its own */
+	if (__atomic_load_n(&pool->net_state, __ATOMIC_ACQUIRE) != NET_LIVE ||
+	    pool->sock_gen != pool->net_gen)
+		return -1;
 
-			cg_rlock(&pool->data_lock);
-			sessionid_match = (pool->nonce1 && !strcmp(work->nonce1, pool->nonce1));
-			cg_runlock(&pool->data_lock);
+	for (sshare = pool->net_sshare; sshare; sshare = sshare->next) {
+		tail = &sshare->next;
+		count++;
+	}
+	while ((work = tq_pop(pool->stratum_q, &tq_nowait))) {
+		if (!pool->net_sshare) {
+			struct timeval tdiff = {0, opt_stratum_submit};
 
-			if (!sessionid_match) {
-				applog(LOG_DEBUG, "No matching session id for resubmitting stratum share");
+			timeradd(now, &tdiff, &pool->net_flush);
+		}
+		*tail = new_stratum_share(pool, work);
+		tail = &(*tail)->next;
+		count++;
+	}
+	if (!pool->net_sshare)
+		return -1;
+
+	/* Don't let a full batch cut short the wait to resend */
+	if ((count < SUBMIT_BATCH || pool->submit_fail) && time_less(now, &pool->net_flush))
+		return (us_tdiff(&pool->net_flush, now) + 999) / 1000;
+
+	pool->net_sshare = submit_stratum_shares(pool, pool->net_sshare);
+	if (!pool->net_sshare)
+		return -1;
+	copy_time(&pool->net_flush, now);
+	pool->net_flush.tv_sec += 5;
+	return 5000;
+}
+
+/* Walks the pools for everything due, returns the ms until the next
+ * deadline */
+static int net_pools(struct timeval *tv_now)
+{
+	time_t now = tv_now->tv_sec, next = now + 90;
+	int i, flush = -1;
+
+	for (i = 0; i < total_pools; i++) {
+		struct pool *pool = pools[i];
+		int ms;
+
+		if (!pool->has_stratum || !pool->stratum_q)
+			continue;
+
+		ms = net_submit(pool, tv_now);
+		if (ms >= 0 && (flush < 0 || ms < flush))
+			flush = ms;
+
+		switch (__atomic_load_n(&pool->net_state, __ATOMIC_ACQUIRE)) {
+			case NET_LIVE:
+				/* Closed by a failed send */
+				if (!pool->stratum_active) {
+					net_interrupted(pool);
+					break;
+				}
+				/* A client.reconnect only took the new
+				 * address, connecting to it is left to the
+				 * connect threads */
+				if (unlikely(pool->net_reconnect)) {
+					pool->net_reconnect = false;
+					net_close(pool);
+					net_connect(pool);
+					break;
+				}
+				/* Lines received along with the replies read
+				 * while connecting */
+				if (pool->sockbuf_scan < pool->sockbuf_tail)
+					net_lines(pool);
+				/* Check to see whether we need to maintain
+				 * this connection indefinitely or just bring
+				 * it up when we switch to this pool */
+				if (pool->sockbuf_tail == pool->sockbuf_head && !cnx_needed(pool)) {
+					net_close(pool);
+					clear_stratum_shares(pool);
+					clear_pool_work(pool);
+					__atomic_store_n(&pool->net_state, NET_PARKED, __ATOMIC_RELEASE);
+					break;
+				}
+				/* The protocol specifies that notify messages
+				 * should be sent every minute so if we fail to
+				 * receive any for 90 seconds we assume the
+				 * connection has been dropped */
+				if (now >= pool->net_deadline) {
+					applog(LOG_DEBUG, "Stratum timed out on pool %d", pool->pool_no);
+					net_interrupted(pool);
+					break;
+				}
+				/* Shares and replies written since */
+				net_want_out(pool);
+				if (pool->net_deadline < next)
+					next = pool->net_deadline;
+				break;
+			case NET_PARKED:
+				if (!pool->removed && (cnx_needed(pool) || !lp_waiting(pool)))
+					net_connect(pool);
+				break;
+			case NET_RETRY:
+				if (now >= pool->net_deadline)
+					net_connect(pool);
+				else if (pool->net_deadline < next)
+					next = pool->net_deadline;
 				break;
+			case NET_CONNECT:
+				break;
+		}
+	}
+	if (flush >= 0 && flush < (next - now) * 1000)
+		return flush;
+	return (next - now) * 1000;
+}
+
+/* Getwork and GBT pools are served by the reactor too. Their longpolls and
+ * share submits are transfers of one curl multi handle, whose sockets sit in
+ * a second epoll set, net_curl_epfd, itself watched in net_epfd. Only the
+ * reactor touches the multi handle, other threads hand shares over through
+ * net_http_q and pools to longpoll for through net_lp_q. */
+struct net_longpoll;
+
+struct net_http {
+	CURL *curl;
+	struct rpc_call *call;
+	struct pool *pool;
+	struct timeval tv_start;
+	void (*done)(struct net_http *http, json_t *val, int rolltime);
+
+	/* share submit */
+	struct work *work;
+	char *req;
+	bool resubmit;
+	struct timeval due;		/* retry of a failed submit */
+	struct net_http *next;
+
+	/* longpoll */
+	struct net_longpoll *lp;
+};
+
+/* Longpoll for pool cp, taken from the pool select_longpoll_pool finds */
+struct net_longpoll {
+	struct pool *cp;
+	struct pool *pool;
+	char *url;
+	char req[1024];
+	bool busy;			/* request in flight */
+	int failures;
+	time_t due;			/* next request, or next look for a pool */
+	struct net_longpoll *next;
+};
+
+static CURLM *net_curlm;
+static int net_curl_epfd = -1;
+static struct timeval net_curl_due;	/* curl timeout, none while tv_sec is 0 */
+static struct thread_q *net_http_q, *net_lp_q;
+static struct net_http *net_retries;
+static struct net_longpoll *net_lps;
+
+static void convert_to_work(json_t *val, int rolltime, struct pool *pool, struct timeval *tv_lp, struct timeval *tv_lp_reply);
+static struct pool *select_longpoll_pool(struct pool *cp);
+
+/* curl tells which of its sockets to watch for what */
+static int net_curl_socket(CURL __maybe_unused *easy, curl_socket_t s, int what,
+			   void __maybe_unused *userp, void __maybe_unused *socketp)
+{
+	struct epoll_event ev;
+
+	if (what == CURL_POLL_REMOVE) {
+		epoll_ctl(net_curl_epfd, EPOLL_CTL_DEL, s, NULL);
+		return 0;
+	}
+	ev.events = 0;
+	if (what & CURL_POLL_IN)
+		ev.events |= EPOLLIN;
+	if (what & CURL_POLL_OUT)
+		ev.events |= EPOLLOUT;
+	ev.data.fd = s;
+	if (epoll_ctl(net_curl_epfd, EPOLL_CTL_ADD, s, &ev) && errno == EEXIST)
+		epoll_ctl(net_curl_epfd, EPOLL_CTL_MOD, s, &ev);
+	return 0;
+}
+
+static int net_curl_timer(CURLM __maybe_unused *multi, long timeout_ms, void __maybe_unused *userp)
+{
+	struct timeval now, tdiff = {timeout_ms / 1000, timeout_ms % 1000 * 1000};
+
+	if (timeout_ms < 0) {
+		net_curl_due.tv_sec = 0;
+		return 0;
+	}
+	cgtime(&now);
+	timeradd(&now, &tdiff, &net_curl_due);
+	return 0;
+}
+
+/* Lets curl act on a socket, or on its timeout, and hands every transfer
+ * finished to its owner */
+static void net_curl_action(curl_socket_t s, int flags)
+{
+	CURLMsg *msg;
+	int left;
+
+	curl_multi_socket_action(net_curlm, s, flags, &left);
+	while ((msg = curl_multi_info_read(net_curlm, &left))) {
+		struct net_http *http;
+		int rc, rolltime = 0;
+		json_t *val;
+
+		if (msg->msg != CURLMSG_DONE)
+			continue;
+		rc = msg->data.result;
+		curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&http);
+		curl_multi_remove_handle(net_curlm, http->curl);
+		val = json_rpc_finish(http->call, http->curl, rc, &rolltime);
+		curl_easy_cleanup(http->curl);
+		http->done(http, val, rolltime);
+	}
+}
+
+static void net_curl_events(void)
+{
+	struct epoll_event ev[NET_EVENTS];
+	int n, i;
+
+	n = epoll_wait(net_curl_epfd, ev, NET_EVENTS, 0);
+	for (i = 0; i < n; i++) {
+		int flags = 0;
+
+		if (ev[i].events & (EPOLLIN | EPOLLHUP))
+			flags |= CURL_CSELECT_IN;
+		if (ev[i].events & EPOLLOUT)
+			flags |= CURL_CSELECT_OUT;
+		if (ev[i].events & EPOLLERR)
+			flags |= CURL_CSELECT_ERR;
+		net_curl_action(ev[i].data.fd, flags);
+	}
+}
+
+static void net_http_start(struct net_http *http, const char *url, const char *req, bool longpoll)
+{
+	struct pool *pool = http->pool;
+
+	http->curl = curl_easy_init();
+	if (unlikely(!http->curl))
+		quit(1, "CURL initialisation failed");
+	/* Longpoll connections can be persistent for a very long time
+	 * and any number of issues could have come up in the meantime
+	 * so always establish a fresh connection instead of relying on
+	 * a persistent one. */
+	if (longpoll)
+		curl_easy_setopt(http->curl, CURLOPT_FRESH_CONNECT, 1);
+	http->call = json_rpc_start(http->curl, url, pool->rpc_userpass, req, longpoll, pool, !longpoll);
+	curl_easy_setopt(http->curl, CURLOPT_PRIVATE, (char *)http);
+	cgtime(&http->tv_start);
+	curl_multi_add_handle(net_curlm, http->curl);
+}
+
+static void net_submit_done(struct net_http *http, json_t *val, int __maybe_unused rolltime)
+{
+	struct work *work = http->work;
+	struct pool *pool = http->pool;
+	struct timeval reply;
+
+	cgtime(&reply);
+	if (submit_upstream_result(work, val, http->resubmit, &http->tv_start, &reply))
+		goto out;
+	if (opt_lowmem) {
+		applog(LOG_NOTICE, "Pool %d share being discarded to minimise memory cache", pool->pool_no);
+		goto out;
+	}
+	http->resubmit = true;
+	if (stale_work(work, true)) {
+		applog(LOG_NOTICE, "Pool %d share became stale while retrying submit, discarding", pool->pool_no);
+
+		mutex_lock(&stats_lock);
+		total_stale++;
+		pool->stale_shares++;
+		total_diff_stale += work->work_difficulty;
+		pool->diff_stale += work->work_difficulty;
+		mutex_unlock(&stats_lock);
+		goto out;
+	}
+
+	/* pause, then submit again */
+	applog(LOG_INFO, "json_rpc_call failed on submit_work, retrying");
+	copy_time(&http->due, &reply);
+	http->due.tv_sec += 5;
+	http->next = net_retries;
+	net_retries = http;
+	return;
+out:
+	free_work(work);
+	free(http->req);
+	free(http);
+}
+
+/* Getwork and GBT shares are submitted by the reactor as well */
+static void submit_http_work(struct work *work)
+{
+	struct net_http *http = calloc(1, sizeof(*http));
+
+	if (unlikely(!http))
+		quit(1, "Failed to calloc net_http in submit_http_work");
+	http->work = work;
+	http->pool = work->pool;
+	http->req = submit_upstream_req(work);
+	http->done = net_submit_done;
+	tq_push(net_http_q, http);
+	net_wake();
+}
+
+static void net_longpoll_done(struct net_http *http, json_t *val, int rolltime)
+{
+	struct net_longpoll *lp = http->lp;
+	struct pool *pool = http->pool;
+	struct timeval reply;
+
+	cgtime(&reply);
+	lp->busy = false;
+	lp->due = reply.tv_sec;
+	if (likely(val)) {
+		json_t *soval = json_object_get(json_object_get(val, "result"), "submitold");
+
+		if (soval)
+			pool->submit_old = json_is_true(soval);
+		else
+			pool->submit_old = false;
+		convert_to_work(val, rolltime, pool, &http->tv_start, &reply);
+		lp->failures = 0;
+		json_decref(val);
+	} else if (reply.tv_sec - http->tv_start.tv_sec <= 30) {
+		/* Some pools regularly drop the longpoll request so
+		 * only see this as longpoll failure if it happens
+		 * immediately and just restart it the rest of the
+		 * time. */
+		if (++lp->failures == 1)
+			applog(LOG_WARNING, "longpoll failed for %s, retrying every 30s", lp->url);
+		lp->due += 30;
+	}
+	free(http);
+
+	/* A longpoll borrowed from another pool is looked for again */
+	if (pool != lp->cp && select_longpoll_pool(lp->cp) != pool)
+		lp->pool = NULL;
+}
+
+/* Starts the next request of a longpoll when due, false once the longpoll
+ * is over */
+static bool net_longpoll(struct net_longpoll *lp, time_t now)
+{
+	struct pool *cp = lp->cp, *pool;
+	struct net_http *http;
+
+	if (lp->busy)
+		return true;
+	if (unlikely(cp->removed || (lp->pool && lp->pool->removed)))
+		return false;
+	if (now < lp->due)
+		return true;
+
+	if (!lp->pool) {
+		pool = select_longpoll_pool(cp);
+		if (!pool) {
+			if (!lp->due)
+				applog(LOG_WARNING, "No suitable long-poll found for %s", cp->rpc_url);
+			lp->due = now + 60;
+			return true;
+		}
+		if (pool->has_stratum) {
+			applog(LOG_WARNING, "Block change for %s detection via %s stratum",
+			       cp->rpc_url, pool->rpc_url);
+			return false;
+		}
+		/* Any longpoll from any pool is enough for this to be true */
+		have_longpoll = true;
+		lp->pool = pool;
+		lp->url = NULL;
+	}
+
+	/* Wait till it's the current pool, or it has been flagged as
+	 * rejecting, before opening any connections. switch_pools wakes the
+	 * reactor to look again */
+	if (!cnx_needed(cp) && lp_waiting(cp))
+		return true;
+
+	pool = lp->pool;
+	if (!lp->url) {
+		if (pool->has_gbt) {
+			lp->url = pool->rpc_url;
+			applog(LOG_WARNING, "GBT longpoll ID activated for %s", lp->url);
+		} else {
+			strcpy(lp->req, getwork_req);
+
+			lp->url = pool->lp_url;
+			if (cp == pool)
+				applog(LOG_WARNING, "Long-polling activated for %s", lp->url);
+			else
+				applog(LOG_WARNING, "Long-polling activated for %s via %s", cp->rpc_url, lp->url);
+		}
+	}
+
+	/* Update the longpollid every time, but do it under lock to
+	 * avoid races */
+	if (pool->has_gbt) {
+		cg_rlock(&pool->gbt_lock);
+		sprintf(lp->req, "{\"id\": 0, \"method\": \"getblocktemplate\", \"params\": "
+			"[{\"capabilities\": [\"coinbasetxn\", \"workid\", \"coinbase/append\"], "
+			"\"longpollid\": \"%s\"}]}\n", pool->longpollid);
+		cg_runlock(&pool->gbt_lock);
+	}
+
+	http = calloc(1, sizeof(*http));
+	if (unlikely(!http))
+		quit(1, "Failed to calloc net_http in net_longpoll");
+	http->pool = pool;
+	http->lp = lp;
+	http->done = net_longpoll_done;
+	lp->busy = true;
+	net_http_start(http, lp->url, lp->req, true);
+	return true;
+}
+
+static void start_longpoll(struct pool *pool)
+{
+	tq_push(net_lp_q, pool);
+	net_wake();
+}
+
+/* Starts the transfers handed over or due, returns the ms until the next
+ * one is due, -1 with none waiting */
+static int net_http(struct timeval *now)
+{
+	struct net_longpoll *lp, **lpp;
+	struct net_http *http, **pp;
+	struct pool *pool;
+	int ms = -1;
+
+	while ((http = tq_pop(net_http_q, &tq_nowait)))
+		net_http_start(http, http->pool->rpc_url, http->req, false);
+
+	for (pp = &net_retries; (http = *pp); ) {
+		if (time_less(now, &http->due)) {
+			int due = (us_tdiff(&http->due, now) + 999) / 1000;
+
+			if (ms < 0 || due < ms)
+				ms = due;
+			pp = &http->next;
+			continue;
+		}
+		*pp = http->next;
+		net_http_start(http, http->pool->rpc_url, http->req, false);
+	}
+
+	while ((pool = tq_pop(net_lp_q, &tq_nowait))) {
+		lp = calloc(1, sizeof(*lp));
+		if (unlikely(!lp))
+			quit(1, "Failed to calloc net_longpoll in net_http");
+		lp->cp = pool;
+		lp->next = net_lps;
+		net_lps = lp;
+	}
+
+	for (lpp = &net_lps; (lp = *lpp); ) {
+		if (!net_longpoll(lp, now->tv_sec)) {
+			*lpp = lp->next;
+			free(lp);
+			continue;
+		}
+		if (!lp->busy && lp->due > now->tv_sec &&
+		    (ms < 0 || (lp->due - now->tv_sec) * 1000 < ms))
+			ms = (lp->due - now->tv_sec) * 1000;
+		lpp = &lp->next;
+	}
+	return ms;
+}
+
+static void *net_reactor(void __maybe_unused *userdata)
+{
+	struct epoll_event ev[NET_EVENTS];
+	int timeout = 0;
+
+	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
+	RenameThread("NetReactor");
+
+	while (42) {
+		struct timeval now;
+		int n, i, ms;
+
+		n = epoll_wait(net_epfd, ev, NET_EVENTS, timeout);
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
+		cgtime(&now);
+		for (i = 0; i < n; i++) {
+			struct pool *pool = ev[i].data.ptr;
+
+			if (ev[i].data.ptr == &net_curl_epfd) {
+				net_curl_events();
+				continue;
 			}
-			/* Retry every 5 seconds */
-			sleep(5);
+			if (!pool) {
+				uint64_t wakes;
+
+				if (read(net_wakefd, &wakes, sizeof(wakes)) < 0)
+					applog(LOG_DEBUG, "Failed to read network reactor wakeups");
+				continue;
+			}
+			/* May have been closed by an earlier event */
+			if ((ev[i].events & EPOLLOUT) &&
+			    __atomic_load_n(&pool->net_state, __ATOMIC_ACQUIRE) == NET_LIVE &&
+			    pool->sock_gen == pool->net_gen)
+				net_write(pool);
+			if ((ev[i].events & ~EPOLLOUT) &&
+			    __atomic_load_n(&pool->net_state, __ATOMIC_ACQUIRE) == NET_LIVE &&
+			    pool->sock_gen == pool->net_gen)
+				net_read(pool, now.tv_sec);
+		}
+		if (net_curl_due.tv_sec && !time_less(&now, &net_curl_due)) {
+			net_curl_due.tv_sec = 0;
+			net_curl_action(CURL_SOCKET_TIMEOUT, 0);
 		}
 
-		if (unlikely(!submitted)) {
-			applog(LOG_DEBUG, "Failed to submit stratum share, discarding");
-            free_work(work);
-            cfree(sshare);
-			pool->stale_shares++;
-			total_stale++;
+		timeout = net_pools(&now);
+		ms = net_http(&now);
+		if (ms >= 0 && ms < timeout)
+			timeout = ms;
+		if (net_curl_due.tv_sec) {
+			ms = 0;
+			if (time_less(&now, &net_curl_due))
+				ms = (us_tdiff(&net_curl_due, &now) + 999) / 1000;
+			if (ms < timeout)
+				timeout = ms;
 		}
 	}
 
-	/* Freeze the work queue but don't free up its memory in case there is
-	 * work still trying to be submitted to the removed pool. */
-	tq_freeze(pool->stratum_q);
+	return NULL;
+}
+
+static void *net_connector(void __maybe_unused *userdata)
+{
+	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
+	RenameThread("NetConnect");
+
+	while (42) {
+		struct pool *pool = net_connect_next();
+
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
+		if (unlikely(pool->removed))
+			continue;
+
+		if (restart_stratum(pool)) {
+			net_add(pool);
+			continue;
+		}
+		pool_died(pool);
+		pool->net_deadline = time(NULL) + 30;
+		__atomic_store_n(&pool->net_state, NET_RETRY, __ATOMIC_RELEASE);
+		net_wake();
+	}
 
 	return NULL;
 }
 
-static void init_stratum_threads(struct pool *pool)
+/* Parses the lines the reactor read, in the order they came. Lines of a
+ * connection closed or replaced since are dropped, as are those after a
+ * client.reconnect. The reactor is woken for replies it could not send at
+ * once and for a reconnect. */
+static void *net_parser(void __maybe_unused *userdata)
 {
-	if (unlikely(pthread_create(&pool->stratum_sthread, NULL, stratum_sthread, (void *)pool)))
-		quit(1, "Failed to create stratum sthread");
-	if (unlikely(pthread_create(&pool->stratum_rthread, NULL, stratum_rthread, (void *)pool)))
-		quit(1, "Failed to create stratum rthread");
+	pthread_detach(pthread_self());
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
+	RenameThread("NetParse");
+
+	while (42) {
+		struct net_line *line = tq_pop(net_parse_q, NULL), *next;
+		struct pool *pool;
+
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
+		if (unlikely(!line))
+			continue;
+		pool = line->pool;
+		for (; line; line = next) {
+			next = line->next;
+			if (__atomic_load_n(&pool->net_state, __ATOMIC_ACQUIRE) == NET_LIVE &&
+			    line->gen == pool->net_gen && !pool->net_reconnect) {
+				/* Check this pool hasn't died while being a
+				 * backup pool and has not had its idle flag
+				 * cleared */
+				stratum_resumed(pool);
+
+				if (!parse_method(pool, line->s) && !parse_stratum_response(pool, line->s))
+					applog(LOG_INFO, "Unknown stratum msg: %s", line->s);
+				stratum_clean_job(pool);
+			}
+			free(line);
+		}
+		if (pool->net_reconnect || pool->net_out_len)
+			net_wake();
+	}
+
+	return NULL;
 }
 
-static void *longpoll_thread(void *userdata);
+static void init_net_reactor(void)
+{
+	struct epoll_event ev;
+	pthread_t pth;
+	int i;
+
+	net_epfd = epoll_create(NET_EVENTS);
+	net_wakefd = eventfd(0, EFD_NONBLOCK);
+	if (unlikely(net_epfd < 0 || net_wakefd < 0))
+		quit(1, "Failed to create network reactor epoll");
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	if (unlikely(epoll_ctl(net_epfd, EPOLL_CTL_ADD, net_wakefd, &ev)))
+		quit(1, "Failed to add network reactor wakeup to epoll");
+
+	net_curl_epfd = epoll_create(NET_EVENTS);
+	if (unlikely(net_curl_epfd < 0))
+		quit(1, "Failed to create network reactor curl epoll");
+	ev.data.ptr = &net_curl_epfd;
+	if (unlikely(epoll_ctl(net_epfd, EPOLL_CTL_ADD, net_curl_epfd, &ev)))
+		quit(1, "Failed to add curl epoll to network reactor epoll");
+	net_curlm = curl_multi_init();
+	if (unlikely(!net_curlm))
+		quit(1, "Failed to create network reactor curl multi handle");
+	curl_multi_setopt(net_curlm, CURLMOPT_SOCKETFUNCTION, net_curl_socket);
+	curl_multi_setopt(net_curlm, CURLMOPT_TIMERFUNCTION, net_curl_timer);
+
+	net_http_q = tq_new();
+	net_lp_q = tq_new();
+	net_parse_q = tq_new();
+	if (unlikely(!net_http_q || !net_lp_q || !net_parse_q))
+		quit(1, "Failed to create network reactor queues");
+
+	if (unlikely(pthread_create(&pth, NULL, net_reactor, NULL)))
+		quit(1, "Failed to create network reactor thread");
+	if (unlikely(pthread_create(&pth, NULL, net_parser, NULL)))
+		quit(1, "Failed to create network parse thread");
+	for (i = 0; i < NET_CONNECTORS; i++) {
+		if (unlikely(pthread_create(&pth, NULL, net_connector, NULL)))
+			quit(1, "Failed to create network connect thread");
+	}
+}
+
+/* Hands a pool just connected and authorised to the reactor */
+static void init_stratum_threads(struct pool *pool)
+{
+	pool->stratum_q = tq_new();
+	if (!pool->stratum_q)
+		quit(1, "Failed to create stratum_q in init_stratum_threads");
+	net_add(pool);
+}
+#endif
 
 static bool stratum_works(struct pool *pool)
 {
@@ -5329,7 +6863,7 @@ retry_stratum:
 		bool init = pool_tset(pool, &pool->stratum_init);
 
 		if (!init) {
-			bool ret = initiate_stratum(pool) && auth_stratum(pool);
+			bool ret = restart_stratum(pool);
 
 			if (ret)
 				init_stratum_threads(pool);
@@ -5469,8 +7003,7 @@ retry_stratum:
 
 		if (!pool->lp_started) {
 			pool->lp_started = true;
-			if (unlikely(pthread_create(&pool->longpoll_thread, NULL, longpoll_thread, (void *)pool)))
-				quit(1, "Failed to create pool longpoll thread");
+			start_longpoll(pool);
 		}
 	} else {
 		/* If we failed to parse a getwork, this could be a stratum
@@ -5500,25 +7033,16 @@ static void pool_resus(struct pool *pool)
 
 static struct work *hash_pop(void)
 {
-	struct work *work = NULL, *tmp;
-	int hc;
+	struct work *work;
 
-	mutex_lock(stgd_lock);
-	while (!getq->frozen && !HASH_COUNT(staged_work))
+	lock_staged();
+	while (!getq->frozen && !__total_staged())
 		pthread_cond_wait(&getq->cond, stgd_lock);
 
-	hc = HASH_COUNT(staged_work);
-	/* Find clone work if possible, to allow masters to be reused */
-	if (hc > staged_rollable) {
-		HASH_ITER(hh, staged_work, work, tmp) {
-			if (!work_rollable(work))
-				break;
-		}
-	} else
-		work = staged_work;
-	HASH_DEL(staged_work, work);
-	if (work_rollable(work))
-		staged_rollable--;
+	/* Hand out clone work if possible, to allow masters to be reused */
+	work = staged_heap_pop(&staged_clones);
+	if (!work)
+		work = staged_heap_pop(&staged_masters);
 
 	/* Signal the getwork scheduler to look for more work */
 	pthread_cond_signal(&gws_cond);
@@ -5615,103 +7139,242 @@ void set_target(unsigned char *dest_target, double diff)
 	memcpy(dest_target, target, 32);
 }
 
-/* Generates stratum based work based on the most recent notify information
- * from the pool. This will keep generating work while a pool is down so we use
- * other means to detect when the pool has died in stratum_thread */
-static void gen_stratum_work(struct pool *pool, struct work *work)
+/* Loads 64 bytes as the big endian words of a sha256 block */
+static void sha256_block_be(uint32_t *block, const unsigned char *data)
 {
-	unsigned char *coinbase, merkle_root[32], merkle_sha[64];
-	char *header, *merkle_hash;
-	uint32_t *data32, *swap32;
-	size_t alloc_len;
 	int i;
 
-	/* Use intermediate lock to update the one pool variable */
-	cg_ilock(&pool->data_lock);
+	for (i = 0; i < 16; i++)
+		block[i] = be32toh(((const uint32_t *)data)[i]);
+}
 
-	/* Generate coinbase */
-	work->nonce2 = bin2hex((const unsigned char *)&pool->nonce2, pool->n2size);
-	pool->nonce2++;
+/* Second sha256 of sha256d, the digest of each lane hashed as a 32 byte message */
+static void sha256d_finish_lanes(uint32_t (*state)[8], uint32_t (*block)[16], int n)
+{
+	int j;
 
-	/* Downgrade to a read lock to read off the pool variables */
-	cg_dlock(&pool->data_lock);
-	alloc_len = pool->swork.cb_len;
-	align_len(&alloc_len);
-    coinbase = safe_calloc(alloc_len, 1, "coinbase in gen_stratum_work");
+	for (j = 0; j < n; j++) {
+		memcpy(block[j], state[j], 32);
+		block[j][8] = 0x80000000;
+		memset(&block[j][9], 0, 6 * 4);
+		block[j][15] = 256;
+		memcpy(state[j], sha256_h0, 32);
+	}
+	sha2_transform_lanes(state, (const uint32_t (*)[16])block, n);
+}
 
-    if (coinbase) {
-        hex2bin(coinbase, pool->swork.coinbase1, pool->swork.cb1_len);
-        hex2bin(coinbase + pool->swork.cb1_len, pool->nonce1, pool->n1_len);
-        hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len, work->nonce2, pool->n2size);
-        hex2bin(coinbase + pool->swork.cb1_len + pool->n1_len + pool->n2size, pool->swork.coinbase2, pool->swork.cb2_len);
+/* Bits of the version mask set for variant number v: the lowest mask bits
+ * count v. False once the mask has too few bits for v */
+static bool version_variant(uint32_t mask, int v, uint32_t *bits)
+{
+	uint32_t bit;
 
-        /* Generate merkle root */
-        gen_hash(coinbase, merkle_root, pool->swork.cb_len);
+	*bits = 0;
+	for (bit = 1; v && bit; bit <<= 1) {
+		if (!(mask & bit))
+			continue;
+		if (v & 1)
+			*bits |= bit;
+		v >>= 1;
+	}
+	return !v;
+}
+
+/* Takes n consecutive nonce2 values from the reservation, reserving a fresh
+ * range with one atomic add to pool->nonce2 when it is used up or voided. With
+ * no reservation exactly n values are taken. Must be entered under data_lock
+ * read lock, so a clean notify cannot restart nonce2 between the epoch check
+ * and the add */
+static uint32_t nonce2_reserve(struct pool *pool, struct nonce2_range *range, uint32_t n)
+{
+	uint32_t size;
+
+	if (!range)
+		return __atomic_fetch_add(&pool->nonce2, n, __ATOMIC_RELAXED);
+
+	if (range->pool != pool || range->epoch != pool->nonce2_epoch ||
+	    range->end - range->next < n) {
+		/* Short nonce2 spaces wrap soon enough without reserving ahead */
+		size = pool->n2size >= 3 ? MAX(n, NONCE2_RANGE) : n;
+		range->pool = pool;
+		range->epoch = pool->nonce2_epoch;
+		range->next = __atomic_fetch_add(&pool->nonce2, size, __ATOMIC_RELAXED);
+		range->end = range->next + size;
+	}
+	range->next += n;
+	return range->next - n;
+}
+
+/* Generates n works of the most recent notify for consecutive nonce2 values.
+ * Every sha256 compression of the batch (coinbase tail, merkle branches and
+ * midstate) runs across the works in SIMD lanes. Nonce2 values come from the
+ * generator's range reservation, if any. This will keep generating
+ * work while a pool is down so we use other means to detect when the pool has
+ * died in stratum_thread */
+static void gen_stratum_works(struct pool *pool, struct nonce2_range *range,
+			      struct work **works, int n)
+{
+	struct stratum_work *swork = &pool->swork;
+	uint32_t state[MAX_STRATUM_BATCH][8], block[MAX_STRATUM_BATCH][16];
+	unsigned char nonce2[MAX_STRATUM_BATCH][MAX_N2SIZE], tmp[64];
+	uint32_t nonce2_base, nonce2le, version, vbits, vversion[MAX_VMIDSTATES];
+	int i, j, vversions;
+	size_t off, n2;
+
+	/* Read lock only, nonce2 comes from the reservation */
+	cg_rlock(&pool->data_lock);
+	nonce2_base = nonce2_reserve(pool, range, n);
 
-        cfree(coinbase);
-    }
+	/* Version rolled variants of the header flip the lowest mask bits */
+	version = be32toh(*(uint32_t *)swork->header_bin);
+	for (vversions = 0; pool->version_mask && vversions < MAX_VMIDSTATES; vversions++) {
+		if (!version_variant(pool->version_mask, vversions, &vbits))
+			break;
+		vversion[vversions] = version ^ vbits;
+	}
+	if (vversions < 2)
+		vversions = 0;
 
+	/* Nonce2 is the little endian counter, zero extended to n2size */
+	for (j = 0; j < n; j++) {
+		nonce2le = htole32(nonce2_base + j);
+		memset(nonce2[j], 0, MAX_N2SIZE);
+		memcpy(nonce2[j], &nonce2le, MIN(sizeof(nonce2le), (size_t)pool->n2size));
+		memcpy(state[j], swork->cb_ctx.state, 32);
+	}
+
+	/* Coinbase resumes from the cached prefix state, each lane patches its
+	 * nonce2 into the tail blocks it spans */
+	n2 = swork->cb_tail_n2;
+	for (off = 0; off < swork->cb_tail_len; off += 64) {
+		bool patch = off < n2 + pool->n2size && n2 < off + 64;
+
+		for (j = 0; j < n; j++) {
+			if (!patch) {
+				sha256_block_be(block[j], swork->cb_tail + off);
+				continue;
+			}
+			memcpy(tmp, swork->cb_tail + off, 64);
+			for (i = 0; i < pool->n2size; i++) {
+				if (n2 + i >= off && n2 + i < off + 64)
+					tmp[n2 + i - off] = nonce2[j][i];
+			}
+			sha256_block_be(block[j], tmp);
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, n);
+	}
+	sha256d_finish_lanes(state, block, n);
 
-	memcpy(merkle_sha, merkle_root, 32);
-	for (i = 0; i < pool->swork.merkles; i++) {
-		unsigned char merkle_bin[32];
+	/* Merkle root, each branch is sha256d of a 64 byte message */
+	for (i = 0; i < swork->merkles; i++) {
+		const uint32_t *branch = (const uint32_t *)(swork->merkle_bin + 32 * i);
 
-		hex2bin(merkle_bin, pool->swork.merkle[i], 32);
-		memcpy(merkle_sha + 32, merkle_bin, 32);
-		gen_hash(merkle_sha, merkle_root, 64);
-		memcpy(merkle_sha, merkle_root, 32);
+		for (j = 0; j < n; j++) {
+			memcpy(block[j], state[j], 32);
+			for (off = 0; off < 8; off++)
+				block[j][8 + off] = be32toh(branch[off]);
+			memcpy(state[j], sha256_h0, 32);
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, n);
+		for (j = 0; j < n; j++) {
+			memset(block[j], 0, 64);
+			block[j][0] = 0x80000000;
+			block[j][15] = 512;
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, n);
+		sha256d_finish_lanes(state, block, n);
 	}
-	data32 = (uint32_t *)merkle_sha;
-	swap32 = (uint32_t *)merkle_root;
-	flip32(swap32, data32);
-	merkle_hash = bin2hex((const unsigned char *)merkle_root, 32);
 
-    header = safe_calloc(pool->swork.header_len, 1, "header in gen_stratum_work");
+	for (j = 0; j < n; j++) {
+		struct work *work = works[j];
+		uint32_t *root = (uint32_t *)(work->data + STRATUM_HDR_MERKLE);
+
+		/* Header is laid out already, only the merkle root goes in */
+		memcpy(work->data, swork->header_bin, 128);
+		for (i = 0; i < 8; i++)
+			root[i] = htole32(state[j][i]);
 
-	sprintf(header, "%s%s%s%s%s%s%s",
-		pool->swork.bbversion,
-		pool->swork.prev_hash,
-		merkle_hash,
-		pool->swork.ntime,
-		pool->swork.nbit,
-		"00000000", /* nonce */
-		workpadding);
+		/* Store the stratum work diff to check it still matches the pool's
+		 * stratum diff when submitting shares */
+		work->sdiff = swork->diff;
 
-	/* Store the stratum work diff to check it still matches the pool's
-	 * stratum diff when submitting shares */
-	work->sdiff = pool->swork.diff;
+		/* Copy parameters required for share submission */
+		work->job = ref_work_job(swork->job);
+		work->job_id = work->job->job_id;
+		work->nonce1 = work->job->nonce1;
+		snprintf(work->ntime, sizeof(work->ntime), "%s", swork->ntime);
+		__bin2hex(work->nonce2, nonce2[j], pool->n2size);
 
-	/* Copy parameters required for share submission */
-	work->job_id = strdup(pool->swork.job_id);
-	work->nonce1 = strdup(pool->nonce1);
-	work->ntime = strdup(pool->swork.ntime);
+		work->version_mask = pool->version_mask;
+		work->vversions = work->vmidstates = vversions;
+		memcpy(work->vversion, vversion, sizeof(vversion));
+	}
 	cg_runlock(&pool->data_lock);
 
-	applog(LOG_DEBUG, "Generated stratum merkle %s", merkle_hash);
-	applog(LOG_DEBUG, "Generated stratum header %s", header);
-	applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+	calc_midstates(works, n);
 
-    cfree(merkle_hash);
+	for (j = 0; j < n; j++) {
+		struct work *work = works[j];
 
-	/* Convert hex data to binary data for work */
-	if (unlikely(!hex2bin(work->data, header, 128)))
-		quit(1, "Failed to convert header to data in gen_stratum_work");
-    cfree(header);
-	calc_midstate(work);
+		if (opt_debug) {
+			char *header = bin2hex(work->data, 128);
 
-	set_target(work->target, work->sdiff);
+			applog(LOG_DEBUG, "Generated stratum header %s", header);
+			applog(LOG_DEBUG, "Work job_id %s nonce2 %s ntime %s", work->job_id, work->nonce2, work->ntime);
+			free(header);
+		}
 
-	local_work++;
-	work->pool = pool;
-	work->stratum = true;
-	work->blk.nonce = 0;
-	work->id = total_work++;
-	work->longpoll = false;
-	work->getwork_mode = GETWORK_MODE_STRATUM;
-	work->work_block = work_block;
-	calc_diff(work, work->sdiff);
+		set_target(work->target, work->sdiff);
 
-	cgtime(&work->tv_staged);
+		local_work++;
+		work->pool = pool;
+		work->stratum = true;
+		work->blk.nonce = 0;
+		work->id = total_work++;
+		work->longpoll = false;
+		work->getwork_mode = GETWORK_MODE_STRATUM;
+		work->work_block = work_block;
+		calc_diff(work, work->sdiff);
+
+		cgtime(&work->tv_staged);
+	}
+}
+
+/* Single work straight off the pool counter, for the clean notify check */
+static void gen_stratum_work(struct pool *pool, struct work *work)
+{
+	gen_stratum_works(pool, NULL, &work, 1);
+}
+
+/* Takes up to half the staged work, at most LOCAL_WORKS, returning the first
+ * and keeping the rest in the thread's deque. With nothing staged, work is
+ * stolen from another thread's deque before waiting on the staged queue */
+static struct work *refill_work(struct thr_info *thr)
+{
+	struct work *works[LOCAL_WORKS];
+	int i, n;
+
+	lock_staged();
+	n = MIN((__total_staged() + 1) / 2, LOCAL_WORKS);
+	for (i = 0; i < n; i++) {
+		/* Hand out clone work if possible, to allow masters to be reused */
+		works[i] = staged_heap_pop(&staged_clones);
+		if (!works[i])
+			works[i] = staged_heap_pop(&staged_masters);
+	}
+	if (n)
+		pthread_cond_signal(&gws_cond);
+	mutex_unlock_noyield(stgd_lock);
+
+	if (n) {
+		local_fill(thr, works + 1, n - 1);
+		return works[0];
+	}
+
+	works[0] = steal_work(thr);
+	if (works[0])
+		return works[0];
+	return hash_pop();
 }
 
 static struct work *get_work(struct thr_info *thr, const int thr_id)
@@ -5720,7 +7383,9 @@ static struct work *get_work(struct thr_info *thr, const int thr_id)
 
 	applog(LOG_DEBUG, "Popping work from get queue to get work");
 	while (!work) {
-		work = hash_pop();
+		work = local_pop(thr);
+		if (!work)
+			work = refill_work(thr);
 		if (stale_work(work, false)) {
 			discard_work(work);
 			work = NULL;
@@ -5740,7 +7405,6 @@ static void submit_work_async(struct work *work_in, struct timeval *tv_work_foun
 {
 	struct work *work = copy_work(work_in);
 	struct pool *pool = work->pool;
-	pthread_t submit_thread;
 
 	if (tv_work_found)
 		copy_time(&work->tv_work_found, tv_work_found);
@@ -5772,11 +7436,11 @@ static void submit_work_async(struct work *work_in, struct timeval *tv_work_foun
 		if (unlikely(!tq_push(pool->stratum_q, work))) {
 			applog(LOG_DEBUG, "Discarding work from removed pool");
 			free_work(work);
-		}
+		} else
+			net_wake();
 	} else {
 		applog(LOG_DEBUG, "Pushing submit work to work thread");
-		if (unlikely(pthread_create(&submit_thread, NULL, submit_work_thread, (void *)work)))
-			quit(1, "Failed to create submit_work_thread");
+		submit_http_work(work);
 	}
 }
 
@@ -6076,6 +7740,9 @@ struct work *get_queued(struct cgpu_info *cgpu)
 		if (!work->queued) {
 			work->queued = true;
 			cgpu->queued_count++;
+			memcpy(work->mkey, work->midstate, 32);
+			memcpy(work->mkey + 32, work->data + QUEUED_MKEY_OFFSET, QUEUED_MKEY_DATALEN);
+			HASH_ADD(mh, cgpu->queued_bymid, mkey, QUEUED_MKEY_LEN, work);
 			ret = work;
 			break;
 		}
@@ -6110,27 +7777,48 @@ struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t mid
 /* This function is for finding an already queued work item in the
  * device's queued_work hashtable. Code using this function must be able
  * to handle NULL as a return which implies there is no matching work.
- * The common values for midstatelen, offset, datalen are 32, 64, 12 */
+ * The common values for midstatelen, offset, datalen are 32, 64, 12, those
+ * are looked up in the queued_bymid index, others walk the whole queue. */
 struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen)
 {
+	unsigned char mkey[QUEUED_MKEY_LEN];
 	struct work *ret;
 
+	if (midstatelen != 32 || offset != QUEUED_MKEY_OFFSET || datalen != QUEUED_MKEY_DATALEN) {
+		rd_lock(&cgpu->qlock);
+		ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+		rd_unlock(&cgpu->qlock);
+		return ret;
+	}
+
+	memcpy(mkey, midstate, 32);
+	memcpy(mkey + 32, data, QUEUED_MKEY_DATALEN);
 	rd_lock(&cgpu->qlock);
-	ret = __find_work_bymidstate(cgpu->queued_work, midstate, midstatelen, data, offset, datalen);
+	HASH_FIND(mh, cgpu->queued_bymid, mkey, QUEUED_MKEY_LEN, ret);
 	rd_unlock(&cgpu->qlock);
 
 	return ret;
 }
 
+/* Removes work from the device's queued_work hashtable and, if it was
+ * flagged queued, from the queued_bymid index. Must be called under
+ * cgpu->qlock write lock. */
+void __del_queued_work(struct cgpu_info *cgpu, struct work *work)
+{
+	if (work->queued) {
+		cgpu->queued_count--;
+		HASH_DELETE(mh, cgpu->queued_bymid, work);
+		work->queued = false;
+	}
+	HASH_DEL(cgpu->queued_work, work);
+}
+
 /* This function should be used by queued device drivers when they're sure
  * the work struct is no longer in use. */
 void work_completed(struct cgpu_info *cgpu, struct work *work)
 {
 	wr_lock(&cgpu->qlock);
-	if (work->queued)
-		cgpu->queued_count--;    
-	HASH_DEL(cgpu->queued_work, work);
-    work->queued = false;
+	__del_queued_work(cgpu, work);
 	wr_unlock(&cgpu->qlock);
 
 	free_work(work);
@@ -6146,7 +7834,7 @@ static void flush_queue(struct cgpu_info *cgpu)
 		/* Can only discard the work items if they're not physically
 		 * queued on the device. */
 		if (!work->queued) {
-			HASH_DEL(cgpu->queued_work, work);
+			__del_queued_work(cgpu, work);
 			discard_work(work);
 			discarded++;
 		}
@@ -6316,6 +8004,14 @@ static struct pool *select_longpoll_pool(struct pool *cp)
 	return NULL;
 }
 
+static bool lp_waiting(struct pool *pool)
+{
+	return pool->enabled == POOL_DISABLED ||
+	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
+	       pool_strategy != POOL_BALANCE);
+}
+
+#ifndef HAVE_SYS_EPOLL_H
 /* This will make the longpoll thread wait till it's the current pool, or it
  * has been flagged as rejecting, before attempting to open any connections.
  */
@@ -6324,9 +8020,7 @@ static void wait_lpcurrent(struct pool *pool)
 	if (cnx_needed(pool))
 		return;
 
-	while (pool->enabled == POOL_DISABLED ||
-	       (pool != current_pool() && pool_strategy != POOL_LOADBALANCE &&
-	       pool_strategy != POOL_BALANCE)) {
+	while (lp_waiting(pool)) {
 		mutex_lock(&lp_lock);
 		pthread_cond_wait(&lp_cond, &lp_lock);
 		mutex_unlock(&lp_lock);
@@ -6355,6 +8049,7 @@ static void *longpoll_thread(void *userdata)
 		applog(LOG_ERR, "CURL initialisation failed");
 		return NULL;
 	}
+	__atomic_add_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 
 retry_pool:
 	pool = select_longpoll_pool(cp);
@@ -6394,6 +8089,7 @@ retry_pool:
 		json_t *val, *soval;
 
 		wait_lpcurrent(cp);
+		__atomic_add_fetch(&net_wakeups, 1, __ATOMIC_RELAXED);
 
 		cgtime(&start);
 
@@ -6457,8 +8153,10 @@ retry_pool:
 out:
 	curl_easy_cleanup(curl);
 
+	__atomic_sub_fetch(&net_threads, 1, __ATOMIC_RELAXED);
 	return NULL;
 }
+#endif
 
 void reinit_device(struct cgpu_info *cgpu)
 {
@@ -6661,7 +8359,7 @@ static void *watchdog_thread(void __maybe_unused *userdata)
 			struct cgpu_info *cgpu = get_devices(i);
 			struct thr_info *thr = cgpu->thr[0];
 			enum dev_enable *denable;
-			char dev_str[8];
+			char dev_str[16];
 			int gpu;
 
 			cgpu->drv->get_stats(cgpu);
@@ -7237,6 +8935,7 @@ void enable_device(struct cgpu_info *cgpu)
 
 	rwlock_init(&cgpu->qlock);
 	cgpu->queued_work = NULL;
+	cgpu->queued_bymid = NULL;
 }
 
 struct _cgpu_devid_counter {
@@ -7326,6 +9025,7 @@ static void hotplug_process()
         mining_thr[mining_threads + i] = calloc(1, sizeof(*thr));
 		if (!mining_thr[mining_threads + i])
             quit(1, "Failed to hotplug calloc mining_thr[%d]", i);
+		mutex_init(&mining_thr[mining_threads + i]->workq.lock);
 	}
 
 	// Start threads
@@ -7432,7 +9132,9 @@ static void probe_pools(void)
 
 int main(int argc, char *argv[])
 {
+	struct nonce2_range nonce2_range;
 	struct sigaction handler;
+	struct timeval tv_lastgen;
 	struct thr_info *thr;
 	struct block *block;
 	unsigned int k;
@@ -7482,6 +9184,10 @@ int main(int argc, char *argv[])
 	if (unlikely(pthread_cond_init(&lp_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init lp_cond");
 
+#ifdef HAVE_SYS_EPOLL_H
+	init_net_reactor();
+#endif
+
 	mutex_init(&restart_lock);
 	if (unlikely(pthread_cond_init(&restart_cond, NULL)))
 		quit(1, "Failed to pthread_cond_init restart_cond");
@@ -7751,6 +9457,7 @@ int main(int argc, char *argv[])
 
 	for (i = 0; i < mining_threads; i++) {
         mining_thr[i] = safe_calloc(1, sizeof(*thr), "mining_thr[x] in main");
+		mutex_init(&mining_thr[i]->workq.lock);
 	}
 
 	stage_thr_id = 2;
@@ -7924,21 +9631,25 @@ begin_bench:
 		quit(1, "incorrect total_control_threads (%d) should be 9", total_control_threads);
 
 	/* Once everything is set up, main() becomes the getwork scheduler */
+	memset(&nonce2_range, 0, sizeof(nonce2_range));
+	cgtime(&tv_lastgen);
 	while (42) {
-		int ts, max_staged = opt_queue;
+		int ts, max_staged = opt_queue, nworks;
+		struct work *work, *works[MAX_STRATUM_BATCH];
+		struct timeval tv_gen;
 		struct pool *pool, *cp;
 		bool lagging = false;
 		struct curl_ent *ce;
-		struct work *work;
+		double gen_secs;
 
 		cp = current_pool();
 
 		/* If the primary pool is a getwork pool and cannot roll work,
 		 * try to stage one extra work per mining thread */
-		if (!pool_localgen(cp) && !staged_rollable)
+		if (!pool_localgen(cp) && !staged_masters.count)
 			max_staged += mining_threads;
 
-		mutex_lock(stgd_lock);
+		lock_staged();
 		ts = __total_staged();
 
 		if (!pool_localgen(cp) && !ts && !opt_fail_only)
@@ -7967,15 +9678,37 @@ retry:
 			while (!pool->stratum_active || !pool->stratum_notify) {
 				struct pool *altpool = select_pool(true);
 
-				nmsleep(5000);
+				/* A standby pool is ready at once, don't sit out
+				 * the failover on the dead one */
+				nmsleep(opt_standby_pools ? 100 : 5000);
 				if (altpool != pool) {
 					pool = altpool;
 					goto retry;
 				}
 			}
-			gen_stratum_work(pool, work);
-			applog(LOG_DEBUG, "Generated stratum work");
-			stage_work(work);
+			/* Rolling ntime of staged work is cheaper than any new
+			 * merkle root */
+			if (clone_available()) {
+				applog(LOG_DEBUG, "Cloned stratum work");
+				free_work(work);
+				continue;
+			}
+
+			/* Stage a whole batch, the scheduler then sleeps until
+			 * the batch is consumed down to max_staged again */
+			nworks = opt_stratum_batch;
+			works[0] = work;
+			for (i = 1; i < nworks; i++)
+				works[i] = make_work();
+			gen_stratum_works(pool, &nonce2_range, works, nworks);
+			applog(LOG_DEBUG, "Generated %d stratum works", nworks);
+			stage_works(works, nworks);
+
+			cgtime(&tv_gen);
+			gen_secs = tdiff(&tv_gen, &tv_lastgen);
+			copy_time(&tv_lastgen, &tv_gen);
+			if (gen_secs > 0)
+				decay_time(&local_work_rate, nworks / gen_secs, gen_secs);
 			continue;
 		}
 
@@ -2057,8 +2057,7 @@ static int64_t bflsc_scanwork(struct thr_info *thr)
 				wr_lock(&bflsc->qlock);
 				HASH_ITER(hh, bflsc->queued_work, work, tmp) {
 					if (work->devflag && work->subid == dev) {
-						bflsc->queued_count--;
-						HASH_DEL(bflsc->queued_work, work);
+						__del_queued_work(bflsc, work);
 						discard_work(work);
 					}
 				}
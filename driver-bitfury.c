@@ -29,9 +29,11 @@
 #include <math.h>
 #include <unistd.h>
 #include <sha2.h>
+#include "sha2_lanes.h"
 #include "libbitfury.h"
 #include "util.h"
 #include "tm_i2c.h"
+#include "spiemu.h"
 #include <stdio.h>
 #include <execinfo.h>
 #include <signal.h>
@@ -44,12 +46,7 @@
 #define STAT_LINE_LENGTH 1024
 
 struct device_drv bitfury_drv;
-unsigned loops_count = 0;
-unsigned call_count = 0;
 short chips_by_rate[50];
-static double vc0_median[BITFURY_MAXBANKS];
-static double vc1_median[BITFURY_MAXBANKS];
-static double ghs_median[BITFURY_MAXBANKS];
 char stat_lines[BITFURY_MAXBANKS][STAT_LINE_LENGTH] = {0};
 static char CL_RESET[]     = "\e[0m";
 static char CL_LT_RED[]    = "\e[1;31m";
@@ -102,6 +99,8 @@ static void bitfury_detect(void)
     bitfury_info->threads = 1;
 
     applog(LOG_INFO, "INFO: bitfury_detect");
+    if (opt_bitfury_emulate)
+        spiemu_setup(opt_bitfury_emulate, opt_bitfury_emu_mhz);
     chip_count = libbitfury_detectChips(bitfury_info->devices);
     if (!chip_count) {
         applog(LOG_WARNING, "No Bitfury chips detected!");
@@ -109,8 +108,10 @@ static void bitfury_detect(void)
     } else {
         applog(LOG_WARNING, "BITFURY: %d chips detected!", chip_count);
     }
+    applog(LOG_INFO, "BITFURY: nonces verified by %s SHA-256, %d lanes", sha2_lanes_name(), sha2_lanes_width());
 
     bitfury_info->chip_count = chip_count;
+    bitfury_info->device_data = safe_calloc(1, sizeof(struct bitfury_info), "bitfury board in bitfury_detect");
     add_cgpu(bitfury_info);
 }
 
@@ -188,12 +189,17 @@ double tv_diff(PTIMEVAL a, PTIMEVAL b) {
 }
 
 
-inline void test_reclock(bitfury_device_p dev) {
+static inline float autoclock_mean(struct bitfury_autoclk *clk, int arm) {
+    return clk->n[arm] > 0 ? clk->sum[arm] / clk->n[arm] : 0;
+}
+
+static inline void test_reclock(bitfury_device_p dev) {
 
     if ( dev->osc6_bits != dev->osc6_bits_upd ) {
-        applog(LOG_WARNING, " for slot %X chip %X, osc6_bits changed from %d to %d, csw_count = %3d, cch_stat = { %2d %2d %2d %2d } ",
+        struct bitfury_autoclk *clk = &dev->clk;
+        applog(LOG_WARNING, " for slot %X chip %X, osc6_bits changed from %d to %d, csw_count = %3d, clock means = { %.2f %.2f %.2f %.2f } ",
                                dev->slot, dev->fasync, dev->osc6_bits, dev->osc6_bits_upd, dev->csw_count,
-                               dev->cch_stat[0], dev->cch_stat[1], dev->cch_stat[2], dev->cch_stat[3] );
+                               autoclock_mean(clk, 0), autoclock_mean(clk, 1), autoclock_mean(clk, 2), autoclock_mean(clk, 3) );
          dev->osc6_bits = dev->osc6_bits_upd;
          send_freq( dev->slot, dev->fasync, dev->osc6_bits );
          cgtime (&dev->rst_time);
@@ -263,10 +269,6 @@ void init_devices (bitfury_device_t *devices, int chip_count) {
 }
 
 
-int next_prefetch(int i) {
-    return ( i + 1 ) % PREFETCH_WORKS;
-}
-
 void get_opt_filename(char *filename) {
     if ( getenv("HOME") && *getenv("HOME") ) {
             strcpy(filename, getenv("HOME"));
@@ -282,6 +284,30 @@ void get_opt_filename(char *filename) {
 }
 
 
+/* Saved choice seeds auto-clock: counts are capped, so saved clock is verified again soon */
+void autoclock_load(bitfury_device_p dev, const int *counts, const float *rates) {
+    struct bitfury_autoclk *clk = &dev->clk;
+    float best = 0;
+    int i;
+
+    memset(clk, 0, sizeof(*clk));
+    for (i = 0; i < BITFURY_CLK_ARMS; i ++) {
+        float score = counts[i];
+
+        if ( counts[i] <= 0 ) continue;
+        clk->n[i] = MIN (counts[i], BITFURY_AUTOCLOCK_PRIOR);
+        if ( rates ) {
+            clk->sum[i] = clk->n[i] * rates[i];
+            score = rates[i];
+        }
+        // поправка лучшего битклока по результатам прошлых запусков
+        if ( best < score ) {
+            best = score;
+            dev->osc6_bits_upd = BASE_OSC_BITS + i;
+        }
+    }
+}
+
 void load_opt_conf (bitfury_device_t *devices, int chip_count) {
     char filename[PATH_MAX];
     get_opt_filename(filename);
@@ -321,23 +347,15 @@ void load_opt_conf (bitfury_device_t *devices, int chip_count) {
         while (t && strlen(t) > 10 ) {
             // applog(LOG_WARNING, "parsing line %d, next token: %35s", lcount, t);
 
-            int v[4];
-            int tc = sscanf(t, "%d:[%d,%d,%d,%d]@{%*.2f,%*.2f,%*.2f,%*.2f}", &n_chip, &v[0], &v[1], &v[2], &v[3]);
+            int v[BITFURY_CLK_ARMS];
+            float r[BITFURY_CLK_ARMS];
+            int tc = sscanf(t, "%d:[%d,%d,%d,%d]@{%f,%f,%f,%f}", &n_chip, &v[0], &v[1], &v[2], &v[3], &r[0], &r[1], &r[2], &r[3]);
             if ( tc >= 5 ) {
 
                 if ( n_chip < 0 ) break;
                 int i = bitfury_findChip (devices, chip_count, n_slot, n_chip);
-                if ( i >= 0 ) {
-                    bitfury_device_p dev = &devices[i];
-                    memcpy( dev->cch_stat, v, sizeof(v) ); // update stat
-                    int best = 0;
-                    // поправка лучшего битклока по количеству выборов
-                    for (i = 0; i < 4; i ++)
-                        if ( best < v[i] ) {
-                             best = v[i];
-                             dev->osc6_bits_upd = BASE_OSC_BITS + i;
-                        }
-               }
+                if ( i >= 0 )
+                    autoclock_load(&devices[i], v, tc >= 9 ? r : NULL);
             }
             else {
                 applog(LOG_WARNING, "parsing error for token %s, sscanf returns %d", t, tc);
@@ -373,17 +391,15 @@ void save_opt_conf (bitfury_device_t *devices, int chip_count) {
             line[0] = 0;
         }
 
+        // auto-clock state: sample counts (rounded up) and mean effective Gh/s per clock
+        struct bitfury_autoclk *clk = &dev->clk;
         char dev_stat[128];
-        sprintf(dev_stat, "%d:[%d,%d,%d,%d]@", dev->fasync, dev->cch_stat[0], dev->cch_stat[1], dev->cch_stat[2], dev->cch_stat[3]);
+        sprintf(dev_stat, "%d:[%d,%d,%d,%d]@", dev->fasync,
+                (int)ceilf(clk->n[0]), (int)ceilf(clk->n[1]), (int)ceilf(clk->n[2]), (int)ceilf(clk->n[3]));
         strncat(line, dev_stat, 1024);
 
-        float v0, v1, v2, v3;
-        v0 = dev->rbc_stat[0];
-        v1 = dev->rbc_stat[1];
-        v2 = dev->rbc_stat[2];
-        v3 = dev->rbc_stat[3];
-
-        sprintf(dev_stat, "{%.2f,%.2f,%.2f,%.2f}; ", v0, v1, v2, v3);
+        sprintf(dev_stat, "{%.2f,%.2f,%.2f,%.2f}; ",
+                autoclock_mean(clk, 0), autoclock_mean(clk, 1), autoclock_mean(clk, 2), autoclock_mean(clk, 3));
         strncat(line, dev_stat, 1024);
     }
 
@@ -398,17 +414,25 @@ struct timeval* get_cgtime() {
     return &now;
 }
 
+/* Occupancy of prefetch ring: head is read first, so it never passes tail snapshot */
 inline int works_prefetched (struct cgpu_info *cgpu) {
-    int i, cnt = 0;
-    for (i = 0; i < PREFETCH_WORKS; i ++)
-        if ( cgpu->prefetch[i] ) cnt ++;
-    return cnt;
+    unsigned head = __atomic_load_n(&cgpu->prefetch.head, __ATOMIC_ACQUIRE);
+    unsigned tail = __atomic_load_n(&cgpu->prefetch.tail, __ATOMIC_ACQUIRE);
+    return (int)(tail - head);
 }
 
-static bool bitfury_fill(struct cgpu_info *cgpu) {
-    bool ret;
-    int i;
+/* Producer side: slot is filled before tail release publishes it */
+static bool push_prefetch(struct cgpu_info *cgpu, struct work *work) {
+    unsigned tail = cgpu->prefetch.tail;
+
+    if (tail - __atomic_load_n(&cgpu->prefetch.head, __ATOMIC_ACQUIRE) >= PREFETCH_WORKS)
+        return false;
+    cgpu->prefetch.slot[tail & (PREFETCH_WORKS - 1)] = work;
+    __atomic_store_n(&cgpu->prefetch.tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
 
+static bool bitfury_fill(struct cgpu_info *cgpu) {
     struct work* nw = NULL;
 
     int max_need = cgpu->chip_count / 3 + 1;
@@ -416,53 +440,36 @@ static bool bitfury_fill(struct cgpu_info *cgpu) {
     if (max_need > PREFETCH_WORKS)
         max_need = PREFETCH_WORKS;
 
-    int now_need =  ( max_need - works_prefetched(cgpu) );
-    ret = ( now_need <= 0 ); // need find optimal values
+    if (works_prefetched(cgpu) >= max_need) return true; // need find optimal values
 
-    if (ret) return ret;
     nw = get_queued (cgpu);
     if (NULL == nw) return false;
-    rd_lock(&cgpu->qlock); // don't return before unlock(!)
-    for (i = 0; i < PREFETCH_WORKS; i ++)  {
-        if ( NULL == cgpu->prefetch [cgpu->w_prefetch] ) {
-            nw->debug_stage = 128;
-            cgpu->prefetch [cgpu->w_prefetch] = nw;
-            now_need --;
-            break;
-        }
-        cgpu->w_prefetch = next_prefetch ( cgpu->w_prefetch );
+    nw->debug_stage = 128;
+    if (!push_prefetch(cgpu, nw)) {
+        // cannot happen with max_need <= PREFETCH_WORKS and single producer
+        applog(LOG_ERR, "BITFURY: prefetch ring overflow");
+        work_completed(cgpu, nw);
+        return true;
     }
 
-    ret = ( works_prefetched(cgpu) >= max_need ); // need find optimal values
-    rd_unlock(&cgpu->qlock);
-
-
-
-    return ret;
-    // */
+    return works_prefetched(cgpu) >= max_need;
 }
 
+/* Consumer side: slot is read before head release gives it back to producer */
 struct work* load_prefetch(struct cgpu_info *cgpu){
-    int i;
-    struct work* result = NULL;
+    unsigned head = cgpu->prefetch.head;
+    struct work* result;
 
-    // rd_lock(&cgpu->qlock);
     // выборка задания из большой очереди
-    // TODO: вместо блокировки здесь нужны атомарные операции!
-    for (i = 0; i < PREFETCH_WORKS; i ++)  {
-        if ( cgpu->prefetch [cgpu->r_prefetch]  ) {
-            result = cgpu->prefetch [cgpu->r_prefetch];
-            cgpu->prefetch [cgpu->r_prefetch] = NULL; // больше не выдавать
-            break;
-        }
-        cgpu->r_prefetch = next_prefetch ( cgpu->r_prefetch );
-    }
-    // rd_unlock(&cgpu->qlock); // */
+    if (head == __atomic_load_n(&cgpu->prefetch.tail, __ATOMIC_ACQUIRE))
+        return NULL;
+    result = cgpu->prefetch.slot[head & (PREFETCH_WORKS - 1)];
+    __atomic_store_n(&cgpu->prefetch.head, head + 1, __ATOMIC_RELEASE);
     return result;
 }
 
 
-inline uint64_t works_receive(thr_info_t *thr, bitfury_device_t *devices, int chip_count) {
+static inline uint64_t works_receive(thr_info_t *thr, bitfury_device_t *devices, int chip_count) {
 
     uint64_t hashes = 0;
     struct timeval now;
@@ -505,6 +512,7 @@ inline uint64_t works_receive(thr_info_t *thr, bitfury_device_t *devices, int ch
             if (o2work) {
                 o2work->debug_stage = 245;
                 work_completed(thr->cgpu, o2work);
+                dev->o2work = NULL;
                 double diff = tv_diff (&now, &dev->work_start);
                 dev->work_end = now;
 
@@ -646,55 +654,153 @@ int relative_bits_index(bitfury_device_p dev) {
 }
 
 
-void freq_bruteforce(bitfury_device_p dev) {
-    int ridx = relative_bits_index(dev);
-    int new_clk = ridx;
-    float best = 3; // extremum Ghz for 54 clk
-    best = dev->rbc_stat[ridx];
-    int i, csum = 0;
-    int test_count = 4;
-    for (i = 0; i < 4; i ++) csum += dev->cch_stat[i];
-    if ( csum > 2 )
-         test_count = 2;
+/* Board controller readings: polled by telemetry thread, scan loop and API only read snapshots */
+static bool read_slot(int slot, struct bitfury_telemetry *t) {
+    unsigned int temp, vc0, vc1;
+
+    if (tm_i2c_getraw(slot, TM_GET_TEMP, &temp) ||
+        tm_i2c_getraw(slot, TM_GET_CORE0, &vc0) ||
+        tm_i2c_getraw(slot, TM_GET_CORE1, &vc1))
+        return false;
+    t->temp = tm_i2c_Data2Temp(temp) * 0.1;
+    t->vc0 = tm_i2c_Data2Core(vc0) * 1000;
+    t->vc1 = tm_i2c_Data2Core(vc1) * 1000;
+    return true;
+}
+
+/* Single writer, so seqlock: readers retry instead of blocking the writer or each other */
+static void slot_publish(struct bitfury_slot_info *si, const struct bitfury_telemetry *t) {
+    unsigned seq = si->seq;
+
+    __atomic_store_n(&si->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    si->t = *t;
+    __atomic_store_n(&si->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void slot_telemetry(struct bitfury_info *info, int slot, struct bitfury_telemetry *t) {
+    struct bitfury_slot_info *si = &info->slots[slot];
+    unsigned seq;
+
+    do {
+        seq = __atomic_load_n(&si->seq, __ATOMIC_ACQUIRE);
+        *t = si->t;
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    } while ((seq & 1) || seq != __atomic_load_n(&si->seq, __ATOMIC_RELAXED));
+}
 
-    if ( dev->csw_count < test_count ) {
+/* Poll every used slot; failed poll keeps old values, so their age grows */
+static void poll_slots(struct bitfury_info *info, const bool *slot_on) {
+    int slot;
 
-        int optimal = 1;
-        if ( csum > 4 ) optimal = dev->cch_stat[ridx]; // probably best choice
+    for (slot = 0; slot < BITFURY_MAXBANKS; slot++) {
+        struct bitfury_slot_info *si = &info->slots[slot];
+        struct bitfury_telemetry t = si->t;
 
-        new_clk = ( ridx + 1 ) & 3; // masked enum
-        while ( csum > 2 && dev->cch_stat[new_clk] < optimal )
-                new_clk = ( new_clk + 1 ) & 3; // дополнительные циклы - пропуск неоптимальных выборов
+        if (!slot_on[slot])
+            continue;
+        if (read_slot(slot, &t))
+            cgtime(&t.updated);
+        else
+            t.errors++;
+        t.reads++;
+        slot_publish(si, &t);
     }
-    else
-    if ( best < 4 && dev->csw_count < test_count + 1 ) {
-        // однократный(!) поиск наилучшего, для работы с заданным клоком.
-        // if ( stat_dumps > 150 ) best = 3;
-        int i;
-        for (i = 0; i < 4; i ++) {
-            if ( best >= dev->rbc_stat [i] ) continue;
-            best = dev->rbc_stat [i];
-            new_clk = i; // optimus
-        } // for
-
-        // подведение итогов соревнования
-        // если произошла смена к удачной конфигурации или было мало регистраций выбора
-        if ( ridx != new_clk || dev->cch_stat[new_clk] < 2 ) dev->cch_stat[new_clk] ++;
+}
+
+static void *bitfury_telemetry_thread(void *userdata) {
+    struct cgpu_info *cgpu = userdata;
+    struct bitfury_info *info = cgpu->device_data;
+    bool slot_on[BITFURY_MAXBANKS] = { false };
+    int i;
+
+    RenameThread("bitfury_i2c");
+
+    for (i = 0; i < cgpu->chip_count; i++)
+        slot_on[cgpu->devices[i].slot] = true;
+
+    while (!info->shutdown) {
+        for (i = 0; i < BITFURY_TELEMETRY_MS / 100 && !info->shutdown; i++)
+            nmsleep(100);
+        poll_slots(info, slot_on);
     }
+    return NULL;
+}
 
-    new_clk = new_clk + BASE_OSC_BITS;
+void autoclock_reset(bitfury_device_p dev) {
+    memset(&dev->clk, 0, sizeof(dev->clk));
+}
+
+/* Discounted UCB choice: never tried clocks first, nearest to current one, then
+   best mean plus bonus for uncertainty. Old samples fade with every new one, so
+   bonus of a clock not tried for long grows and it is measured again on drift */
+static int autoclock_choose(struct bitfury_autoclk *clk, int cur) {
+    float total = 0, best_mean = 0, score, best_score;
+    int i, d, best = cur;
+
+    for (d = 1; d < BITFURY_CLK_ARMS; d ++) {
+        if ( cur + d < BITFURY_CLK_ARMS && clk->n[cur + d] == 0 ) return cur + d;
+        if ( cur - d >= 0 && clk->n[cur - d] == 0 ) return cur - d;
+    }
+
+    for (i = 0; i < BITFURY_CLK_ARMS; i ++) {
+        total += clk->n[i];
+        best_mean = MAX (best_mean, autoclock_mean(clk, i));
+    }
+
+    best_score = -1;
+    for (i = 0; i < BITFURY_CLK_ARMS; i ++) {
+        score = autoclock_mean(clk, i);
+        if ( total > 1 )
+            score += BITFURY_AUTOCLOCK_EXPLORE * best_mean * sqrtf(2 * logf(total) / clk->n[i]);
+        // current clock wins ties, no switching while nothing is measured
+        if ( score > best_score || ( score == best_score && i == cur ) ) {
+            best_score = score;
+            best = i;
+        }
+    }
+    return best;
+}
+
+/* One auto-clock step per short stat: rewards current clock with effective hashrate
+   of the period, less HW errors share and overheat penalty, then picks next clock */
+void autoclock_sample(struct bitfury_info *info, bitfury_device_p dev, double period_mcs) {
+    struct bitfury_autoclk *clk = &dev->clk;
+    double now_mcs = tv2mcs ( get_cgtime() );
+    double window = now_mcs - tv2mcs ( &dev->rst_time );
+    struct bitfury_telemetry t;
+    float reward, over;
+    int arm = relative_bits_index(dev);
+    int i, new_clk;
+
+    if ( window > period_mcs ) window = period_mcs;
+    if ( window < 1e6 ) return; // switched right now, nothing measured
+
+    reward = shares_to_ghashes( calc_stat_f(dev->stat_tsf, window, now_mcs), window / 1e6 );
+    reward *= 1 - MIN (dev->hw_rate, 100) / 100;
+
+    slot_telemetry(info, dev->slot, &t);
+    over = t.temp - BITFURY_AUTOCLOCK_TEMP;
+    if ( over > 0 ) // 10 degrees of overheat take whole reward of the fastest clock
+        reward *= MAX (0, 1 - over / 10 * arm / (BITFURY_CLK_ARMS - 1));
+
+    for (i = 0; i < BITFURY_CLK_ARMS; i ++) {
+        clk->n[i] *= BITFURY_AUTOCLOCK_DISCOUNT;
+        clk->sum[i] *= BITFURY_AUTOCLOCK_DISCOUNT;
+    }
+    clk->n[arm] += 1;
+    clk->sum[arm] += reward;
+    clk->reward = reward;
+    clk->samples ++;
 
+    new_clk = BASE_OSC_BITS + autoclock_choose(clk, arm);
     if ( dev->osc6_bits_upd != new_clk ) {
          dev->osc6_bits_upd = new_clk;
          test_reclock(dev);
     }
 }
 
-
-
-
-double collect_chip_stats (bitfury_device_p dev, int loop) {
-    static int last_slot = 0;
+double collect_chip_stats (struct bitfury_info *info, bitfury_device_p dev, int loop) {
     // статистику стоит оценивать от последнего сброса устройства, иначе хрень будет.
     double now_mcs = tv2mcs ( get_cgtime() );
     double rst_msc = tv2mcs ( &dev->rst_time );
@@ -714,11 +820,16 @@ double collect_chip_stats (bitfury_device_p dev, int loop) {
 
 
     // if slot changed
-    if (n_slot != last_slot) {
+    if (n_slot != info->last_stat_slot) {
     #ifdef BITFURY_ENABLE_SHORT_STAT
-        float slot_temp = tm_i2c_gettemp(n_slot) * 0.1;
-        float slot_vc0 = tm_i2c_getcore0(n_slot) * 1000;
-        float slot_vc1 = tm_i2c_getcore1(n_slot) * 1000;
+        struct bitfury_slot_info *si = &info->slots[n_slot];
+        struct bitfury_telemetry t;
+        float slot_temp, slot_vc0, slot_vc1;
+
+        slot_telemetry(info, n_slot, &t);
+        slot_temp = t.temp;
+        slot_vc0 = t.vc0;
+        slot_vc1 = t.vc1;
 
         if (stat_dumps > 2) {
             // checking anomaly extremums 0.2 outbound
@@ -727,17 +838,17 @@ double collect_chip_stats (bitfury_device_p dev, int loop) {
             if (slot_vc0 > 2000) slot_vc0 = 1090;
             if (slot_vc1 > 2000) slot_vc1 = 1090;
 
-            slot_vc0 = vc0_median[n_slot] * 0.95 + slot_vc0 * 0.05;
-            slot_vc1 = vc1_median[n_slot] * 0.95 + slot_vc1 * 0.05;
+            slot_vc0 = si->vc0_median * 0.95 + slot_vc0 * 0.05;
+            slot_vc1 = si->vc1_median * 0.95 + slot_vc1 * 0.05;
         }
 
-        vc0_median[n_slot] = slot_vc0;
-        vc1_median[n_slot] = slot_vc1;
+        si->vc0_median = slot_vc0;
+        si->vc1_median = slot_vc1;
 
         // sprintf(stat_lines[n_slot], "[%X] T:%3.0f | V: %4.0f %4.0f| ", n_slot, slot_temp, slot_vc0, slot_vc1);
         sprintf(stat_lines[n_slot], "[%X] T:%3.0f | V: %4.2f %4.2f| ", n_slot, slot_temp, slot_vc0 / 1000, slot_vc1 / 1000);
     #endif
-        last_slot = n_slot;
+        info->last_stat_slot = n_slot;
     }
 
     len = strlen(stat_lines[n_slot]);
@@ -827,6 +938,7 @@ void check_not_hang(bitfury_device_p dev, double speed) {
         printf(CL_RESET);
         int i;
         for (i = 0; i < 3; i ++) dev->rbc_stat[i] = 0; // затереть статистику, типа устарела
+        autoclock_reset(dev);
     }
 
     if ( speed <= 1.0 ) {
@@ -847,7 +959,7 @@ void check_not_hang(bitfury_device_p dev, double speed) {
         dev->csw_back = 0;
         dev->csw_count ++;
         cgtime (&dev->rst_time);
-        dev->cch_stat[0] = dev->cch_stat[1] = dev->cch_stat[2] = dev->cch_stat[3] = 0; // полный сброс статистики автоподбора
+        autoclock_reset(dev); // полный сброс статистики автоподбора
     }
 
 }
@@ -855,42 +967,25 @@ void check_not_hang(bitfury_device_p dev, double speed) {
 static int64_t try_scanHash(thr_info_t *thr)
 {
 
-    static bitfury_device_t *devices, *dev; // TODO Move somewhere to appropriate place
+    struct bitfury_info *info = thr->cgpu->device_data;
+    bitfury_device_t *devices, *dev;
     int chip_count;
     int chip;
-    static no_work = 0;
     uint64_t hashes = 0;
-    static struct timeval now;
-    static struct timeval last_call;
-    static double call_period = 0;
+    struct timeval now;
 
 #define BIG_LINE_LENGTH 16384
     unsigned char line[BIG_LINE_LENGTH];
     int short_stat = 20;
-    static time_t short_out_t = 0;
-    static double short_out_tf = 0;
     int long_stat = 900;
-    static time_t long_out_t = 0;
     int long_long_stat = 60 * 30;
-    static time_t long_long_out_t;
     double elps_mcs = 0;
     double now_mcs = 0;
 
-
-    static char debug_log[1024];
-
-
-    static int last_chip = 0; // для кольцевого обхода по выдаче заданий
-
-
-
     int i;
 
-
-
-
-    loops_count ++;
-    call_count ++;
+    info->loops_count ++;
+    info->call_count ++;
 
 
     devices = thr->cgpu->devices;
@@ -898,23 +993,23 @@ static int64_t try_scanHash(thr_info_t *thr)
     cgtime(&now);
 
 
-    if ( loops_count == 1 ) {
+    if ( info->loops_count == 1 ) {
          init_devices  (devices, chip_count);
          load_opt_conf (devices, chip_count);
     }
 
 
-    if ( loops_count > 2 ) {
-        elps_mcs = tv_diff (&now, &last_call); //
-        if ( call_period == 0 )
-             call_period = elps_mcs;
+    if ( info->loops_count > 2 ) {
+        elps_mcs = tv_diff (&now, &info->last_call); //
+        if ( info->call_period == 0 )
+             info->call_period = elps_mcs;
         else
-             call_period = call_period * 0.999 + elps_mcs * 0.001;
+             info->call_period = info->call_period * 0.999 + elps_mcs * 0.001;
 
     }
 
 
-    last_call = now;
+    info->last_call = now;
     int w_pushed = 0;
 
 
@@ -925,29 +1020,29 @@ static int64_t try_scanHash(thr_info_t *thr)
     for (chip = 0; chip < chip_count; chip++) {
 
 
-       int code = work_push(thr, &devices[last_chip]);
+       int code = work_push(thr, &devices[info->last_chip]);
 
        if ( 2 == code ) w_pushed ++;
 
        if ( 0 == code ) {
            char msg[64];
-           sprintf(msg, "chip = %3d, lcount = %5d, pcount = %3d | ", chip, loops_count, works_prefetched(thr->cgpu) );
-           no_work ++;
-           strncat (debug_log, msg, 1023);
+           sprintf(msg, "chip = %3d, lcount = %5d, pcount = %3d | ", chip, info->loops_count, works_prefetched(thr->cgpu) );
+           info->no_work ++;
+           strncat (info->debug_log, msg, 1023);
 
-           if ( no_work % 10 == 0 || strlen(debug_log) > 800 ) {
+           if ( info->no_work % 10 == 0 || strlen(info->debug_log) > 800 ) {
                printf(CL_LT_CYAN);
-               applog(LOG_WARNING, debug_log);
+               applog(LOG_WARNING, info->debug_log);
                printf(CL_RESET);
-               debug_log[0] = 0;
+               info->debug_log[0] = 0;
            }
 
            // return 0;
            break;
        }
-       last_chip ++;
-       if (last_chip >= chip_count)
-           last_chip = 0;
+       info->last_chip ++;
+       if (info->last_chip >= chip_count)
+           info->last_chip = 0;
     }
 
 
@@ -963,20 +1058,20 @@ static int64_t try_scanHash(thr_info_t *thr)
     cgtime(&now);
     now_mcs = tv2mcs (&now);
 
-    if (short_out_t == 0) {
-        short_out_t = now.tv_sec;
-        short_out_tf = now_mcs;
+    if (info->short_out_t == 0) {
+        info->short_out_t = now.tv_sec;
+        info->short_out_tf = now_mcs;
     }
 
-    if ( loops_count < 10 )
+    if ( info->loops_count < 10 )
          return hashes; // обычно статистика не накапливается
 
-    int elapsed = now.tv_sec - short_out_t;
+    int elapsed = now.tv_sec - info->short_out_t;
 
 
     if (elapsed >= short_stat) {
-        elps_mcs = now_mcs - short_out_tf;
-        short_out_tf = now_mcs;
+        elps_mcs = now_mcs - info->short_out_tf;
+        info->short_out_tf = now_mcs;
         shares_first = shares_last = shares_total = 0;
 
         char color [15];
@@ -1001,11 +1096,11 @@ static int64_t try_scanHash(thr_info_t *thr)
            // сбор статистики по чипам
 
            bitfury_device_p dev = &devices[chip];
-           double speed = collect_chip_stats  (dev, maskv);         // for (chip; chip < n-chip; chip++)
+           double speed = collect_chip_stats  (info, dev, maskv);         // for (chip; chip < n-chip; chip++)
            check_not_hang (dev, speed); // проверки на слишком маленькую частоту
-           // AUTOFREQ: переключение частоты осциллятора принудительно (в режиме брутфорс или выбора лучшего)
-           if ( dev->csw_back > 50 && !dev->fixed_clk && maskv == 15 )
-                freq_bruteforce (dev);
+           // AUTOFREQ: выбор частоты осциллятора по результатам каждого периода
+           if ( !dev->fixed_clk )
+                autoclock_sample (info, dev, elps_mcs);
 
 
            gh[dev->slot][dev->fasync] = speed;
@@ -1025,12 +1120,30 @@ static int64_t try_scanHash(thr_info_t *thr)
 
         // sprintf(line, "vvvvwww SHORT stat %ds: wwwvvvv", short_stat);
         sprintf(line, "  ================== SHORT stat, elapsed %.3fs, no_work = %d, dump %d, call period = %.2f ms, count = %5d =================== ",
-                                                 elps_mcs / 1e6, no_work, stat_dumps, call_period / 1000, call_count );
-        no_work = 0;
-        call_count = 0;
+                                                 elps_mcs / 1e6, info->no_work, stat_dumps, info->call_period / 1000, info->call_count );
+        info->no_work = 0;
+        info->call_count = 0;
 
 
         applog(LOG_WARNING, line);
+
+        struct bitfury_loop_stats ls;
+
+        libbitfury_getLoopStats(info, &ls, true);
+        if (ls.loops) {
+            applog(LOG_WARNING, "SPI send loop %.2f ms (max %.2f ms), chips polled per loop %.1f, SPI transfers per loop %.1f, %.0f%% asleep till deadline",
+                                 ls.loop_us / ls.loops / 1000, ls.loop_us_max / 1000,
+                                 (double)ls.polls / ls.loops, (double)ls.transfers / ls.loops,
+                                 elps_mcs > 0 ? ls.sleep_us * 100 / elps_mcs : 0);
+        }
+
+        if (opt_bitfury_emulate) {
+            uint64_t emu_hashes;
+            unsigned emu_found;
+            spiemu_get_stats(&emu_hashes, &emu_found);
+            applog(LOG_WARNING, "Emulator verified %.1f Mhashes by SHA-256, nonces found %u", emu_hashes / 1e6, emu_found);
+        }
+
         double ghsm_saldo = 0;
 
 
@@ -1065,7 +1178,7 @@ static int64_t try_scanHash(thr_info_t *thr)
                 applog(LOG_WARNING, stat_lines[i]);
             }
 
-        elapsed = now.tv_sec - long_out_t;
+        elapsed = now.tv_sec - info->long_out_t;
         printf("\e[37;40m\r");
 
         rd_lock(&thr->cgpu->qlock);
@@ -1077,7 +1190,7 @@ static int64_t try_scanHash(thr_info_t *thr)
         applog(LOG_WARNING, line);
         // malloc_stats();
 #endif
-        short_out_t = now.tv_sec;
+        info->short_out_t = now.tv_sec;
 
         if ( maskv == 15 ) printf("%s", CL_RESET);
     }
@@ -1120,7 +1233,7 @@ static int64_t try_scanHash(thr_info_t *thr)
                 snprintf(stat_lines[i] + len, 256 - len, "- %4.1f + %4.1f = %4.1f Gh/s slot %X ", gh1h, gh2h, ghsum, i);
                 applog(LOG_WARNING, stat_lines[i]);
             }
-        long_out_t = now.tv_sec;
+        info->long_out_t = now.tv_sec;
         printf("%s", CL_RESET);
         // attroff(A_BOLD);
     }
@@ -1138,7 +1251,7 @@ static int64_t bitfury_scanHash(thr_info_t *thr) {
      int64_t result = try_scanHash(thr);
      cgtime (&now);
      time_ms = tv2mcs (&now) * 0.001 - time_ms; // how elapsed
-     if ( 0 == result ) nmsleep ( BITFURY_SCANHASH_DELAY - (int)time_ms ); // strict loop time
+     if ( 0 == result ) libbitfury_waitNextPoll ( thr->cgpu->device_data, BITFURY_SCANHASH_DELAY ); // next chip deadline, housekeeping at least every delay
      if (time_ms > 500)
          applog(LOG_WARNING, "#PERF: scanHash loop complete in %.1f msec", time_ms);
 
@@ -1184,9 +1297,21 @@ static void bitfury_shutdown(thr_info_t *thr)
     int chip_count;
     int i;
 
+    struct bitfury_info *info = thr->cgpu->device_data;
+
     chip_count = thr->cgpu->chip_count;
 
     applog(LOG_INFO, "INFO bitfury_shutdown");
+    if (info->pipeline) {
+        mutex_lock(&info->pipe_lock);
+        info->shutdown = true;
+        pthread_cond_broadcast(&info->pipe_cond);
+        mutex_unlock(&info->pipe_lock);
+        pthread_join(info->spi_thr, NULL);
+    }
+    info->shutdown = true;
+    if (info->telemetry)
+        pthread_join(info->telemetry_thr, NULL);
     libbitfury_shutdownChips(thr->cgpu->devices, chip_count);
 }
 
@@ -1265,12 +1390,38 @@ static bool bitfury_prepare(thr_info_t *thr)
 {
     struct timeval now;
     struct cgpu_info *cgpu = thr->cgpu;
+    struct bitfury_info *info = cgpu->device_data;
+    int i;
 
     cgtime(&now);
     get_datestamp(cgpu->init, &now);
 
     get_options(cgpu);
 
+    info->thr = thr;
+#ifdef BITFURY_METABANK
+    {
+        bool slot_on[BITFURY_MAXBANKS] = { false };
+
+        /* slots[] filled before scan loop reads them */
+        for (i = 0; i < cgpu->chip_count; i++)
+            slot_on[cgpu->devices[i].slot] = true;
+        poll_slots(info, slot_on);
+        info->telemetry = true;
+        if (pthread_create(&info->telemetry_thr, NULL, bitfury_telemetry_thread, (void *)cgpu))
+            quit(1, "Failed to create bitfury telemetry_thr");
+    }
+#endif
+    if (opt_bitfury_pipeline) {
+        mutex_init(&info->pipe_lock);
+        if (unlikely(pthread_cond_init(&info->pipe_cond, NULL)))
+            quit(1, "Failed to pthread_cond_init bitfury pipe_cond");
+        info->pipeline = true;
+        if (pthread_create(&info->spi_thr, NULL, libbitfury_spiThread, (void *)info))
+            quit(1, "Failed to create bitfury spi_thr");
+        applog(LOG_WARNING, "BITFURY: pipeline mode, SPI on own thread");
+    }
+
     applog(LOG_INFO, "INFO bitfury_prepare");
     return true;
 }
@@ -1279,9 +1430,10 @@ static bool bitfury_prepare(thr_info_t *thr)
 static struct api_data *bitfury_api_stats(struct cgpu_info *cgpu)
 {
     struct api_data *root = NULL;
-    static bitfury_device_t *devices;
+    bitfury_device_t *devices;
     struct timeval now;
     struct bitfury_info *info = cgpu->device_data;
+    struct bitfury_loop_stats ls;
     int shares_found, i;
     double ghash, ghash_sum = 0.0;
     unsigned int osc_bits;
@@ -1297,6 +1449,19 @@ static struct api_data *bitfury_api_stats(struct cgpu_info *cgpu)
         osc_bits = (unsigned int)devices[i].osc6_bits;
         root = api_add_int(root, mcw, &(devices[i].osc6_bits), false);
     }
+    for (i = 0; i < cgpu->chip_count; i++) {
+        struct bitfury_autoclk *clk = &devices[i].clk;
+        char clk_stat[128];
+        int arm, len = 0;
+
+        // osc6_bits:samples/mean Gh/s of every clock, then last reward
+        for (arm = 0; arm < BITFURY_CLK_ARMS; arm++)
+            len += snprintf(clk_stat + len, sizeof(clk_stat) - len, "%d:%.1f/%.2f ",
+                            BASE_OSC_BITS + arm, clk->n[arm], autoclock_mean(clk, arm));
+        snprintf(clk_stat + len, sizeof(clk_stat) - len, "last:%.2f%s", clk->reward, devices[i].fixed_clk ? " fixed" : "");
+        sprintf(mcw, "autoclock_%d_%d", devices[i].slot, devices[i].fasync);
+        root = api_add_string(root, mcw, clk_stat, true);
+    }
     for (i = 0; i < cgpu->chip_count; i++) {
         sprintf(mcw, "match_work_count_%d_%d", devices[i].slot, devices[i].fasync);
         root = api_add_uint(root, mcw, &(devices[i].matching_work), false);
@@ -1313,6 +1478,34 @@ static struct api_data *bitfury_api_stats(struct cgpu_info *cgpu)
         sprintf(mcw, "ghash_%d_%d", devices[i].slot, devices[i].fasync);
         root = api_add_double(root, mcw, &(ghash), true);
     }
+    for (i = 0; i < BITFURY_MAXBANKS && info->telemetry; i++) {
+        struct bitfury_telemetry t;
+        double age;
+
+        slot_telemetry(info, i, &t);
+        if (!t.reads)
+            continue;
+        age = t.updated.tv_sec ? tdiff(&now, &t.updated) : -1;
+        t.vc0 /= 1000;
+        t.vc1 /= 1000;
+        sprintf(mcw, "slot_%X_temp", i);
+        root = api_add_temp(root, mcw, &t.temp, true);
+        sprintf(mcw, "slot_%X_vc0", i);
+        root = api_add_volts(root, mcw, &t.vc0, true);
+        sprintf(mcw, "slot_%X_vc1", i);
+        root = api_add_volts(root, mcw, &t.vc1, true);
+        sprintf(mcw, "slot_%X_age", i);
+        root = api_add_elapsed(root, mcw, &age, true);
+        sprintf(mcw, "slot_%X_i2c_errors", i);
+        root = api_add_uint(root, mcw, &t.errors, true);
+    }
+    libbitfury_getLoopStats(info, &ls, false);
+    if (ls.loops) {
+        double loop_ms = ls.loop_us / ls.loops / 1000;
+        double xfers = (double)ls.transfers / ls.loops;
+        root = api_add_double(root, "spi_loop_ms", &loop_ms, true);
+        root = api_add_double(root, "spi_transfers_per_loop", &xfers, true);
+    }
     api_add_uint64(root, "total_hw", &(total_hw), false);
     api_add_double(root, "total_gh", &(ghash_sum), true);
     ghash_sum /= cgpu->chip_count;
@@ -7,6 +7,13 @@
 #define BITFURY_ENABLE_SHORT_STAT 1
 // #define BITFURY_AUTOCLOCK
 #define BITFURY_SCANHASH_DELAY 30
+#define BITFURY_TELEMETRY_MS 1000 // board controller poll period of the telemetry thread
+
+// auto-clock: discounted UCB over osc6_bits, one sample per short stat (20s)
+#define BITFURY_AUTOCLOCK_DISCOUNT 0.95 // weight of older samples, clock choice forgets ~20 samples back
+#define BITFURY_AUTOCLOCK_EXPLORE 0.1   // exploration bonus, relative to best mean hashrate
+#define BITFURY_AUTOCLOCK_PRIOR 3       // max samples trusted from saved opt conf
+#define BITFURY_AUTOCLOCK_TEMP 75       // slot temperature (C), above it faster clocks are penalized
 
 // #define FAST_CLOCK1
 
@@ -36,11 +36,17 @@
 
 #include "spidevc.h"
 #include "sha2.h"
+#include "sha2_lanes.h"
 
 #include <time.h>
+#include <errno.h>
+#include <stdlib.h>
 
 #define BITFURY_REFRESH_DELAY 100
 #define BITFURY_DETECT_TRIES 3000 / BITFURY_REFRESH_DELAY
+#define BITFURY_SCHED_SPREAD_NS 1450000000ULL	// first polls spread, about one job time
+#define BITFURY_SCHED_BURST_NS 5000000ULL	// chips due that close are polled in one burst
+#define BITFURY_SCHED_MIN_NS 20000000ULL	// never poll chip more often
 
 // 0 .... 31 bit
 // 1000 0011 0101 0110 1001 1010 1100 0111
@@ -123,6 +129,10 @@ static const unsigned SHA_K[64] = {
         0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
 };
 
+static const unsigned SHA_H0[8] = {
+	0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+};
+
 void t_print(struct timespec d_time) {
 	printf(" %ds %.2fms\n", (int)d_time.tv_sec, (double)d_time.tv_nsec / 1000000.0);
 }
@@ -220,7 +230,11 @@ void set_freq(int bits) {
     config_reg(4, 1); /* Enable slow oscillator */
 }
 
+/* SPI buffer, bus and bank OE belong to one user at a time: scan loop or SPI thread and reclocking */
+static pthread_mutex_t spi_bus_lock = PTHREAD_MUTEX_INITIALIZER;
+
 void send_reinit(int slot, int chip_index, int n) {
+	mutex_lock(&spi_bus_lock);
 	spi_clear_buf();
 	spi_emit_break();
     spi_emit_fasync(chip_index);
@@ -230,9 +244,11 @@ void send_reinit(int slot, int chip_index, int n) {
 	tm_i2c_set_oe(slot);
 	spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
 	tm_i2c_clear_oe(slot);
+	mutex_unlock(&spi_bus_lock);
 }
 
 void send_shutdown(int slot, int chip_index) {
+	mutex_lock(&spi_bus_lock);
 	spi_clear_buf();
 	spi_emit_break();
     spi_emit_fasync(chip_index);
@@ -241,9 +257,11 @@ void send_shutdown(int slot, int chip_index) {
 	tm_i2c_set_oe(slot);
 	spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
 	tm_i2c_clear_oe(slot);
+	mutex_unlock(&spi_bus_lock);
 }
 
 void send_freq(int slot, int chip_index, int bits) {
+	mutex_lock(&spi_bus_lock);
 	spi_clear_buf();
 	spi_emit_break();
     spi_emit_fasync(chip_index);
@@ -251,6 +269,7 @@ void send_freq(int slot, int chip_index, int bits) {
 	tm_i2c_set_oe(slot);
 	spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
 	tm_i2c_clear_oe(slot);
+	mutex_unlock(&spi_bus_lock);
 }
 
 unsigned int c_diff(unsigned ocounter, unsigned counter) {
@@ -306,13 +325,14 @@ int detect_chip(int chip_index) {
 	for (i = 0; i < BITFURY_DETECT_TRIES; i++) {
 		int j;
 		int counter;
+		unsigned offset;
 
 		spi_clear_buf();
 		spi_emit_break();
         spi_emit_fasync(chip_index);
-		spi_emit_data(0x3000, (void*)&atrvec[0], 19*4);
+		offset = spi_emit_data(0x3000, (void*)&atrvec[0], 19*4);
 		spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
-        memcpy(newbuf, spi_getrxbuf() + 4 + chip_index, 17*4);
+        memcpy(newbuf, spi_getrxbuf() + offset, 17*4);
 
 		clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
 		counter = get_counter(newbuf, oldbuf);
@@ -341,6 +361,7 @@ int libbitfury_detectChips(struct bitfury_device *devices) {
 	int n = 0;
 	int i;
 	static slot_on[BITFURY_MAXBANKS];
+	int banks = opt_bitfury_emulate ? BITFURY_MAXBANKS : BITFURY_HWBANKS;
 	struct timespec t1, t2;
 
 	if (tm_i2c_init() < 0) {
@@ -358,14 +379,14 @@ int libbitfury_detectChips(struct bitfury_device *devices) {
 	}
 
 	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &t1);
-	for (i = 0; i < BITFURY_MAXBANKS; i++) {
+	for (i = 0; i < banks; i++) {
 		int slot_detected = tm_i2c_detect(i) != -1;
 		slot_on[i] = slot_detected;
 		tm_i2c_clear_oe(i);
 		nmsleep(1);
 	}
 
-	for (i = 0; i < BITFURY_MAXBANKS; i++) {
+	for (i = 0; i < banks; i++) {
 //		if (slot_on[i]) {
             int chip_index = 0;
             int cnt_on_slot = 0;
@@ -490,6 +511,48 @@ int rehash(unsigned char *midstate, unsigned m7,
 	return 0;
 }
 
+/* Same check as rehash() for n tuples, sets found flags, returns number found */
+int rehash_batch(struct rehash_req *req, int n) {
+	uint32_t state[REHASH_BATCH][8];
+	uint32_t block[REHASH_BATCH][16];
+	int i, j, m, found = 0;
+
+	for (j = 0; j < n; j += m) {
+		m = n - j < REHASH_BATCH ? n - j : REHASH_BATCH;
+
+		/* Second block of header: m7, ntime, nbits, nonce and padding of 80 bytes */
+		memset(block, 0, m * sizeof(block[0]));
+		for (i = 0; i < m; i++) {
+			struct rehash_req *r = &req[j + i];
+
+			memcpy(state[i], r->midstate, 32);
+			block[i][0] = r->m7;
+			block[i][1] = r->ntime;
+			block[i][2] = r->nbits;
+			block[i][3] = r->nonce;
+			block[i][4] = 0x80000000;
+			block[i][15] = 80 * 8;
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, m);
+
+		/* SHA-256 of the 32 byte digest */
+		memset(block, 0, m * sizeof(block[0]));
+		for (i = 0; i < m; i++) {
+			memcpy(block[i], state[i], 32);
+			block[i][8] = 0x80000000;
+			block[i][15] = 32 * 8;
+			memcpy(state[i], SHA_H0, 32);
+		}
+		sha2_transform_lanes(state, (const uint32_t (*)[16])block, m);
+
+		for (i = 0; i < m; i++) {
+			req[j + i].found = state[i][7] == 0;
+			found += req[j + i].found;
+		}
+	}
+	return found;
+}
+
 void work_to_payload(struct bitfury_payload *p, struct work *w) {
 	unsigned char flipped_data[80];
 
@@ -500,263 +563,488 @@ void work_to_payload(struct bitfury_payload *p, struct work *w) {
 	p->m7 = bswap_32(*(unsigned *)(flipped_data + 64));
 	p->ntime = bswap_32(*(unsigned *)(flipped_data + 68));
 	p->nbits = bswap_32(*(unsigned *)(flipped_data + 72));
+	/* Job frame is sent every loop, expand it once per work */
+	ms3_compute((unsigned *)p);
 }
 
-int libbitfury_sendHashData(struct thr_info *thr, struct bitfury_device *bf, int chip_count) {
-	int chip_id;
-	int buf_diff;
-	static unsigned second_run;
+/* Emit job frame for chip, returns offset of chip read-back in rx buffer */
+static unsigned chip_emit_job(struct bitfury_device *d) {
+	spi_emit_break();
+	spi_emit_fasync(d->fasync);
+	return spi_emit_data(0x3000, (void*)&d->payload, 19*4);
+}
+
+static int chip_read(struct bitfury_device *d, unsigned offset) {
+	memcpy(d->newbuf, spi_getrxbuf() + offset, 17*4);
+	d->counter1 = get_counter(d->newbuf, d->oldbuf);
+	return get_diff(d->newbuf, d->oldbuf);
+}
 
-    int delay = 1450 / chip_count; // вписать планировку всех чипов в среднее время на задание
+static void chip_begin(struct bitfury_device *d, struct timespec *time) {
+	d->otimer1 = d->timer1;
+	d->timer1 = *time;
+	d->ocounter1 = d->counter1;
+}
 
-    extern unsigned loops_count;
+/* Chip reports nonce with one of these shifts */
+static const int nonce_shifts[NONCE_SHIFTS] = {
+	0, -0x00400000, -0x00800000, 0x02800000, 0x02C00000, 0x00400000
+};
 
+static void chip_check_nonces(struct rehash_req *r, struct bitfury_payload *p, unsigned pn) {
+	int k;
 
-    for (chip_id = 0; chip_id < chip_count; chip_id++) {
-        if ( loops_count < 10 ) nmsleep(delay);
+	for (k = 0; k < NONCE_SHIFTS; k++, r++) {
+		r->midstate = p->midstate;
+		r->m7 = p->m7;
+		r->ntime = p->ntime;
+		r->nbits = p->nbits;
+		r->nonce = pn + nonce_shifts[k];
+	}
+}
 
-		unsigned char *hexstr;
-		struct bitfury_device *d = bf + chip_id;
-		unsigned *newbuf = d->newbuf;
-		unsigned *oldbuf = d->oldbuf;
-		struct bitfury_payload *p = &(d->payload);
-		struct bitfury_payload *op = &(d->opayload);
-		struct bitfury_payload *o2p = &(d->o2payload);
-		struct timespec d_time;
-		struct timespec time;
-		int smart = 0;
-		int i;
-		int chip = d->fasync;
-		int slot = d->slot;
-
-
-
-
-
-		memcpy(atrvec, p, 20*4);
-		ms3_compute(atrvec);
-
-		clock_gettime(CLOCK_REALTIME, &(time));
-
-		if (!second_run) {
-			d->predict2 = d->predict1 = time;
-			d->counter1 = d->counter2 = 0;
-			d->req2_done = 0;
-		};
-
-		d_time = t_diff(time, d->predict1);
-		if (d_time.tv_sec < 0 && (d->req2_done || !smart)) {
-			d->otimer1 = d->timer1;
-			d->timer1 = time;
-			d->ocounter1 = d->counter1;
-			/* Programming next value */
-			tm_i2c_set_oe(slot);
-			spi_clear_buf(); spi_emit_break();
-			spi_emit_fasync(chip);
-			spi_emit_data(0x3000, (void*)&atrvec[0], 19*4);
-			if (smart) {
-				config_reg(3,0);
-			}
-			clock_gettime(CLOCK_REALTIME, &(time));
-			d_time = t_diff(time, d->predict1);
-			spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
-			memcpy(newbuf, spi_getrxbuf()+4 + chip, 17*4);
-			d->counter1 = get_counter(newbuf, oldbuf);
-			buf_diff = get_diff(newbuf, oldbuf);
-			if (buf_diff > 4 || (d->counter1 > 0 && d->counter1 < 0x00400000 / 2)) {
-				if (buf_diff > 4) {
-//					printf("AAA        chip_id: %d, buf_diff: %d, counter: %08x\n", chip_id, buf_diff, d->counter1);
-					memcpy(atrvec, p, 20*4);
-					ms3_compute(atrvec);
-					spi_clear_buf(); spi_emit_break();
-					spi_emit_fasync(chip);
-					spi_emit_data(0x3000, (void*)&atrvec[0], 19*4);
-					clock_gettime(CLOCK_REALTIME, &(time));
-					d_time = t_diff(time, d->predict1);
-					spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
-					memcpy(newbuf, spi_getrxbuf()+4 + chip, 17*4);
-					buf_diff = get_diff(newbuf, oldbuf);
-					d->counter1 = get_counter(newbuf, oldbuf);
-//					printf("AAA _222__ chip_id: %d, buf_diff: %d, counter: %08x\n", chip_id, buf_diff, d->counter1);
-				}
-			}
+/* First shift in order that produced a valid share, 0 if none */
+static unsigned chip_nonce_found(struct rehash_req *r) {
+	int k;
 
-			tm_i2c_clear_oe(slot);
-
-			d->job_switched = newbuf[16] != oldbuf[16];
-
-			int i;
-			int results_num = 0;
-			int found = 0;
-			unsigned * results = d->results;
-
-			d->old_nonce = 0;
-			d->future_nonce = 0;
-			for (i = 0; i < 16; i++) {
-				if (oldbuf[i] != newbuf[i] && op && o2p) {
-					unsigned pn; //possible nonce
-					unsigned int s = 0; //TODO zero may be solution
-					unsigned int old_f = 0;
-					if ((newbuf[i] & 0xFF) == 0xE0)
-						continue;
-					pn = decnonce(newbuf[i]);
-					if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn)) s = pn;
-					else if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn-0x00400000)) s = pn - 0x00400000;
-					else if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn-0x00800000)) s = pn - 0x00800000;
-					else if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn+0x02800000)) s = pn + 0x02800000;
-					else if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn+0x02C00000)) s = pn + 0x02C00000;
-					else if(rehash(op->midstate, op->m7, op->ntime, op->nbits, pn+0x00400000)) s = pn + 0x00400000;
-					if (s) {
-						results[results_num++] = bswap_32(s);
-						found++;
-					}
-
-					s = 0;
-					pn = decnonce(newbuf[i]);
-					if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn)) s = pn;
-					else if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn-0x00400000)) s = pn - 0x00400000;
-					else if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn-0x00800000)) s = pn - 0x00800000;
-					else if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn+0x02800000)) s = pn + 0x02800000;
-					else if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn+0x02C00000)) s = pn + 0x02C00000;
-					else if(rehash(o2p->midstate, o2p->m7, o2p->ntime, o2p->nbits, pn+0x00400000)) s = pn + 0x00400000;
-					if (s) {
-						d->old_nonce = bswap_32(s);
-						found++;
-					}
-
-					s = 0;
-					pn = decnonce(newbuf[i]);
-					if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn)) s = pn;
-					else if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn-0x00400000)) s = pn - 0x00400000;
-					else if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn-0x00800000)) s = pn - 0x00800000;
-					else if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn+0x02800000)) s = pn + 0x02800000;
-					else if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn+0x02C00000)) s = pn + 0x02C00000;
-					else if(rehash(p->midstate, p->m7, p->ntime, p->nbits, pn+0x00400000)) s = pn + 0x00400000;
-					if (s) {
-						d->future_nonce = bswap_32(s);
-						found++;
-					}
-					if (!found) {
-						//printf("AAA Strange: %08x, chip_id: %d\n", pn, chip_id);
-						d->hw_errors++;
-						inc_hw_errors(thr);
-					}
-				}
-			}
-			d->results_n = results_num;
+	for (k = 0; k < NONCE_SHIFTS; k++)
+		if (r[k].found)
+			return r[k].nonce;
+	return 0;
+}
+
+/* Demultiplex results read back from chip, update rate prediction and rotate payloads */
+static void chip_complete(struct thr_info *thr, struct bitfury_device *d, struct timespec time) {
+	unsigned *newbuf = d->newbuf;
+	unsigned *oldbuf = d->oldbuf;
+	struct bitfury_payload *p = &(d->payload);
+	struct bitfury_payload *op = &(d->opayload);
+	struct bitfury_payload *o2p = &(d->o2payload);
+	struct timespec d_time;
+	int smart = 0;
+	int i;
+	int results_num = 0;
+	int found = 0;
+	unsigned * results = d->results;
+	struct rehash_req req[16 * 3 * NONCE_SHIFTS], *r;
+	int req_n = 0;
+
+	d->job_switched = newbuf[16] != oldbuf[16];
+
+	/* Every changed result word against op, o2p and p with all shifts, verified in one batch */
+	for (i = 0; i < 16; i++) {
+		if (oldbuf[i] != newbuf[i] && op && o2p) {
+			unsigned pn; //possible nonce
+			if ((newbuf[i] & 0xFF) == 0xE0)
+				continue;
+			pn = decnonce(newbuf[i]);
+			chip_check_nonces(&req[req_n], op, pn);
+			chip_check_nonces(&req[req_n + NONCE_SHIFTS], o2p, pn);
+			chip_check_nonces(&req[req_n + 2 * NONCE_SHIFTS], p, pn);
+			req_n += 3 * NONCE_SHIFTS;
+		}
+	}
+	if (req_n)
+		rehash_batch(req, req_n);
+
+	d->old_nonce = 0;
+	d->future_nonce = 0;
+	for (r = req; r < req + req_n; r += 3 * NONCE_SHIFTS) {
+		unsigned int s; //TODO zero may be solution
 
-			if (smart) {
-				d_time = t_diff(d->timer2, d->timer1);
+		if ((s = chip_nonce_found(r))) {
+			results[results_num++] = bswap_32(s);
+			found++;
+		}
+		if ((s = chip_nonce_found(r + NONCE_SHIFTS))) {
+			d->old_nonce = bswap_32(s);
+			found++;
+		}
+		if ((s = chip_nonce_found(r + 2 * NONCE_SHIFTS))) {
+			d->future_nonce = bswap_32(s);
+			found++;
+		}
+		if (!found) {
+			//printf("AAA Strange: %08x, chip_id: %d\n", pn, chip_id);
+			d->hw_errors++;
+			inc_hw_errors(thr);
+		}
+	}
+	d->results_n = results_num;
+
+	if (smart) {
+		d_time = t_diff(d->timer2, d->timer1);
+	} else {
+		d_time = t_diff(d->otimer1, d->timer1);
+	}
+	d->counter1 = get_counter(newbuf, oldbuf);
+	if (d->counter2 || !smart) {
+		int shift;
+		int cycles;
+		int req1_cycles;
+		long long unsigned int period;
+		double ns;
+		unsigned full_cycles, half_cycles;
+		double full_delay, half_delay;
+		long long unsigned delta;
+		struct timespec t_delta;
+		double mhz;
+		int ccase;
+
+		shift = 800000;
+		if (smart) {
+			cycles = d->counter1 < d->counter2 ? 0x00400000 - d->counter2 + d->counter1 : d->counter1 - d->counter2; // + 0x003FFFFF;
+		} else {
+			if (d->counter1 > (0x00400000 - shift * 2) && d->ocounter1 > (0x00400000 - shift)) {
+				cycles = 0x00400000 - d->ocounter1 + d->counter1; // + 0x003FFFFF;
+				ccase = 1;
 			} else {
-				d_time = t_diff(d->otimer1, d->timer1);
+				cycles = d->counter1 > d->ocounter1 ? d->counter1 - d->ocounter1 : 0x00400000 - d->ocounter1 + d->counter1;
+				ccase = 2;
 			}
-			d->counter1 = get_counter(newbuf, oldbuf);
-			if (d->counter2 || !smart) {
-				int shift;
-				int cycles;
-				int req1_cycles;
-				long long unsigned int period;
-				double ns;
-				unsigned full_cycles, half_cycles;
-				double full_delay, half_delay;
-				long long unsigned delta;
-				struct timespec t_delta;
-				double mhz;
-				int ccase;
-
-				shift = 800000;
-				if (smart) {
-					cycles = d->counter1 < d->counter2 ? 0x00400000 - d->counter2 + d->counter1 : d->counter1 - d->counter2; // + 0x003FFFFF;
-				} else {
-					if (d->counter1 > (0x00400000 - shift * 2) && d->ocounter1 > (0x00400000 - shift)) {
-						cycles = 0x00400000 - d->ocounter1 + d->counter1; // + 0x003FFFFF;
-						ccase = 1;
-					} else {
-						cycles = d->counter1 > d->ocounter1 ? d->counter1 - d->ocounter1 : 0x00400000 - d->ocounter1 + d->counter1;
-						ccase = 2;
-					}
-				}
-				req1_cycles = 0x003FFFFF - d->counter1;
-				period = (long long unsigned int)d_time.tv_sec * 1000000000ULL + (long long unsigned int)d_time.tv_nsec;
-				ns = (double)period / (double)(cycles);
-				mhz = 1.0 / ns * 65.0 * 1000.0;
+		}
+		req1_cycles = 0x003FFFFF - d->counter1;
+		period = (long long unsigned int)d_time.tv_sec * 1000000000ULL + (long long unsigned int)d_time.tv_nsec;
+		ns = (double)period / (double)(cycles);
+		mhz = 1.0 / ns * 65.0 * 1000.0;
 
-				if (d->counter1 > 0 && d->counter1 < 0x001FFFFF) {
-					//printf("//AAA chip_id %2d: %llu ms, req1_cycles: %08u,  counter1: %08d, ocounter1: %08d, counter2: %08d, cycles: %08d, ns: %.2f, mhz: %.2f \n", chip_id, period / 1000000ULL, req1_cycles, d->counter1, d->ocounter1, d->counter2, cycles, ns, mhz);
-				}
-				if (ns > 2000.0 || ns < 20) {
-					//printf("AAA %d!Stupid ns chip_id %2d: %llu ms, req1_cycles: %08u,  counter1: %08d, ocounter1: %08d, counter2: %08d, cycles: %08d, ns: %.2f, mhz: %.2f \n", ccase, chip_id, period / 1000000ULL, req1_cycles, d->counter1, d->ocounter1, d->counter2, cycles, ns, mhz);
-					ns = 200.0;
-				} else {
-					d->ns = ns;
-					d->mhz = mhz;
-				}
+		if (d->counter1 > 0 && d->counter1 < 0x001FFFFF) {
+			//printf("//AAA chip_id %2d: %llu ms, req1_cycles: %08u,  counter1: %08d, ocounter1: %08d, counter2: %08d, cycles: %08d, ns: %.2f, mhz: %.2f \n", chip_id, period / 1000000ULL, req1_cycles, d->counter1, d->ocounter1, d->counter2, cycles, ns, mhz);
+		}
+		if (ns > 2000.0 || ns < 20) {
+			//printf("AAA %d!Stupid ns chip_id %2d: %llu ms, req1_cycles: %08u,  counter1: %08d, ocounter1: %08d, counter2: %08d, cycles: %08d, ns: %.2f, mhz: %.2f \n", ccase, chip_id, period / 1000000ULL, req1_cycles, d->counter1, d->ocounter1, d->counter2, cycles, ns, mhz);
+			ns = 200.0;
+		} else {
+			d->ns = ns;
+			d->mhz = mhz;
+		}
 
-				if (smart) {
-					half_cycles = req1_cycles + shift;
-					full_cycles = 0x003FFFFF - 2 * shift;
-				} else {
-					half_cycles = 0;
-					full_cycles = req1_cycles > shift ? req1_cycles - shift : req1_cycles + 0x00400000 - shift;
-				}
-				half_delay = (double)half_cycles * ns * (1 +0.92);
-				full_delay = (double)full_cycles * ns;
-				delta = (long long unsigned)(full_delay + half_delay);
-				t_delta.tv_sec = delta / 1000000000ULL;
-				t_delta.tv_nsec = delta - t_delta.tv_sec * 1000000000ULL;
-				d->predict1 = t_add(time, t_delta);
-
-				if (smart) {
-					half_cycles = req1_cycles + shift;
-					full_cycles = 0;
-				} else {
-					full_cycles = req1_cycles + shift;
-				}
-				half_delay = (double)half_cycles * ns * (1 + 0.92);
-				full_delay = (double)full_cycles * ns;
-				delta = (long long unsigned)(full_delay + half_delay);
-
-				t_delta.tv_sec = delta / 1000000000ULL;
-				t_delta.tv_nsec = delta - t_delta.tv_sec * 1000000000ULL;
-				d->predict2 = t_add(time, t_delta);
-				d->req2_done = 0; d->req1_done = 0;
-			}
+		if (smart) {
+			half_cycles = req1_cycles + shift;
+			full_cycles = 0x003FFFFF - 2 * shift;
+		} else {
+			half_cycles = 0;
+			full_cycles = req1_cycles > shift ? req1_cycles - shift : req1_cycles + 0x00400000 - shift;
+		}
+		half_delay = (double)half_cycles * ns * (1 +0.92);
+		full_delay = (double)full_cycles * ns;
+		delta = (long long unsigned)(full_delay + half_delay);
+		t_delta.tv_sec = delta / 1000000000ULL;
+		t_delta.tv_nsec = delta - t_delta.tv_sec * 1000000000ULL;
+		d->predict1 = t_add(time, t_delta);
+
+		if (smart) {
+			half_cycles = req1_cycles + shift;
+			full_cycles = 0;
+		} else {
+			full_cycles = req1_cycles + shift;
+		}
+		half_delay = (double)half_cycles * ns * (1 + 0.92);
+		full_delay = (double)full_cycles * ns;
+		delta = (long long unsigned)(full_delay + half_delay);
+
+		t_delta.tv_sec = delta / 1000000000ULL;
+		t_delta.tv_nsec = delta - t_delta.tv_sec * 1000000000ULL;
+		d->predict2 = t_add(time, t_delta);
+		d->req2_done = 0; d->req1_done = 0;
+	}
 
-			if (d->job_switched) {
-				memcpy(o2p, op, sizeof(struct bitfury_payload));
-				memcpy(op, p, sizeof(struct bitfury_payload));
-				memcpy(oldbuf, newbuf, 17 * 4);
-			}
+	if (d->job_switched) {
+		memcpy(o2p, op, sizeof(struct bitfury_payload));
+		memcpy(op, p, sizeof(struct bitfury_payload));
+		memcpy(oldbuf, newbuf, 17 * 4);
+	}
+}
+
+/* One chip per SPI transaction, bank output enabled around each of them */
+static void send_chip(struct thr_info *thr, struct bitfury_device *d, struct timespec time) {
+	struct bitfury_loop_stats *stats = &((struct bitfury_info *)thr->cgpu->device_data)->loop_stats;
+	unsigned offset;
+	int buf_diff;
+
+	mutex_lock(&spi_bus_lock);
+	chip_begin(d, &time);
+	/* Programming next value */
+	tm_i2c_set_oe(d->slot);
+	spi_clear_buf();
+	offset = chip_emit_job(d);
+	clock_gettime(CLOCK_MONOTONIC, &(time));
+	spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
+	stats->transfers++;
+	buf_diff = chip_read(d, offset);
+	if (buf_diff > 4) {
+		spi_clear_buf();
+		offset = chip_emit_job(d);
+		clock_gettime(CLOCK_MONOTONIC, &(time));
+		spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
+		stats->transfers++;
+		chip_read(d, offset);
+	}
+	tm_i2c_clear_oe(d->slot);
+	stats->polls++;
+	mutex_unlock(&spi_bus_lock);
+
+	chip_complete(thr, d, time);
+}
+
+/* All chips of bank job in single SPI_IOC_MESSAGE, read-backs demultiplexed from shared rx buffer */
+static void bank_xfer(struct bitfury_info *info, struct bitfury_bankjob *job) {
+	struct bitfury_device **chips = job->chips;
+	unsigned offsets[BITFURY_BANKCHIPS];
+	int retry[BITFURY_BANKCHIPS];
+	int i, n = job->n, n_retry = 0;
+	int slot = chips[0]->slot;
+
+	mutex_lock(&spi_bus_lock);
+	clock_gettime(CLOCK_MONOTONIC, &(job->time));
+	spi_clear_buf();
+	for (i = 0; i < n; i++) {
+		chip_begin(chips[i], &job->time);
+		offsets[i] = chip_emit_job(chips[i]);
+		spi_emit_seg();
+	}
+	tm_i2c_set_oe(slot);
+	clock_gettime(CLOCK_MONOTONIC, &(job->time));
+	spi_txrx_batch();
+	info->loop_stats.transfers++;
+	for (i = 0; i < n; i++)
+		if (chip_read(chips[i], offsets[i]) > 4)
+			retry[n_retry++] = i;
+
+	if (n_retry) {
+		spi_clear_buf();
+		for (i = 0; i < n_retry; i++) {
+			offsets[retry[i]] = chip_emit_job(chips[retry[i]]);
+			spi_emit_seg();
 		}
+		clock_gettime(CLOCK_MONOTONIC, &(job->time));
+		spi_txrx_batch();
+		info->loop_stats.transfers++;
+		for (i = 0; i < n_retry; i++)
+			chip_read(chips[retry[i]], offsets[retry[i]]);
+	}
+	tm_i2c_clear_oe(slot);
+	info->loop_stats.polls += n;
+	mutex_unlock(&spi_bus_lock);
+}
 
-		clock_gettime(CLOCK_REALTIME, &(time));
-		d_time = t_diff(time, d->predict2);
-		if (d_time.tv_sec < 0 && !d->req2_done) {
-			if(smart) {
-				d->otimer2 = d->timer2;
-				d->timer2 = time;
-				spi_clear_buf();
-				spi_emit_break();
-				spi_emit_fasync(chip);
-				spi_emit_data(0x3000, (void*)&atrvec[0], 19*4);
-				if (smart) {
-					config_reg(3,1);
-				}
-				tm_i2c_set_oe(slot);
-				spi_txrx(spi_gettxbuf(), spi_getrxbuf(), spi_getbufsz());
-				tm_i2c_clear_oe(slot);
-				memcpy(newbuf, spi_getrxbuf()+4 + chip, 17*4);
-				d->counter2 = get_counter(newbuf, oldbuf);
+static void bank_complete(struct thr_info *thr, struct bitfury_bankjob *job) {
+	int i;
 
-				d->req2_done = 1;
-			} else {
-				d->req2_done = 1;
-			}
+	for (i = 0; i < job->n; i++)
+		chip_complete(thr, job->chips[i], job->time);
+}
+
+/* Owns the SPI bus in pipeline mode: transfers queued bank jobs in order */
+void *libbitfury_spiThread(void *userdata) {
+	struct bitfury_info *info = userdata;
+	struct bitfury_bankjob *job;
+
+	RenameThread("bitfury_spi");
+
+	mutex_lock(&info->pipe_lock);
+	while (!info->shutdown) {
+		if (info->jobs_done >= info->jobs_n) {
+			pthread_cond_wait(&info->pipe_cond, &info->pipe_lock);
+			continue;
 		}
+		job = &info->jobs[info->jobs_done];
+		mutex_unlock(&info->pipe_lock);
+
+		bank_xfer(info, job);
+
+		mutex_lock(&info->pipe_lock);
+		info->jobs_done++;
+		pthread_cond_broadcast(&info->pipe_cond);
+	}
+	mutex_unlock(&info->pipe_lock);
+	return NULL;
+}
+
+/* Hands jobs to SPI thread and verifies bank N while bank N+1 is on the wire */
+static void pipe_banks(struct thr_info *thr, struct bitfury_info *info, int n) {
+	int i;
+
+	mutex_lock(&info->pipe_lock);
+	info->jobs_done = 0;
+	info->jobs_n = n;
+	pthread_cond_broadcast(&info->pipe_cond);
+	for (i = 0; i < n; i++) {
+		while (info->jobs_done <= i)
+			pthread_cond_wait(&info->pipe_cond, &info->pipe_lock);
+		mutex_unlock(&info->pipe_lock);
+
+		bank_complete(thr, &info->jobs[i]);
+
+		mutex_lock(&info->pipe_lock);
+	}
+	info->jobs_n = info->jobs_done = 0;
+	mutex_unlock(&info->pipe_lock);
+}
+
+static int t_before(const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static struct timespec t_ns(long long unsigned ns) {
+	struct timespec t;
+
+	t.tv_sec = ns / 1000000000ULL;
+	t.tv_nsec = ns % 1000000000ULL;
+	return t;
+}
+
+static void sched_push(struct bitfury_info *info, struct bitfury_device *d) {
+	struct bitfury_device **heap = info->sched_heap;
+	int i = info->sched_n++;
+
+	while (i) {
+		int parent = (i - 1) / 2;
+
+		if (!t_before(&d->predict1, &heap[parent]->predict1))
+			break;
+		heap[i] = heap[parent];
+		i = parent;
 	}
-	second_run = 1;
+	heap[i] = d;
+}
+
+static struct bitfury_device *sched_pop(struct bitfury_info *info) {
+	struct bitfury_device **heap = info->sched_heap;
+	struct bitfury_device *top = heap[0];
+	struct bitfury_device *last = heap[--info->sched_n];
+	int n = info->sched_n;
+	int i = 0;
+
+	while (2 * i + 1 < n) {
+		int child = 2 * i + 1;
+
+		if (child + 1 < n && t_before(&heap[child + 1]->predict1, &heap[child]->predict1))
+			child++;
+		if (!t_before(&heap[child]->predict1, &last->predict1))
+			break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	if (n)
+		heap[i] = last;
+	return top;
+}
+
+/* First polls are spread over one job time, so chips keep apart afterwards */
+static void sched_start(struct bitfury_info *info, struct bitfury_device *bf, int chip_count, struct timespec *now) {
+	int chip_id;
+
+	info->sched_n = 0;
+	for (chip_id = 0; chip_id < chip_count; chip_id++) {
+		struct bitfury_device *d = bf + chip_id;
+
+		d->predict2 = d->predict1 = t_add(*now, t_ns(BITFURY_SCHED_SPREAD_NS / chip_count * chip_id));
+		d->counter1 = d->counter2 = 0;
+		d->req2_done = 0;
+		sched_push(info, d);
+	}
+}
+
+static int chip_cmp(const void *a, const void *b) {
+	const struct bitfury_device *da = *(struct bitfury_device * const *)a;
+	const struct bitfury_device *db = *(struct bitfury_device * const *)b;
+
+	return da < db ? -1 : da > db;
+}
+
+/* Polls chips whose deadline falls within burst window, chips are in bank order in bf[] */
+int libbitfury_sendHashData(struct thr_info *thr, struct bitfury_device *bf, int chip_count) {
+	struct bitfury_info *info = thr->cgpu->device_data;
+	struct bitfury_device *due[BITFURY_MAXCHIPS];
+	struct bitfury_bankjob *job = NULL;
+	int due_n = 0, jobs_n = 0;
+	struct timespec loop_start, loop_end, horizon;
+	double loop_us;
+	int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &loop_start);
+	if (!info->sched_n)
+		sched_start(info, bf, chip_count, &loop_start);
+
+	horizon = t_add(loop_start, t_ns(BITFURY_SCHED_BURST_NS));
+	while (info->sched_n && t_before(&info->sched_heap[0]->predict1, &horizon))
+		due[due_n++] = sched_pop(info);
+	qsort(due, due_n, sizeof(due[0]), chip_cmp);
+
+	for (i = 0; i < due_n; i++) {
+		struct bitfury_device *d = due[i];
+
+		if (!info->pipeline && !opt_bitfury_spi_batch) {
+			struct timespec time;
+
+			clock_gettime(CLOCK_MONOTONIC, &(time));
+			send_chip(thr, d, time);
+			continue;
+		}
+		if (!job || job->chips[0]->slot != d->slot || job->n == BITFURY_BANKCHIPS) {
+			job = &info->jobs[jobs_n++];
+			job->n = 0;
+		}
+		job->chips[job->n++] = d;
+	}
+	if (info->pipeline) {
+		pipe_banks(thr, info, jobs_n);
+	} else {
+		for (i = 0; i < jobs_n; i++) {
+			bank_xfer(info, &info->jobs[i]);
+			bank_complete(thr, &info->jobs[i]);
+		}
+	}
+
+	/* Back to heap, not earlier than minimal poll interval after this poll */
+	for (i = 0; i < due_n; i++) {
+		struct bitfury_device *d = due[i];
+		struct timespec earliest = t_add(d->timer1, t_ns(BITFURY_SCHED_MIN_NS));
+
+		if (t_before(&d->predict1, &earliest))
+			d->predict1 = earliest;
+		sched_push(info, d);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &loop_end);
+	loop_us = (double)(loop_end.tv_sec - loop_start.tv_sec) * 1e6 +
+		  (double)(loop_end.tv_nsec - loop_start.tv_nsec) * 1e-3;
+	mutex_lock(&spi_bus_lock);
+	info->loop_stats.loops++;
+	info->loop_stats.loop_us += loop_us;
+	if (loop_us > info->loop_stats.loop_us_max)
+		info->loop_stats.loop_us_max = loop_us;
+	mutex_unlock(&spi_bus_lock);
+
+	return 0;
+}
+
+/* Sleeps until the next chip deadline, at most max_ms */
+void libbitfury_waitNextPoll(struct bitfury_info *info, int max_ms) {
+	struct timespec now, wake;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	wake = t_add(now, t_ns((long long unsigned)max_ms * 1000000ULL));
+	if (info->sched_n && t_before(&info->sched_heap[0]->predict1, &wake))
+		wake = info->sched_heap[0]->predict1;
+	if (!t_before(&now, &wake))
+		return;
+	mutex_lock(&spi_bus_lock);
+	info->loop_stats.sleep_us += (double)(wake.tv_sec - now.tv_sec) * 1e6 +
+				     (double)(wake.tv_nsec - now.tv_nsec) * 1e-3;
+	mutex_unlock(&spi_bus_lock);
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR)
+		;
+}
 
-	return;
+/* Copies the board's loop stats, and starts them afresh with reset */
+void libbitfury_getLoopStats(struct bitfury_info *info, struct bitfury_loop_stats *stats, bool reset) {
+	mutex_lock(&spi_bus_lock);
+	*stats = info->loop_stats;
+	if (reset)
+		memset(&info->loop_stats, 0, sizeof(info->loop_stats));
+	mutex_unlock(&spi_bus_lock);
 }
 
 int libbitfury_readHashData(unsigned int *res) {
@@ -33,7 +33,8 @@
 
 
 #define BITFURY_MAXCHIPS 256
-#define BITFURY_MAXBANKS 16
+#define BITFURY_MAXBANKS 32	// every I2C slot address, the emulator can fill them all
+#define BITFURY_HWBANKS 16	// slots probed on a real board
 #define BITFURY_BANKCHIPS 8
 
 #endif
@@ -43,6 +44,7 @@
 
 #define BITFURY_MAXCHIPS 100
 #define BITFURY_MAXBANKS 1
+#define BITFURY_HWBANKS 1
 #define BITFURY_BANKCHIPS 100
 #define BITFURY_SCANHASH_DELAY 100
 
@@ -53,13 +55,23 @@
 
 struct bitfury_payload {
 	unsigned char midstate[32];
-	unsigned int junk[8];
+	unsigned int junk[8];		// ms3 state, filled by work_to_payload()
 	unsigned m7;
 	unsigned ntime;
 	unsigned nbits;
 	unsigned nnonce;
 };
 
+#define BITFURY_CLK_ARMS 4 // osc6_bits BASE_OSC_BITS .. BASE_OSC_BITS + 3 tried by auto-clock
+
+/* Auto-clock state: discounted UCB statistics of every osc6_bits choice */
+struct bitfury_autoclk {
+	float n[BITFURY_CLK_ARMS];   // discounted count of samples taken at the clock
+	float sum[BITFURY_CLK_ARMS]; // discounted sum of rewards (effective Gh/s)
+	int samples;                 // samples since last reset
+	float reward;                // last sample
+};
+
 struct bitfury_device {
 	unsigned osc6_bits;
     unsigned osc6_bits_upd;
@@ -87,7 +99,7 @@ struct bitfury_device {
 	struct timespec timer2;
 	struct timespec otimer1;
 	struct timespec otimer2;
-	struct timespec predict1;
+	struct timespec predict1;	// next poll deadline, CLOCK_MONOTONIC
 	struct timespec predict2;
 	unsigned int counter1, counter2;
 	unsigned int ocounter1, ocounter2;
@@ -105,9 +117,9 @@ struct bitfury_device {
     float            eff_speed;       // рассчитывается из big_stat
     float            hw_rate;
     bool             fixed_clk;    
-    float            rbc_stat[4];     // rate-by-clock: 53, 54, 55, 56 associated to chip hash-rate
-    short            big_stat[4][50];
-    int              cch_stat[4];     // clock choice stat: сколько выбирался каждый клок по итогам соревнования
+    float            rbc_stat[BITFURY_CLK_ARMS];     // rate-by-clock: 53, 54, 55, 56 associated to chip hash-rate
+    short            big_stat[BITFURY_CLK_ARMS][50];
+    struct bitfury_autoclk clk;       // online clock choice, see autoclock_sample()
     int              csw_back;        // clock switch back: сколько статистики прошло, после переключения частоты
     int              csw_count;       // clock switch count: сколько раз сменялась частота принудительно
     struct timeval   rst_time;        // reset time: когда устройство сбрасывалось последний раз
@@ -118,13 +130,106 @@ struct bitfury_device {
 	double gh_stat[8];
 };
 
+/* SPI loop timing of a board, accumulated by libbitfury_sendHashData(). The
+ * SPI thread counts transfers too, so all of it is kept under spi_bus_lock,
+ * read it with libbitfury_getLoopStats() */
+struct bitfury_loop_stats {
+	unsigned loops;
+	unsigned polls;      // chip frames exchanged
+	unsigned transfers;  // SPI round trips (ioctl batches)
+	double loop_us;      // summary time spent in send loops
+	double loop_us_max;
+	double sleep_us;     // waiting for the next chip deadline
+};
+
+/* Nonce candidate, rehash_batch() verifies REHASH_BATCH of them per pass */
+#define REHASH_BATCH 64
+#define NONCE_SHIFTS 6
+
+struct rehash_req {
+	const unsigned char *midstate;
+	unsigned m7;
+	unsigned ntime;
+	unsigned nbits;
+	unsigned nonce;
+	int found;
+};
+
+/* Board controller readings of one slot, as published by telemetry thread */
+struct bitfury_telemetry {
+	float temp;
+	float vc0, vc1;		// core voltages, mV
+	struct timeval updated;	// last good reading, age of values
+	unsigned reads;
+	unsigned errors;	// polls with lost or garbled I2C answer
+};
+
+struct bitfury_slot_info {
+	unsigned seq;		// seqlock of t: odd while telemetry thread writes it
+	struct bitfury_telemetry t;
+	double vc0_median, vc1_median;	// scan loop only
+};
+
+/* Chips of one bank exchanged in one SPI transaction */
+struct bitfury_bankjob {
+	struct bitfury_device *chips[BITFURY_BANKCHIPS];
+	int n;
+	struct timespec time;	// transfer time, CLOCK_MONOTONIC
+};
+
+/* Per-board state, cgpu->device_data */
+struct bitfury_info {
+	struct thr_info *thr;
+
+	/* scan loop */
+	unsigned loops_count;
+	unsigned call_count;
+	int last_chip;		// round robin of work_push
+	int no_work;
+	struct timeval last_call;
+	double call_period;
+	time_t short_out_t;
+	double short_out_tf;
+	time_t long_out_t;
+	time_t long_long_out_t;
+	char debug_log[1024];
+	int last_stat_slot;
+	struct bitfury_slot_info slots[BITFURY_MAXBANKS];
+
+	/* deadline scheduler, chips ordered by predict1 */
+	struct bitfury_device *sched_heap[BITFURY_MAXCHIPS];
+	int sched_n;
+
+	/* pipeline: scan loop queues bank jobs, SPI thread transfers them in order */
+	bool pipeline;
+	bool shutdown;
+	pthread_mutex_t pipe_lock;
+	pthread_cond_t pipe_cond;
+	struct bitfury_bankjob jobs[BITFURY_MAXCHIPS];
+	int jobs_n;
+	int jobs_done;
+	pthread_t spi_thr;
+
+	/* telemetry thread publishes slots[].t, readers never wait on I2C */
+	bool telemetry;
+	pthread_t telemetry_thr;
+
+	struct bitfury_loop_stats loop_stats;
+};
+
 typedef struct bitfury_device bitfury_device_t;
 typedef bitfury_device_t *bitfury_device_p;
 typedef struct timeval *PTIMEVAL;
 
 int libbitfury_readHashData(unsigned int *res);
 int libbitfury_sendHashData(struct thr_info *thr, struct bitfury_device *bf, int chip_count);
+void libbitfury_waitNextPoll(struct bitfury_info *info, int max_ms);
+void libbitfury_getLoopStats(struct bitfury_info *info, struct bitfury_loop_stats *stats, bool reset);
+void *libbitfury_spiThread(void *userdata);
 void work_to_payload(struct bitfury_payload *p, struct work *w);
+unsigned decnonce(unsigned in);
+int rehash(unsigned char *midstate, unsigned m7, unsigned ntime, unsigned nbits, unsigned nnonce);
+int rehash_batch(struct rehash_req *req, int n);
 struct timespec t_diff(struct timespec start, struct timespec end);
 int libbitfury_detectChips(struct bitfury_device *devices);
 int libbitfury_shutdownChips(struct bitfury_device *devices, int chip_count);
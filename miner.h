@@ -15,6 +15,7 @@
 #include "uthash.h"
 #include "logging.h"
 #include "util.h"
+#include "sha2.h"
 #include <sys/types.h>
 #ifndef WIN32
 # include <sys/socket.h>
@@ -430,6 +431,9 @@ struct cgminer_pool_stats {
 	uint64_t times_received;
 	uint64_t bytes_received;
 	uint64_t net_bytes_received;
+	double cnx_setup;		/* seconds the last connect, subscribe and authorise took */
+	uint32_t standby_failovers;	/* switches to the pool while it was on standby */
+	double standby_saved;		/* cnx_setup seconds those switches didn't wait */
 };
 
 struct cgpu_info {
@@ -476,12 +480,16 @@ struct cgpu_info {
 	pthread_mutex_t device_mutex;
 #endif /* USE_BITFORCE || USE_BFLSC */
 #ifdef USE_BITFURY
-#define PREFETCH_WORKS 256
+#define PREFETCH_WORKS 256 // power of two
     int chip_count; //
-	struct bitfury_device devices[200]; // TODO Move somewhere to appropriate place
-    struct work *prefetch[PREFETCH_WORKS]; // большая очередь заданий
-    int w_prefetch;
-    int r_prefetch;
+	struct bitfury_device devices[256]; // BITFURY_MAXCHIPS, TODO Move somewhere to appropriate place
+    /* большая очередь заданий: single producer (queue_full) / single consumer (scan loop) ring,
+       head is written by consumer only, tail by producer only */
+    struct {
+        struct work *slot[PREFETCH_WORKS];
+        unsigned head;
+        unsigned tail;
+    } prefetch;
 #endif
 	enum dev_enable deven;
 	int accepted;
@@ -565,6 +573,8 @@ struct cgpu_info {
 
 	pthread_rwlock_t qlock;
 	struct work *queued_work;
+	/* Works flagged queued, indexed by their mkey */
+	struct work *queued_bymid;
 	unsigned int queued_count;
 
 	bool shutdown;
@@ -583,6 +593,17 @@ struct thread_q {
 	pthread_cond_t		cond;
 };
 
+/* Works a mining thread took off the staged queue in one go. The owner pops
+ * the oldest end, idle threads steal from the newest */
+#define LOCAL_WORKS 4
+
+struct work_deque {
+	pthread_mutex_t	lock;
+	struct work	*works[LOCAL_WORKS];
+	int		head;
+	int		count;
+};
+
 struct thr_info {
 	int		id;
 	int		device_thread;
@@ -601,6 +622,8 @@ struct thr_info {
 	double	rolling;
 
 	bool	work_restart;
+
+	struct work_deque workq;
 };
 
 typedef struct thr_info thr_info_t;
@@ -859,6 +882,8 @@ extern bool opt_protocol;
 extern bool have_longpoll;
 extern char *opt_kernel_path;
 extern char *opt_socks_proxy;
+extern int opt_stratum_batch;
+extern int opt_stratum_roll;
 extern char *cgminer_path;
 extern bool opt_fail_only;
 extern bool opt_autofan;
@@ -872,6 +897,7 @@ extern bool opt_api_listen;
 extern bool opt_api_network;
 extern bool opt_delaynet;
 extern bool opt_restart;
+extern bool opt_version_rolling;
 extern char *opt_icarus_options;
 extern char *opt_icarus_timing;
 extern bool opt_worktime;
@@ -881,6 +907,10 @@ extern char *opt_avalon_options;
 #ifdef USE_BITFURY
 extern char *opt_bitfury_clockbits;
 extern int spi_clock;
+extern bool opt_bitfury_spi_batch;
+extern bool opt_bitfury_pipeline;
+extern int opt_bitfury_emulate;
+extern int opt_bitfury_emu_mhz;
 #endif
 #ifdef USE_USBUTILS
 extern char *opt_usb_select;
@@ -899,8 +929,13 @@ extern const uint32_t sha256_init_state[];
 extern json_t *json_rpc_call(CURL *curl, const char *url, const char *userpass,
 			     const char *rpc_req, bool, bool, int *,
 			     struct pool *pool, bool);
+struct rpc_call;
+extern struct rpc_call *json_rpc_start(CURL *curl, const char *url, const char *userpass,
+				       const char *rpc_req, bool longpoll, struct pool *pool, bool share);
+extern json_t *json_rpc_finish(struct rpc_call *call, CURL *curl, int rc, int *rolltime);
 extern const char *proxytype(curl_proxytype proxytype);
 extern char *get_proxy(char *url, struct pool *pool);
+extern void __bin2hex(char *s, const unsigned char *p, size_t len);
 extern char *bin2hex(const unsigned char *p, size_t len);
 extern bool hex2bin(unsigned char *p, const char *hexstr, size_t len);
 
@@ -1008,6 +1043,11 @@ extern int total_accepted, total_rejected, total_diff1;;
 extern int total_getworks, total_stale, total_discarded;
 extern double total_diff_accepted, total_diff_rejected, total_diff_stale;
 extern unsigned int local_work;
+extern double local_work_rate;
+extern uint64_t stgd_locked, stgd_contended, local_pops, work_steals;
+extern uint64_t work_allocs, work_mallocs, job_allocs, job_refs;
+extern int net_threads;
+extern uint64_t net_wakeups;
 extern unsigned int total_go, total_ro;
 extern const int opt_cutofftemp;
 extern int opt_log_interval;
@@ -1065,6 +1105,14 @@ enum pool_enable {
 	POOL_REJECTING,
 };
 
+/* Strings shared by every work of a job. Works hold a reference instead of
+ * owning copies, the job is freed with its last reference */
+struct work_job {
+	int refs;
+	char *job_id;
+	char *nonce1;
+};
+
 struct stratum_work {
 	char *job_id;
 	char *prev_hash;
@@ -1075,19 +1123,70 @@ struct stratum_work {
 	char *nbit;
 	char *ntime;
 	bool clean;
+	char *job_buf;			/* holds the strings above, reused by every notify */
+	size_t job_size;
+	int merkles_size;		/* entries allocated in merkle */
 
 	size_t cb1_len;
 	size_t cb2_len;
 	size_t cb_len;
 
-	size_t header_len;
+	/* Binary template compiled from the above by stratum_template() */
+	unsigned char *cb_bin;		/* coinbase1, nonce1, zeroed nonce2, coinbase2 */
+	size_t nonce2_offset;
+	sha2_context cb_ctx;		/* sha256 of cb_bin up to nonce2: full blocks hashed, rest buffered */
+	unsigned char *cb_tail;		/* cb_bin after the hashed blocks, sha256 padded */
+	size_t cb_tail_len;		/* whole 64 byte blocks */
+	size_t cb_tail_n2;		/* nonce2 offset in cb_tail */
+	unsigned char *merkle_bin;	/* merkles * 32 bytes */
+	unsigned char header_bin[128];	/* header with zero merkle root and nonce, sha256 padded */
+	struct work_job *job;		/* job_id and nonce1 for the works */
+
 	int merkles;
 	double diff;
 };
 
+#define MAX_N2SIZE 16
+#define MAX_STRATUM_BATCH 64
+
+/* BIP320 general purpose version bits asked for with mining.configure */
+#define VERSION_ROLLING_MASK 0x1fffe000
+
+/* Version rolled header variants computed for each stratum work */
+#define MAX_VMIDSTATES 4
+
+/* Nonce2 values a generator reserves from its pool at once */
+#define NONCE2_RANGE 1024
+
+/* Queued work is indexed by midstate plus the 12 bytes of data after it,
+ * what avalon and bflsc results carry to identify their work */
+#define QUEUED_MKEY_OFFSET 64
+#define QUEUED_MKEY_DATALEN 12
+#define QUEUED_MKEY_LEN (32 + QUEUED_MKEY_DATALEN)
+
+/* Block of nonce2 values reserved by one work generator. Valid while pool
+ * and nonce2_epoch match, next runs up to end */
+struct nonce2_range {
+	struct pool *pool;
+	uint32_t epoch;
+	uint32_t next, end;
+};
+
+/* Byte offsets in stratum_work header_bin and work data */
+#define STRATUM_HDR_MERKLE	36
+#define STRATUM_HDR_NTIME	68
+
 #define RBUFSIZE 8192
 #define RECVSIZE (RBUFSIZE - 4)
 
+/* Which thread owns a stratum connection when the network reactor runs */
+enum net_state {
+	NET_LIVE,	/* sock in the epoll set, owned by the reactor */
+	NET_CONNECT,	/* queued for, or being set up by, a connect thread */
+	NET_RETRY,	/* waiting out the backoff before connecting again */
+	NET_PARKED,	/* connection not needed, kept closed */
+};
+
 struct pool {
 	int pool_no;
 	int prio;
@@ -1157,13 +1256,23 @@ struct pool {
 	char *stratum_port;
 	struct addrinfo stratum_hints;
 	SOCKETTYPE sock;
+	unsigned int sock_gen;		/* bumped for every new sock */
 	char *sockbuf;
 	size_t sockbuf_size;
+	size_t sockbuf_head;		/* start of unconsumed data */
+	size_t sockbuf_scan;		/* searched for \n up to here */
+	size_t sockbuf_tail;		/* end of received data */
 	char *sockaddr_url; /* stripped url used for sockaddr */
 	char *nonce1;
 	size_t n1_len;
-	uint32_t nonce2;
+	uint32_t nonce2;		/* next unreserved nonce2, advanced atomically */
+	uint32_t nonce2_epoch;		/* bumped when nonce2 restarts, voids reservations */
 	int n2size;
+	uint32_t version_mask;		/* BIP310 version bits the pool lets us roll */
+	bool no_configure;		/* pool dropped us on mining.configure */
+	bool configure_pending;		/* mining.configure configure_id not answered yet */
+	int configure_id;
+	bool sock_closed;		/* last recv_line saw the pool close or reset */
 	char *sessionid;
 	bool has_stratum;
 	bool stratum_active;
@@ -1176,6 +1285,20 @@ struct pool {
 	struct thread_q *stratum_q;
 	int sshares; /* stratum shares submitted waiting on response */
 
+	/* Network reactor state of the stratum connection */
+	enum net_state net_state;
+	unsigned int net_gen;		/* sock_gen registered with epoll */
+	bool net_reconnect;		/* client.reconnect left to the reactor */
+	time_t net_deadline;		/* recv timeout, or next connect in NET_RETRY */
+	struct stratum_share *net_sshare; /* shares waiting to be sent */
+	struct timeval net_flush;	/* when they are due to be sent */
+	char *net_out;			/* written, not yet taken by the sock */
+	size_t net_out_len;
+	size_t net_out_size;
+	bool net_pollout;		/* EPOLLOUT armed for net_out */
+	struct pool *net_connect_next;	/* waiting for a connect thread */
+	bool net_queued;
+
 	/* GBT  variables */
 	bool has_gbt;
 	cglock_t gbt_lock;
@@ -1234,12 +1357,25 @@ struct work {
 	bool		queued;
 
 	bool		stratum;
+	/* job_id and nonce1 point into job */
+	struct work_job	*job;
 	char 		*job_id;
-	char		*nonce2;
-	char		*ntime;
+	char		nonce2[MAX_N2SIZE * 2 + 1];
+	char		ntime[9];
 	double		sdiff;
 	char		*nonce1;
 
+	/* BIP310 version rolling: vversions header variants sharing the merkle
+	 * root, variant 0 is the job's version. Drivers taking several
+	 * midstates can hash the first vmidstates of them, the others have
+	 * been handed out as clones. Version bits in data are submitted
+	 * within version_mask */
+	uint32_t	version_mask;
+	int		vversions;
+	int		vmidstates;
+	uint32_t	vversion[MAX_VMIDSTATES];
+	unsigned char	vmidstate[MAX_VMIDSTATES][32];
+
 	bool		gbt;
 	char		*gbt_coinbase;
 	int		gbt_txns;
@@ -1247,6 +1383,12 @@ struct work {
 	unsigned int	work_block;
 	int		id;
 	UT_hash_handle	hh;
+	/* Key of the cgpu queued_bymid index: midstate followed by the
+	 * data tail devices report back with their nonces */
+	unsigned char	mkey[QUEUED_MKEY_LEN];
+	UT_hash_handle	mh;
+	/* Free list link while the work is cached by the work slab */
+	struct work	*slab_next;
 
 	double		work_difficulty;
 
@@ -1298,6 +1440,7 @@ extern void inc_hw_errors(struct thr_info *thr);
 extern bool submit_nonce(struct thr_info *thr, struct work *work, uint32_t nonce);
 extern struct work *get_queued(struct cgpu_info *cgpu);
 extern struct work *__find_work_bymidstate(struct work *que, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
+extern void __del_queued_work(struct cgpu_info *cgpu, struct work *work);
 extern struct work *find_queued_work_bymidstate(struct cgpu_info *cgpu, char *midstate, size_t midstatelen, char *data, int offset, size_t datalen);
 extern void work_completed(struct cgpu_info *cgpu, struct work *work);
 extern void hash_queued_work(struct thr_info *mythr);
@@ -1329,8 +1472,12 @@ extern void adl(void);
 extern void app_restart(void);
 extern void clean_work(struct work *work);
 extern void free_work(struct work *work);
+extern struct work_job *make_work_job(const char *job_id, const char *nonce1);
+extern struct work_job *ref_work_job(struct work_job *job);
+extern void free_work_job(struct work_job *job);
 extern void __copy_work(struct work *work, struct work *base_work);
 extern struct work *copy_work(struct work *base_work);
+extern void set_work_version(struct work *work, int variant);
 extern struct thr_info *get_thread(int thr_id);
 extern struct cgpu_info *get_devices(int id);
 
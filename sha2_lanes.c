@@ -0,0 +1,176 @@
+/*
+ *   sha2_lanes.c - SHA-256 compression of several independent blocks at once
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 3 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+*/
+
+/*
+ * Lanes are GCC vector extension types, so one round body serves AVX2, SSE2
+ * and NEON: compiler maps vector ops to the instruction set enabled by target
+ * attribute of the function. Blocks are transposed into lanes on load, short
+ * tail of the batch repeats first block of the group and is not stored back.
+ */
+
+#include "config.h"
+
+#include <string.h>
+
+#if defined(__arm__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+
+#include "sha2_lanes.h"
+
+static const uint32_t K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+/* Work for both scalars and vectors */
+#define ROTR(x,n) (((x) >> (n)) | ((x) << (32 - (n))))
+#define CH(x,y,z) ((z) ^ ((x) & ((y) ^ (z))))
+#define MAJ(x,y,z) (((x) & (y)) | ((z) & ((x) | (y))))
+#define EP0(x) (ROTR(x,2) ^ ROTR(x,13) ^ ROTR(x,22))
+#define EP1(x) (ROTR(x,6) ^ ROTR(x,11) ^ ROTR(x,25))
+#define SIG0(x) (ROTR(x,7) ^ ROTR(x,18) ^ ((x) >> 3))
+#define SIG1(x) (ROTR(x,17) ^ ROTR(x,19) ^ ((x) >> 10))
+
+#define SHA2_ROUNDS(w, a, b, c, d, e, f, g, h, t1, t2) \
+	for (i = 0; i < 64; i++) { \
+		if (i >= 16) \
+			w[i & 15] += SIG1(w[(i - 2) & 15]) + w[(i - 7) & 15] + SIG0(w[(i - 15) & 15]); \
+		t1 = h + EP1(e) + CH(e, f, g) + K[i] + w[i & 15]; \
+		t2 = EP0(a) + MAJ(a, b, c); \
+		h = g; g = f; f = e; e = d + t1; \
+		d = c; c = b; b = a; a = t1 + t2; \
+	}
+
+/* Defines static fn running LANES blocks per pass in vector type vec */
+#define SHA2_LANES_FN(fn, vec, LANES) \
+static void fn(uint32_t (*state)[8], const uint32_t (*block)[16], int n) \
+{ \
+	int base, l, i; \
+\
+	for (base = 0; base < n; base += LANES) { \
+		vec s[8], w[16], a, b, c, d, e, f, g, h, t1, t2; \
+\
+		for (l = 0; l < LANES; l++) { \
+			int src = base + l < n ? base + l : base; \
+\
+			for (i = 0; i < 8; i++) \
+				s[i][l] = state[src][i]; \
+			for (i = 0; i < 16; i++) \
+				w[i][l] = block[src][i]; \
+		} \
+		a = s[0]; b = s[1]; c = s[2]; d = s[3]; \
+		e = s[4]; f = s[5]; g = s[6]; h = s[7]; \
+		SHA2_ROUNDS(w, a, b, c, d, e, f, g, h, t1, t2) \
+		s[0] += a; s[1] += b; s[2] += c; s[3] += d; \
+		s[4] += e; s[5] += f; s[6] += g; s[7] += h; \
+		for (l = 0; l < LANES && base + l < n; l++) \
+			for (i = 0; i < 8; i++) \
+				state[base + l][i] = s[i][l]; \
+	} \
+}
+
+static void sha2_lanes_scalar(uint32_t (*state)[8], const uint32_t (*block)[16], int n)
+{
+	uint32_t w[16], a, b, c, d, e, f, g, h, t1, t2;
+	int j, i;
+
+	for (j = 0; j < n; j++) {
+		uint32_t *s = state[j];
+
+		memcpy(w, block[j], sizeof(w));
+		a = s[0]; b = s[1]; c = s[2]; d = s[3];
+		e = s[4]; f = s[5]; g = s[6]; h = s[7];
+		SHA2_ROUNDS(w, a, b, c, d, e, f, g, h, t1, t2)
+		s[0] += a; s[1] += b; s[2] += c; s[3] += d;
+		s[4] += e; s[5] += f; s[6] += g; s[7] += h;
+	}
+}
+
+typedef uint32_t sha2_v4 __attribute__ ((vector_size (16)));
+typedef uint32_t sha2_v8 __attribute__ ((vector_size (32)));
+
+#if defined(__x86_64__) || defined(__i386__)
+#define SHA2_LANES_X86 1
+__attribute__ ((target ("avx2")))
+SHA2_LANES_FN(sha2_lanes_avx2, sha2_v8, 8)
+__attribute__ ((target ("sse2")))
+SHA2_LANES_FN(sha2_lanes_sse2, sha2_v4, 4)
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(__aarch64__)
+#define SHA2_LANES_NEON 1
+SHA2_LANES_FN(sha2_lanes_neon, sha2_v4, 4)
+#endif
+
+struct sha2_lanes_impl {
+	const char *name;
+	int width;
+	void (*transform)(uint32_t (*state)[8], const uint32_t (*block)[16], int n);
+};
+
+static const struct sha2_lanes_impl *sha2_lanes_impl;
+
+static const struct sha2_lanes_impl *sha2_lanes_select(void)
+{
+	static const struct sha2_lanes_impl scalar = { "scalar", 1, sha2_lanes_scalar };
+#ifdef SHA2_LANES_X86
+	static const struct sha2_lanes_impl avx2 = { "avx2", 8, sha2_lanes_avx2 };
+	static const struct sha2_lanes_impl sse2 = { "sse2", 4, sha2_lanes_sse2 };
+
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return &avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return &sse2;
+#endif
+#ifdef SHA2_LANES_NEON
+	static const struct sha2_lanes_impl neon = { "neon", 4, sha2_lanes_neon };
+
+#ifdef __arm__
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+		return &neon;
+#endif
+	return &scalar;
+}
+
+/* Selection is idempotent, so racing first calls just store the same pointer */
+static inline const struct sha2_lanes_impl *sha2_lanes_get(void)
+{
+	if (!sha2_lanes_impl)
+		sha2_lanes_impl = sha2_lanes_select();
+	return sha2_lanes_impl;
+}
+
+void sha2_transform_lanes(uint32_t (*state)[8], const uint32_t (*block)[16], int n)
+{
+	sha2_lanes_get()->transform(state, block, n);
+}
+
+const char *sha2_lanes_name(void)
+{
+	return sha2_lanes_get()->name;
+}
+
+int sha2_lanes_width(void)
+{
+	return sha2_lanes_get()->width;
+}
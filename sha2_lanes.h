@@ -0,0 +1,39 @@
+/*
+ *   sha2_lanes.h - SHA-256 compression of several independent blocks at once
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 3 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+*/
+
+#ifndef SHA2_LANES_H
+#define SHA2_LANES_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Runs one SHA-256 compression for every i < n: state[i] is advanced by
+ * 16 word block[i]. Words are plain integers (big endian already decoded).
+ * Blocks are processed 8 (AVX2) or 4 (SSE2, NEON) at a time, implementation
+ * is picked at first call by CPU features, scalar code is the fallback.
+ */
+void sha2_transform_lanes(uint32_t (*state)[8], const uint32_t (*block)[16], int n);
+
+/* Name and width of the selected implementation */
+const char *sha2_lanes_name(void);
+int sha2_lanes_width(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
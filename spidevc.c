@@ -42,7 +42,34 @@
 static volatile unsigned *gpio;
 static int fd;
 
+static void spidev_init(void);
+static int spidev_txrx(const char *wrbuf, char *rdbuf, int bufsz);
+static int spidev_txrx_batch(const char *wrbuf, char *rdbuf, const unsigned *segs, int nsegs);
+
+const struct spi_backend spidev_backend = {
+	.name = "spidev",
+	.init = spidev_init,
+	.txrx = spidev_txrx,
+	.txrx_batch = spidev_txrx_batch,
+};
+
+static const struct spi_backend *backend = &spidev_backend;
+
+void spi_set_backend(const struct spi_backend *b) { backend = b; }
+const struct spi_backend *spi_get_backend(void) { return backend; }
+
 void spi_init(void)
+{
+	applog(LOG_WARNING, "SPI backend: %s", backend->name);
+	backend->init();
+}
+
+int spi_txrx(const char *wrbuf, char *rdbuf, int bufsz)
+{
+	return backend->txrx(wrbuf, rdbuf, bufsz);
+}
+
+static void spidev_init(void)
 {
     int mem_fd;
 
@@ -155,7 +182,7 @@ int spi_reset(int a)
 	return a;
 }
 
-int spi_txrx(const char *wrbuf, char *rdbuf, int bufsz)
+static int spidev_txrx(const char *wrbuf, char *rdbuf, int bufsz)
 {
 	int mode, bits, speed, rv, i, j;
 	struct timespec tv;
@@ -203,60 +230,173 @@ int spi_txrx(const char *wrbuf, char *rdbuf, int bufsz)
 }
 
 #define SPIMAXSZ 256*1024
+#define SPIMAXSEGS 256
 static unsigned char spibuf[SPIMAXSZ], spibuf_rx[SPIMAXSZ];
-static unsigned spibufsz;
+static unsigned spibits; // stream length in bits, commands are not padded to bytes
+static unsigned spisegs[SPIMAXSEGS]; // end offsets of closed segments
+static unsigned spinsegs;
+
+#define SPIBYTES(bits) (((bits) + 7) / 8)
 
-void spi_clear_buf(void) { spibufsz = 0; }
+void spi_clear_buf(void) { spibits = 0; spinsegs = 0; }
 unsigned char *spi_getrxbuf(void) { return spibuf_rx; }
 unsigned char *spi_gettxbuf(void) { return spibuf; }
-unsigned spi_getbufsz(void) { return spibufsz; }
+unsigned spi_getbufsz(void) { return SPIBYTES(spibits); }
+
+/* Pad with NOP bits up to byte boundary */
+static void spi_emit_align(void) { spibits = SPIBYTES(spibits) * 8; }
+
+/* Append n (up to 25) low bits of v, MSB first as they go to the wire */
+static void spi_emit_bits(unsigned v, unsigned n)
+{
+	unsigned byte = spibits / 8, used = spibits % 8;
+	uint32_t acc;
+
+	if (byte + 4 >= SPIMAXSZ) return;
+	acc = (uint32_t)(used ? spibuf[byte] : 0) << 24;
+	acc |= (v & ((1u << n) - 1)) << (32 - used - n);
+	spibuf[byte] = acc >> 24;
+	spibuf[byte + 1] = acc >> 16;
+	spibuf[byte + 2] = acc >> 8;
+	spibuf[byte + 3] = acc;
+	spibits += n;
+}
+
+void spi_emit_seg(void)
+{
+	unsigned start = spinsegs ? spisegs[spinsegs - 1] : 0;
+	spi_emit_align();
+	if (spibits / 8 == start || spinsegs >= SPIMAXSEGS) return;
+	spisegs[spinsegs++] = spibits / 8;
+}
+
+/* Transfers for all segments are submitted by single ioctl, so bank switching and
+   chain reset are paid once per batch instead of once per chip. spidev refuses
+   messages longer than its bufsiz (4096 by default), so longer batches are split */
+#define SPIMSGSZ 4096
+
+static int spi_message(struct spi_ioc_transfer *tr, int n)
+{
+	if (!n) return 0;
+	if ((int)ioctl(fd, SPI_IOC_MESSAGE(n), (intptr_t)tr) < 0) {
+		perror("WTF! Unable to SPI_IOC_MESSAGE batch");
+		return -1;
+	}
+	return 0;
+}
+
+static int spidev_txrx_batch(const char *wrbuf, char *rdbuf, const unsigned *segs, int nsegs)
+{
+	static struct spi_ioc_transfer tr[SPIMAXSEGS];
+	unsigned start, end, len, msgsz;
+	int i, n, rv = 0;
+
+	spi_reset(2048);
+
+	memset(tr, 0, sizeof(tr));
+	start = 0; n = 0; msgsz = 0;
+	for (i = 0; i < nsegs && !rv; i++) {
+		end = segs[i];
+		while (start < end && !rv) {
+			len = end - start;
+			if (len > SPIMSGSZ) len = SPIMSGSZ;
+			if (msgsz + len > SPIMSGSZ || n == SPIMAXSEGS) {
+				rv = spi_message(tr, n);
+				memset(tr, 0, sizeof(tr[0]) * n);
+				n = 0; msgsz = 0;
+			}
+			tr[n].tx_buf = (uintptr_t) &wrbuf[start];
+			tr[n].rx_buf = (uintptr_t) &rdbuf[start];
+			tr[n].len = len;
+			tr[n].delay_usecs = 1;
+			tr[n].speed_hz = spi_clock;
+			tr[n].bits_per_word = 8;
+			msgsz += len; start += len; n++;
+		}
+	}
+	if (!rv)
+		rv = spi_message(tr, n);
+
+#ifdef BITFURY_METABANK
+	spi_reset(4096);
+#endif
+
+	return rv;
+}
+
+int spi_txrx_batch(void)
+{
+	spi_emit_seg();
+	if (!spinsegs) return 0;
+	return backend->txrx_batch((char *)spibuf, (char *)spibuf_rx, spisegs, spinsegs);
+}
+
+#define R2(n) n, n + 2*64, n + 1*64, n + 3*64
+#define R4(n) R2(n), R2(n + 2*16), R2(n + 1*16), R2(n + 3*16)
+#define R6(n) R4(n), R4(n + 2*4), R4(n + 1*4), R4(n + 3*4)
+static const unsigned char bitrev[256] = { R6(0), R6(2), R6(1), R6(3) };
 
 void spi_emit_buf_reverse(const char *str, unsigned sz)
 {
+	const unsigned char *src = (const unsigned char *)str;
+	unsigned char *dst;
 	unsigned i;
-	if (spibufsz + sz >= SPIMAXSZ) return;
-	for (i = 0; i < sz; i++) { // Reverse bit order in each byte!
-		unsigned char p = str[i];
-		p = ((p & 0xaa)>>1) | ((p & 0x55) << 1);
-		p = ((p & 0xcc)>>2) | ((p & 0x33) << 2);
-		p = ((p & 0xf0)>>4) | ((p & 0x0f) << 4);
-		spibuf[spibufsz+i] = p;
+	uint64_t w;
+
+	spi_emit_align();
+	if (spibits / 8 + sz >= SPIMAXSZ) return;
+	dst = &spibuf[spibits / 8];
+	for (i = 0; i + 8 <= sz; i += 8) { // Reverse bit order in each byte, word at a time
+		memcpy(&w, src + i, 8);
+		w = ((w & 0xaaaaaaaaaaaaaaaaULL) >> 1) | ((w & 0x5555555555555555ULL) << 1);
+		w = ((w & 0xccccccccccccccccULL) >> 2) | ((w & 0x3333333333333333ULL) << 2);
+		w = ((w & 0xf0f0f0f0f0f0f0f0ULL) >> 4) | ((w & 0x0f0f0f0f0f0f0f0fULL) << 4);
+		memcpy(dst + i, &w, 8);
 	}
-	spibufsz += sz;
+	for (; i < sz; i++)
+		dst[i] = bitrev[src[i]];
+	spibits += sz * 8;
 }
 
 void spi_emit_buf(const char *str, unsigned sz)
 {
-	unsigned i;
-	if (spibufsz + sz >= SPIMAXSZ) return;
-	memcpy(&spibuf[spibufsz], str, sz); spibufsz += sz;
+	spi_emit_align();
+	if (spibits / 8 + sz >= SPIMAXSZ) return;
+	memcpy(&spibuf[spibits / 8], str, sz); spibits += sz * 8;
 }
 
-/* TODO: in production, emit just bit-sequences! Eliminate padding to byte! */
-void spi_emit_break(void) { spi_emit_buf("\x4", 1); }
-void spi_emit_fsync(void) { spi_emit_buf("\x6", 1); }
+/* Commands are 3 bits each, zero bits between them are NOPs */
+#define SPI_CMD_BREAK  0x4
+#define SPI_CMD_FASYNC 0x5
+#define SPI_CMD_FSYNC  0x6
+
+void spi_emit_break(void) { spi_emit_bits(SPI_CMD_BREAK, 3); }
+void spi_emit_fsync(void) { spi_emit_bits(SPI_CMD_FSYNC, 3); }
 
 void spi_emit_fasync(int n) {
-	int i;
-	for (i = 0; i < n; i++) {
-		spi_emit_buf("\x5", 1);
-	}
+	for (; n >= 8; n -= 8)
+		spi_emit_bits(0xB6DB6D, 24); /* 8 x FASYNC */
+	if (n > 0)
+		spi_emit_bits(0xB6DB6D >> (24 - 3*n), 3*n);
 }
 
 void spi_emit_nop(int n) {
 	int i;
-	for (i = 0; i < n; n++) {
-		spi_emit_buf("\x0", 1);
+	for (i = 0; i < n; i++) {
+		spi_emit_bits(0, 8);
 	}
 }
 
-void spi_emit_data(unsigned addr, const char *buf, unsigned len)
+unsigned spi_emit_data(unsigned addr, const char *buf, unsigned len)
 {
 	unsigned char otmp[3];
-	if (len < 4 || len > 128) return; /* This cannot be programmed in single frame! */
+	unsigned offset;
+	if (len < 4 || len > 128) return 0; /* This cannot be programmed in single frame! */
 	len /= 4; /* Strip */
 	otmp[0] = (len - 1) | 0xE0;
 	otmp[1] = (addr >> 8)&0xFF; otmp[2] = addr & 0xFF;
-	spi_emit_buf(otmp, 3);
+	spi_emit_buf(otmp, 3); /* Pads to byte, so payload and its read-back are byte aligned */
+	offset = spibits / 8;
 	spi_emit_buf_reverse(buf, len*4);
+	return offset;
 }
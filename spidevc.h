@@ -19,17 +19,40 @@
 #ifndef SPIDEVC_H
 #define SPIDEVC_H
 
+/* SPI backend: real spidev bus or emulated chip array */
+struct spi_backend {
+	const char *name;
+	void (*init)(void);
+	/* TX-RX single frame */
+	int (*txrx)(const char *wrbuf, char *rdbuf, int bufsz);
+	/* TX-RX buffer as batch of transfers, segs are end offsets of transfers */
+	int (*txrx_batch)(const char *wrbuf, char *rdbuf, const unsigned *segs, int nsegs);
+};
+
+extern const struct spi_backend spidev_backend;
+
+/* Select backend before spi_init(), spidev is default */
+void spi_set_backend(const struct spi_backend *backend);
+const struct spi_backend *spi_get_backend(void);
+
 /* Initialize SPI using this function */
 void spi_init(void);
 
 /* TX-RX single frame */
 int spi_txrx(const char *wrbuf, char *rdbuf, int bufsz);
 
+/* TX-RX whole buffer, every segment as separate transfer of one SPI_IOC_MESSAGE(n) */
+int spi_txrx_batch(void);
+
 /* SPI BUFFER OPS */
 void spi_clear_buf(void);
 unsigned char *spi_getrxbuf(void);
 unsigned char *spi_gettxbuf(void);
 unsigned spi_getbufsz(void);
+void spi_emit_seg(void); /* CLOSE CURRENT SEGMENT, NEXT EMITS GO TO NEW TRANSFER OF THE BATCH */
+
+/* Commands are packed as bit sequences, only byte oriented emits below pad the
+   stream to byte boundary with NOP bits */
 
 void spi_emit_buf_reverse(const char *str, unsigned sz); /* INTERNAL USE: EMIT REVERSED BYTE SEQUENCE DIRECTLY TO STREAM */
 void spi_emit_buf(const char *str, unsigned sz); /* INTERNAL USE: EMIT BYTE SEQUENCE DIRECTLY TO STREAM */
@@ -37,13 +60,15 @@ void spi_emit_buf(const char *str, unsigned sz); /* INTERNAL USE: EMIT BYTE SEQU
 void spi_emit_break(void); /* BREAK CONNECTIONS AFTER RESET */
 void spi_emit_fsync(void); /* FEED-THROUGH TO NEXT CHIP SYNCHRONOUSLY (WITH FLIP-FLOP) */
 void spi_emit_fasync(int n); /* FEED-THROUGH TO NEXT CHIP ASYNCHRONOUSLY (WITHOUT FLIP-FLOP INTERMEDIATE) */
-void spi_emit_nop(int n);
+void spi_emit_nop(int n); /* n BYTES OF NOP BITS */
 
 /* TRANSMIT PROGRAMMING SEQUENCE (AND ALSO READ-BACK) */
 /* addr is the destination address in bits (16-bit - 0 to 0xFFFF valid ones)
-   buf is buffer to be transmitted, it will go at position spi_getbufsz()+3
+   buf is buffer to be transmitted, frame header is padded with NOP bits to byte
+   boundary, so buf goes at position spi_getbufsz()+3 after the padding
    len is length in _bytes_, should be 4 to 128 and be multiple of 4, as smallest
-   transmission quantum is 32 bits */
-void spi_emit_data(unsigned addr, const char *buf, unsigned len);
+   transmission quantum is 32 bits
+   returns offset of data in buffer, read-back of chip will be at same offset in rx buffer */
+unsigned spi_emit_data(unsigned addr, const char *buf, unsigned len);
 
 #endif
@@ -0,0 +1,436 @@
+/*
+ *   spiemu.c - software emulated Bitfury chip array behind SPI/I2C backends
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 2 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, see http://www.gnu.org/licenses/.
+*/
+
+/*
+ * Every emulated chip decodes the SPI command stream bit by bit like real one:
+ * zero bits are NOPs, 100 - break, 101 - fasync, 110 - fsync, 111 - data frame
+ * (5 bits length, 16 bits address, bit-reversed payload). Job frames at 0x3000
+ * return the 17 result words at the same bit position of the rx buffer.
+ *
+ * Nonce counter of a chip runs at mhz / 65 ticks per microsecond, a job lasts
+ * 0x400000 ticks, 1024 nonces per tick. Hashing thread verifies the nonce space
+ * passed by every chip with real SHA-256, as much as host CPU allows, so found
+ * nonces are genuine and go through the normal get_counter/decnonce path.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "miner.h"
+#include "libbitfury.h"
+#include "spiemu.h"
+
+#define EMU_JOB_TICKS     0x00400000ULL
+#define EMU_TICK_NONCES   1024ULL
+#define EMU_NONCE_SPACE   0x100000000ULL
+#define EMU_HASH_CHUNK    4096
+#define EMU_RESULT_WORDS  15           // word 15 holds counter, 16 - job toggle
+#define EMU_BASE_OSC_BITS 54
+
+struct emu_chip {
+	unsigned job[19];       // running job frame: midstate, ms3 state, m7, ntime, nbits
+	unsigned next[19];      // job loaded by last 0x3000 frame
+	int has_job, has_next;
+	unsigned gen;           // bumped on every job switch
+	uint64_t job_start;     // ns, CLOCK_MONOTONIC
+	uint64_t scanned;       // nonces of running job verified by hashing thread
+	unsigned buf[17];       // read-back: results, counter, job toggle
+	int res_pos;
+	int osc6_bits;
+};
+
+static struct emu_chip emu_chips[BITFURY_MAXBANKS][BITFURY_BANKCHIPS];
+static int emu_slots;
+static double emu_mhz;
+static int emu_active_slot = -1;
+static pthread_mutex_t emu_lock;
+static pthread_t emu_hash_pth;
+static uint64_t emu_hashes;
+static unsigned emu_found;
+
+static uint64_t emu_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static unsigned char emu_rev8(unsigned char p)
+{
+	p = ((p & 0xaa)>>1) | ((p & 0x55) << 1);
+	p = ((p & 0xcc)>>2) | ((p & 0x33) << 2);
+	p = ((p & 0xf0)>>4) | ((p & 0x0f) << 4);
+	return p;
+}
+
+/* Inverse of decnonce() */
+static unsigned emu_encnonce(unsigned out)
+{
+	unsigned in, low;
+
+	out += 0x800004;
+	low = out & 0xFFFFFF;
+	in = ((low & 0x3FFFFF) << 2) | ((low >> 23) & 1) | (((low >> 22) & 1) << 1);
+	in = (((in & 0xaaaaaaaa) >> 1) | ((in & 0x55555555) << 1));
+	in = (((in & 0xcccccccc) >> 2) | ((in & 0x33333333) << 2));
+	in = (((in & 0xf0f0f0f0) >> 4) | ((in & 0x0f0f0f0f) << 4));
+	return (in << 8) | (out >> 24);
+}
+
+static unsigned emu_getbits(const unsigned char *b, unsigned pos, int n)
+{
+	unsigned v = 0;
+
+	while (n--) {
+		v = (v << 1) | ((b[pos >> 3] >> (7 - (pos & 7))) & 1);
+		pos++;
+	}
+	return v;
+}
+
+static void emu_putbyte(unsigned char *b, unsigned pos, unsigned char v)
+{
+	unsigned sh = pos & 7;
+
+	if (!sh) {
+		b[pos >> 3] = v;
+		return;
+	}
+	b[pos >> 3] |= v >> sh;
+	b[(pos >> 3) + 1] |= v << (8 - sh);
+}
+
+static double emu_chip_mhz(struct emu_chip *c)
+{
+	return emu_mhz * (1.0 + 0.04 * (c->osc6_bits - EMU_BASE_OSC_BITS));
+}
+
+static void emu_switch_job(struct emu_chip *c)
+{
+	if (c->has_next) {
+		memcpy(c->job, c->next, sizeof(c->job));
+		c->has_next = 0;
+	}
+	c->gen++;
+	c->scanned = 0;
+	c->buf[16] ^= 0xFFFFFFFF;
+}
+
+/* Move chip to the time now, returns counter ticks of running job */
+static uint64_t emu_advance(struct emu_chip *c, uint64_t now)
+{
+	uint64_t job_ns, ticks;
+	double mhz;
+
+	if (!c->has_job)
+		return 0;
+
+	mhz = emu_chip_mhz(c);
+	job_ns = (uint64_t)(EMU_JOB_TICKS * 65000.0 / mhz);
+	if (now - c->job_start > 2 * job_ns)
+		c->job_start = now - (now - c->job_start) % job_ns - job_ns;
+	while (now - c->job_start >= job_ns) {
+		emu_switch_job(c);
+		c->job_start += job_ns;
+	}
+
+	ticks = (uint64_t)((now - c->job_start) * mhz / 65000.0);
+	if (ticks >= EMU_JOB_TICKS)
+		ticks = EMU_JOB_TICKS - 1;
+	c->buf[15] = emu_encnonce(0xdf800000 | (unsigned)ticks);
+	return ticks;
+}
+
+static void emu_post_nonce(struct emu_chip *c, unsigned nonce)
+{
+	c->buf[c->res_pos] = emu_encnonce(nonce);
+	c->res_pos = (c->res_pos + 1) % EMU_RESULT_WORDS;
+	emu_found++;
+}
+
+static void emu_frame(int hop, unsigned addr, const unsigned char *wr, unsigned char *rd,
+		      unsigned pos, unsigned len, uint64_t now)
+{
+	unsigned words[32];
+	unsigned char *bytes = (unsigned char *)words;
+	struct emu_chip *c;
+	int slot, i;
+
+#ifdef BITFURY_METABANK
+	slot = emu_active_slot;
+#else
+	slot = 0;
+#endif
+	if (slot < 0 || slot >= emu_slots || hop >= BITFURY_BANKCHIPS)
+		return;
+	c = &emu_chips[slot][hop];
+
+	for (i = 0; i < len * 4; i++)
+		bytes[i] = emu_rev8(emu_getbits(wr, pos + i * 8, 8));
+
+	if (addr == 0x3000 && len == 19) {
+		const unsigned char *rb = (const unsigned char *)c->buf;
+
+		emu_advance(c, now);
+		for (i = 0; i < 17 * 4; i++)
+			emu_putbyte(rd, pos + i * 8, rb[i]);
+		if (!c->has_job) {
+			memcpy(c->job, words, sizeof(c->job));
+			c->has_job = 1;
+			c->job_start = now;
+			c->gen++;
+			c->scanned = 0;
+		} else {
+			memcpy(c->next, words, sizeof(c->next));
+			c->has_next = 1;
+		}
+	} else if (addr == 0x6000 && len == 2) {
+		/* thermometer code, more ones ==> faster clock */
+		c->osc6_bits = __builtin_popcount(words[0]) + __builtin_popcount(words[1]);
+	} else if (addr == 0x7000 + 4 * 32 && len == 1) {
+		/* slow oscillator disabled on shutdown, chip stops */
+		if (!words[0])
+			c->has_job = c->has_next = 0;
+	}
+}
+
+static void emu_parse(const unsigned char *wr, unsigned char *rd, unsigned bits, uint64_t now)
+{
+	unsigned pos = 0, len, addr;
+	int hop = 0;
+
+	while (pos + 3 <= bits) {
+		if (!emu_getbits(wr, pos, 1)) { /* NOP */
+			pos++;
+			continue;
+		}
+		switch (emu_getbits(wr, pos, 3)) {
+			case 4: /* break */
+				hop = 0;
+				pos += 3;
+				break;
+			case 5: /* fasync */
+			case 6: /* fsync */
+				hop++;
+				pos += 3;
+				break;
+			default: /* data */
+				if (pos + 24 > bits)
+					return;
+				len = emu_getbits(wr, pos + 3, 5) + 1;
+				addr = emu_getbits(wr, pos + 8, 16);
+				pos += 24;
+				if (pos + len * 32 > bits)
+					return;
+				emu_frame(hop, addr, wr, rd, pos, len, now);
+				pos += len * 32;
+				break;
+		}
+	}
+}
+
+static void *emu_hash_thread(void __maybe_unused *userdata)
+{
+	unsigned job[19];
+	unsigned found[16];
+	struct rehash_req req[REHASH_BATCH];
+	uint64_t from, to, n;
+	unsigned gen;
+	int s, i, k, m, busy, found_n;
+
+	pthread_detach(pthread_self());
+
+	for (k = 0; k < REHASH_BATCH; k++)
+		req[k].midstate = (const unsigned char *)job;
+
+	while (42) {
+		busy = 0;
+		for (s = 0; s < emu_slots; s++)
+			for (i = 0; i < BITFURY_BANKCHIPS; i++) {
+				struct emu_chip *c = &emu_chips[s][i];
+
+				mutex_lock(&emu_lock);
+				if (!c->has_job) {
+					mutex_unlock_noyield(&emu_lock);
+					continue;
+				}
+				to = emu_advance(c, emu_now()) * EMU_TICK_NONCES;
+				from = c->scanned;
+				gen = c->gen;
+				memcpy(job, c->job, sizeof(job));
+				mutex_unlock_noyield(&emu_lock);
+
+				if (to <= from)
+					continue;
+				if (to - from > EMU_HASH_CHUNK)
+					to = from + EMU_HASH_CHUNK;
+				if (to > EMU_NONCE_SPACE)
+					to = EMU_NONCE_SPACE;
+
+				found_n = 0;
+				for (n = from; n < to; n += m) {
+					m = to - n < REHASH_BATCH ? (int)(to - n) : REHASH_BATCH;
+					for (k = 0; k < m; k++) {
+						req[k].m7 = job[16];
+						req[k].ntime = job[17];
+						req[k].nbits = job[18];
+						req[k].nonce = (unsigned)(n + k);
+					}
+					if (rehash_batch(req, m))
+						for (k = 0; k < m; k++)
+							if (req[k].found && found_n < 16)
+								found[found_n++] = req[k].nonce;
+				}
+
+				mutex_lock(&emu_lock);
+				emu_hashes += to - from;
+				if (c->gen == gen) {
+					c->scanned = to;
+					while (found_n)
+						emu_post_nonce(c, found[--found_n]);
+				}
+				mutex_unlock_noyield(&emu_lock);
+				busy = 1;
+			}
+		if (!busy)
+			nmsleep(1);
+	}
+	return NULL;
+}
+
+static void spiemu_init(void)
+{
+	applog(LOG_WARNING, "BITFURY emulator: %d banks of %d chips at %.0f Mhz", emu_slots, BITFURY_BANKCHIPS, emu_mhz);
+	if (unlikely(pthread_create(&emu_hash_pth, NULL, emu_hash_thread, NULL)))
+		quit(1, "Failed to create bitfury emulator hashing thread");
+}
+
+static int spiemu_txrx(const char *wrbuf, char *rdbuf, int bufsz)
+{
+	memset(rdbuf, 0, bufsz);
+	mutex_lock(&emu_lock);
+	emu_parse((const unsigned char *)wrbuf, (unsigned char *)rdbuf, bufsz * 8, emu_now());
+	mutex_unlock_noyield(&emu_lock);
+	return 0;
+}
+
+static int spiemu_txrx_batch(const char *wrbuf, char *rdbuf, const unsigned *segs, int nsegs)
+{
+	unsigned start = 0;
+	uint64_t now;
+	int i;
+
+	memset(rdbuf, 0, segs[nsegs - 1]);
+	mutex_lock(&emu_lock);
+	now = emu_now();
+	for (i = 0; i < nsegs; i++) {
+		emu_parse((const unsigned char *)wrbuf + start, (unsigned char *)rdbuf + start, (segs[i] - start) * 8, now);
+		start = segs[i];
+	}
+	mutex_unlock_noyield(&emu_lock);
+	return 0;
+}
+
+const struct spi_backend spiemu_spi_backend = {
+	.name = "emulator",
+	.init = spiemu_init,
+	.txrx = spiemu_txrx,
+	.txrx_batch = spiemu_txrx_batch,
+};
+
+static int spiemu_i2c_init(void)
+{
+	return 0;
+}
+
+static void spiemu_i2c_close(void)
+{
+}
+
+/* Board controller answers: temperature grows with clock of the bank */
+static unsigned int spiemu_i2c_req(unsigned char addr, unsigned char cmd, unsigned int data)
+{
+	int slot = (int)addr - (TM_ADDR >> 1);
+	double mhz = 0, temp;
+	int i;
+
+	if (slot < 0 || slot >= emu_slots)
+		return -1;
+
+	switch (cmd) {
+		case TM_SET_OE:
+			mutex_lock(&emu_lock);
+			if (!data)
+				emu_active_slot = slot;
+			else if (emu_active_slot == slot)
+				emu_active_slot = -1;
+			mutex_unlock_noyield(&emu_lock);
+			return 0;
+		case TM_GET_TEMP:
+			mutex_lock(&emu_lock);
+			for (i = 0; i < BITFURY_BANKCHIPS; i++)
+				mhz += emu_chip_mhz(&emu_chips[slot][i]);
+			mutex_unlock_noyield(&emu_lock);
+			mhz /= BITFURY_BANKCHIPS;
+			temp = 40.0 + 20.0 * (mhz - emu_mhz) / emu_mhz;
+			return (unsigned int)((temp / 100.0 + 2.73) / 6.6 * 1023.0);
+		case TM_GET_CORE0:
+		case TM_GET_CORE1:
+			return (unsigned int)(0.9 / 3.3 * 1023.0);
+		default:
+			return 0;
+	}
+}
+
+const struct tm_i2c_backend spiemu_i2c_backend = {
+	.name = "emulator",
+	.init = spiemu_i2c_init,
+	.close = spiemu_i2c_close,
+	.req = spiemu_i2c_req,
+};
+
+void spiemu_setup(int chips, double mhz)
+{
+	int s, i;
+
+	emu_slots = (chips + BITFURY_BANKCHIPS - 1) / BITFURY_BANKCHIPS;
+	if (emu_slots > BITFURY_MAXBANKS) {
+		applog(LOG_WARNING, "BITFURY emulator: %d chips requested, limited to %d banks of %d chips",
+		       chips, BITFURY_MAXBANKS, BITFURY_BANKCHIPS);
+		emu_slots = BITFURY_MAXBANKS;
+	}
+	emu_mhz = mhz > 0 ? mhz : 250;
+
+	memset(emu_chips, 0, sizeof(emu_chips));
+	for (s = 0; s < BITFURY_MAXBANKS; s++)
+		for (i = 0; i < BITFURY_BANKCHIPS; i++)
+			emu_chips[s][i].osc6_bits = EMU_BASE_OSC_BITS;
+	mutex_init(&emu_lock);
+
+	spi_set_backend(&spiemu_spi_backend);
+	tm_i2c_set_backend(&spiemu_i2c_backend);
+}
+
+void spiemu_get_stats(uint64_t *hashes, unsigned *found)
+{
+	mutex_lock(&emu_lock);
+	*hashes = emu_hashes;
+	*found = emu_found;
+	mutex_unlock_noyield(&emu_lock);
+}
@@ -0,0 +1,35 @@
+/*
+ *   spiemu.h - software emulated Bitfury chip array behind SPI/I2C backends
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License version 2 as
+ *   published by the Free Software Foundation.
+ *
+ *   This program is distributed in the hope that it will be useful, but
+ *   WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ *   General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, see http://www.gnu.org/licenses/.
+*/
+
+#ifndef SPIEMU_H
+#define SPIEMU_H
+
+#include <stdint.h>
+
+#include "spidevc.h"
+#include "tm_i2c.h"
+
+extern const struct spi_backend spiemu_spi_backend;
+extern const struct tm_i2c_backend spiemu_i2c_backend;
+
+/* Emulate chips (rounded up to full banks) clocked at mhz for osc6_bits 54,
+   selects emulator as SPI and I2C backend */
+void spiemu_setup(int chips, double mhz);
+
+/* Nonces verified by real SHA-256 and nonces found since start */
+void spiemu_get_stats(uint64_t *hashes, unsigned *found);
+
+#endif
@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <sys/ioctl.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
@@ -16,17 +18,50 @@ float tm_i2c_Data2Core(unsigned int ans) {
 	return t / 1023.0 * 3.3;
 }
 
-int tm_i2c_init() {
+static int tm_i2c_dev_init(void) {
 	if ((tm_i2c_fd = open("/dev/i2c-1", O_RDWR)) < 0)
 		return 1;
 	else
 		return 0;
 }
 
-void tm_i2c_close() {
+static void tm_i2c_dev_close(void) {
 	close(tm_i2c_fd);
 }
 
+/* Request is a write and a read transfer, keep them together when several threads use the bus */
+static pthread_mutex_t tm_i2c_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static unsigned int tm_i2c_dev_req(unsigned char addr, unsigned char cmd, unsigned int data) {
+	unsigned int ret;
+
+	pthread_mutex_lock(&tm_i2c_lock);
+	ret = tm_i2c_req(tm_i2c_fd, addr, cmd, data);
+	pthread_mutex_unlock(&tm_i2c_lock);
+	return ret;
+}
+
+const struct tm_i2c_backend tm_i2c_dev_backend = {
+	.name = "i2c-dev",
+	.init = tm_i2c_dev_init,
+	.close = tm_i2c_dev_close,
+	.req = tm_i2c_dev_req,
+};
+
+static const struct tm_i2c_backend *backend = &tm_i2c_dev_backend;
+
+void tm_i2c_set_backend(const struct tm_i2c_backend *b) {
+	backend = b;
+}
+
+int tm_i2c_init() {
+	return backend->init();
+}
+
+void tm_i2c_close() {
+	backend->close();
+}
+
 unsigned int tm_i2c_req(int fd, unsigned char addr, unsigned char cmd, unsigned int data) {
 	int i;
 	unsigned char buf[16];
@@ -74,16 +109,29 @@ unsigned int tm_i2c_req(int fd, unsigned char addr, unsigned char cmd, unsigned
 int tm_i2c_detect(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return 0;
-	return tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_GET_CORE0, 0);
+	return backend->req((TM_ADDR >> 1) + slot, TM_GET_CORE0, 0);
 #else
 	return 0;
 #endif
 }
 
+/* Raw answer to TM_GET_* request, -1 when bus failed or controller answered other command */
+int tm_i2c_getraw(unsigned char slot, unsigned char cmd, unsigned int *ans) {
+#ifdef BITFURY_METABANK
+	if (slot > 31) return -1;
+	*ans = backend->req((TM_ADDR >> 1) + slot, cmd, 0);
+	if (*ans == (unsigned int)-1 || *ans == 0) return -1;
+	return 0;
+#else
+	*ans = 0;
+	return -1;
+#endif
+}
+
 float tm_i2c_getcore0(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return 0;
-	return tm_i2c_Data2Core(tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_GET_CORE0, 0));
+	return tm_i2c_Data2Core(backend->req((TM_ADDR >> 1) + slot, TM_GET_CORE0, 0));
 #else
 	return 0;
 #endif
@@ -92,7 +140,7 @@ float tm_i2c_getcore0(unsigned char slot) {
 float tm_i2c_getcore1(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return 0;
-	return tm_i2c_Data2Core(tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_GET_CORE1, 0));
+	return tm_i2c_Data2Core(backend->req((TM_ADDR >> 1) + slot, TM_GET_CORE1, 0));
 #else
 	return 0;
 #endif
@@ -101,7 +149,7 @@ float tm_i2c_getcore1(unsigned char slot) {
 float tm_i2c_gettemp(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return 0;
-	return tm_i2c_Data2Temp(tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_GET_TEMP, 0));
+	return tm_i2c_Data2Temp(backend->req((TM_ADDR >> 1) + slot, TM_GET_TEMP, 0));
 #else
 	return 0;
 #endif
@@ -110,7 +158,7 @@ float tm_i2c_gettemp(unsigned char slot) {
 void tm_i2c_set_oe(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return;
-	tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_SET_OE, 0);
+	backend->req((TM_ADDR >> 1) + slot, TM_SET_OE, 0);
 #else
 	return;
 #endif
@@ -119,7 +167,7 @@ void tm_i2c_set_oe(unsigned char slot) {
 void tm_i2c_clear_oe(unsigned char slot) {
 #ifdef BITFURY_METABANK
 	if (slot < 0 || slot > 31) return;
-	tm_i2c_req(tm_i2c_fd, (TM_ADDR >> 1) + slot, TM_SET_OE, 1);
+	backend->req((TM_ADDR >> 1) + slot, TM_SET_OE, 1);
 #else
 	return;
 #endif
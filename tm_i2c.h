@@ -1,5 +1,8 @@
 /* - Version 1.0 - */
 
+#ifndef TM_I2C_H
+#define TM_I2C_H
+
 #define TM_ADDR         0xC0
 
 #define TM_GET_TEMP     0x10
@@ -30,11 +33,25 @@ typedef struct {
 	unsigned char data_msb;
 } tm_struct;
 
+/* I2C backend: real bus or emulated bank controllers */
+struct tm_i2c_backend {
+	const char *name;
+	int (*init)(void);
+	void (*close)(void);
+	unsigned int (*req)(unsigned char addr, unsigned char cmd, unsigned int data);
+};
+
+extern const struct tm_i2c_backend tm_i2c_dev_backend;
+
+/* Select backend before tm_i2c_init(), /dev/i2c-1 is default */
+void tm_i2c_set_backend(const struct tm_i2c_backend *backend);
+
 int tm_i2c_init();
 void tm_i2c_close();
 unsigned int tm_i2c_req(int fd, unsigned char addr, unsigned char cmd, unsigned int data);
 float tm_i2c_Data2Temp(unsigned int ans);
 float tm_i2c_Data2Core(unsigned int ans);
+int tm_i2c_getraw(unsigned char slot, unsigned char cmd, unsigned int *ans);
 float tm_i2c_gettemp(unsigned char slot);
 float tm_i2c_getcore0(unsigned char slot);
 float tm_i2c_getcore1(unsigned char slot);
@@ -43,3 +60,4 @@ void tm_i2c_clear_oe(unsigned char slot);
 int tm_i2c_detect(unsigned char slot);
 unsigned char tm_i2c_slot2addr(unsigned char slot);
 
+#endif
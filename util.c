@@ -201,12 +201,9 @@ out:
 	return ptrlen;
 }
 
-static void keep_sockalive(SOCKETTYPE fd)
+static void noblock_socket(SOCKETTYPE fd)
 {
-	const int tcp_one = 1;
 #ifndef WIN32
-	const int tcp_keepidle = 45;
-	const int tcp_keepintvl = 30;
 	int flags = fcntl(fd, F_GETFL, 0);
 
 	fcntl(fd, F_SETFL, O_NONBLOCK | flags);
@@ -215,6 +212,17 @@ static void keep_sockalive(SOCKETTYPE fd)
 
 	ioctlsocket(fd, FIONBIO, &flags);
 #endif
+}
+
+static void keep_sockalive(SOCKETTYPE fd)
+{
+	const int tcp_one = 1;
+#ifndef WIN32
+	const int tcp_keepidle = 45;
+	const int tcp_keepintvl = 30;
+#endif
+
+	noblock_socket(fd);
 
 	setsockopt(fd, SOL_SOCKET, SO_KEEPALIVE, (const void *)&tcp_one, sizeof(tcp_one));
 	if (!opt_delaynet)
@@ -292,30 +300,31 @@ static int curl_debug_cb(__maybe_unused CURL *handle, curl_infotype type,
 	return 0;
 }
 
-json_t *json_rpc_call(CURL *curl, const char *url,
-		      const char *userpass, const char *rpc_req,
-		      bool probe, bool longpoll, int *rolltime,
-		      struct pool *pool, bool share)
+/* State of one JSON-RPC request, alive until its transfer is done */
+struct rpc_call {
+	struct data_buffer all_data;
+	struct header_info hi;
+	struct upload_buffer upload_data;
+	struct curl_slist *headers;
+	char curl_err_str[CURL_ERROR_SIZE];
+	struct pool *pool;
+	bool probing;
+	char *req;			/* owned copy of a request in flight */
+};
+
+/* Sets up curl for the request, leaving out only the transfer itself */
+static void json_rpc_setup(struct rpc_call *call, CURL *curl, const char *url,
+			   const char *userpass, const char *rpc_req,
+			   bool probe, bool longpoll, struct pool *pool, bool share)
 {
 	long timeout = longpoll ? (60 * 60) : 60;
-	struct data_buffer all_data = {NULL, 0};
-	struct header_info hi = {NULL, 0, NULL, NULL, false, false, false};
 	char len_hdr[64], user_agent_hdr[128];
-	char curl_err_str[CURL_ERROR_SIZE];
-	struct curl_slist *headers = NULL;
-	struct upload_buffer upload_data;
-	json_t *val, *err_val, *res_val;
-	bool probing = false;
-	double byte_count;
-	json_error_t err;
-	int rc;
-
-	memset(&err, 0, sizeof(err));
 
 	/* it is assumed that 'curl' is freshly [re]initialized at this pt */
 
+	call->pool = pool;
 	if (probe)
-		probing = !pool->probed;
+		call->probing = !pool->probed;
 	curl_easy_setopt(curl, CURLOPT_TIMEOUT, timeout);
 
 	// CURLOPT_VERBOSE won't write to stderr if we use CURLOPT_DEBUGFUNCTION
@@ -333,13 +342,13 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (!opt_delaynet || share)
 		curl_easy_setopt(curl, CURLOPT_TCP_NODELAY, 1);
 	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, all_data_cb);
-	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &all_data);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &call->all_data);
 	curl_easy_setopt(curl, CURLOPT_READFUNCTION, upload_data_cb);
-	curl_easy_setopt(curl, CURLOPT_READDATA, &upload_data);
-	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, curl_err_str);
+	curl_easy_setopt(curl, CURLOPT_READDATA, &call->upload_data);
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, call->curl_err_str);
 	curl_easy_setopt(curl, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, resp_hdr_cb);
-	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &hi);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &call->hi);
 	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_TRY);
 	if (pool->rpc_proxy) {
 		curl_easy_setopt(curl, CURLOPT_PROXY, pool->rpc_proxy);
@@ -359,60 +368,48 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (opt_protocol)
 		applog(LOG_DEBUG, "JSON protocol request:\n%s", rpc_req);
 
-	upload_data.buf = rpc_req;
-	upload_data.len = strlen(rpc_req);
+	call->upload_data.buf = rpc_req;
+	call->upload_data.len = strlen(rpc_req);
 	sprintf(len_hdr, "Content-Length: %lu",
-		(unsigned long) upload_data.len);
+		(unsigned long) call->upload_data.len);
 	sprintf(user_agent_hdr, "User-Agent: %s", PACKAGE_STRING);
 
-	headers = curl_slist_append(headers,
+	call->headers = curl_slist_append(call->headers,
 		"Content-type: application/json");
-	headers = curl_slist_append(headers,
+	call->headers = curl_slist_append(call->headers,
 		"X-Mining-Extensions: longpoll midstate rollntime submitold");
 
 	if (likely(global_hashrate)) {
 		char ghashrate[255];
 
 		sprintf(ghashrate, "X-Mining-Hashrate: %llu", global_hashrate);
-		headers = curl_slist_append(headers, ghashrate);
+		call->headers = curl_slist_append(call->headers, ghashrate);
 	}
 
-	headers = curl_slist_append(headers, len_hdr);
-	headers = curl_slist_append(headers, user_agent_hdr);
-	headers = curl_slist_append(headers, "Expect:"); /* disable Expect hdr*/
+	call->headers = curl_slist_append(call->headers, len_hdr);
+	call->headers = curl_slist_append(call->headers, user_agent_hdr);
+	call->headers = curl_slist_append(call->headers, "Expect:"); /* disable Expect hdr*/
 
-	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
-
-	if (opt_delaynet) {
-		/* Don't delay share submission, but still track the nettime */
-		if (!share) {
-			long long now_msecs, last_msecs;
-			struct timeval now, last;
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, call->headers);
+}
 
-			cgtime(&now);
-			last_nettime(&last);
-			now_msecs = (long long)now.tv_sec * 1000;
-			now_msecs += now.tv_usec / 1000;
-			last_msecs = (long long)last.tv_sec * 1000;
-			last_msecs += last.tv_usec / 1000;
-			if (now_msecs > last_msecs && now_msecs - last_msecs < 250) {
-				struct timespec rgtp;
+/* Takes the reply of a finished transfer, rc being its curl result */
+static json_t *json_rpc_result(struct rpc_call *call, CURL *curl, int rc, int *rolltime)
+{
+	struct pool *pool = call->pool;
+	struct header_info *hi = &call->hi;
+	json_t *val, *err_val, *res_val;
+	double byte_count;
+	json_error_t err;
 
-				rgtp.tv_sec = 0;
-				rgtp.tv_nsec = (250 - (now_msecs - last_msecs)) * 1000000;
-				nanosleep(&rgtp, NULL);
-			}
-		}
-		set_nettime();
-	}
+	memset(&err, 0, sizeof(err));
 
-	rc = curl_easy_perform(curl);
 	if (rc) {
-		applog(LOG_INFO, "HTTP request failed: %s", curl_err_str);
+		applog(LOG_INFO, "HTTP request failed: %s", call->curl_err_str);
 		goto err_out;
 	}
 
-	if (!all_data.buf) {
+	if (!call->all_data.buf) {
 		applog(LOG_DEBUG, "Empty data received in json_rpc_call.");
 		goto err_out;
 	}
@@ -424,42 +421,42 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 	if (curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD, &byte_count) == CURLE_OK)
 		pool->cgminer_pool_stats.bytes_received += byte_count;
 
-	if (probing) {
+	if (call->probing) {
 		pool->probed = true;
 		/* If X-Long-Polling was found, activate long polling */
-		if (hi.lp_path) {
+		if (hi->lp_path) {
 			if (pool->hdr_path != NULL)
 				free(pool->hdr_path);
-			pool->hdr_path = hi.lp_path;
+			pool->hdr_path = hi->lp_path;
 		} else
 			pool->hdr_path = NULL;
-		if (hi.stratum_url) {
-			pool->stratum_url = hi.stratum_url;
-			hi.stratum_url = NULL;
+		if (hi->stratum_url) {
+			pool->stratum_url = hi->stratum_url;
+			hi->stratum_url = NULL;
 		}
 	} else {
-		if (hi.lp_path) {
-			free(hi.lp_path);
-			hi.lp_path = NULL;
+		if (hi->lp_path) {
+			free(hi->lp_path);
+			hi->lp_path = NULL;
 		}
-		if (hi.stratum_url) {
-			free(hi.stratum_url);
-			hi.stratum_url = NULL;
+		if (hi->stratum_url) {
+			free(hi->stratum_url);
+			hi->stratum_url = NULL;
 		}
 	}
 
-	*rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.rolltime = hi.rolltime;
-	pool->cgminer_pool_stats.hadrolltime = hi.hadrolltime;
-	pool->cgminer_pool_stats.canroll = hi.canroll;
-	pool->cgminer_pool_stats.hadexpire = hi.hadexpire;
+	*rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.rolltime = hi->rolltime;
+	pool->cgminer_pool_stats.hadrolltime = hi->hadrolltime;
+	pool->cgminer_pool_stats.canroll = hi->canroll;
+	pool->cgminer_pool_stats.hadexpire = hi->hadexpire;
 
-	val = JSON_LOADS(all_data.buf, &err);
+	val = JSON_LOADS(call->all_data.buf, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 
 		if (opt_protocol)
-			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(all_data.buf));
+			applog(LOG_DEBUG, "JSON protocol response:\n%s", (char *)(call->all_data.buf));
 
 		goto err_out;
 	}
@@ -492,20 +489,20 @@ json_t *json_rpc_call(CURL *curl, const char *url,
 		goto err_out;
 	}
 
-	if (hi.reason) {
-		json_object_set_new(val, "reject-reason", json_string(hi.reason));
-		free(hi.reason);
-		hi.reason = NULL;
+	if (hi->reason) {
+		json_object_set_new(val, "reject-reason", json_string(hi->reason));
+		free(hi->reason);
+		hi->reason = NULL;
 	}
 	successful_connect = true;
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&call->all_data);
+	curl_slist_free_all(call->headers);
 	curl_easy_reset(curl);
 	return val;
 
 err_out:
-	databuf_free(&all_data);
-	curl_slist_free_all(headers);
+	databuf_free(&call->all_data);
+	curl_slist_free_all(call->headers);
 	curl_easy_reset(curl);
 	if (!successful_connect)
 		applog(LOG_DEBUG, "Failed to connect in json_rpc_call");
@@ -513,6 +510,73 @@ err_out:
 	return NULL;
 }
 
+json_t *json_rpc_call(CURL *curl, const char *url,
+		      const char *userpass, const char *rpc_req,
+		      bool probe, bool longpoll, int *rolltime,
+		      struct pool *pool, bool share)
+{
+	struct rpc_call call;
+	int rc;
+
+	memset(&call, 0, sizeof(call));
+	json_rpc_setup(&call, curl, url, userpass, rpc_req, probe, longpoll, pool, share);
+
+	if (opt_delaynet) {
+		/* Don't delay share submission, but still track the nettime */
+		if (!share) {
+			long long now_msecs, last_msecs;
+			struct timeval now, last;
+
+			cgtime(&now);
+			last_nettime(&last);
+			now_msecs = (long long)now.tv_sec * 1000;
+			now_msecs += now.tv_usec / 1000;
+			last_msecs = (long long)last.tv_sec * 1000;
+			last_msecs += last.tv_usec / 1000;
+			if (now_msecs > last_msecs && now_msecs - last_msecs < 250) {
+				struct timespec rgtp;
+
+				rgtp.tv_sec = 0;
+				rgtp.tv_nsec = (250 - (now_msecs - last_msecs)) * 1000000;
+				nanosleep(&rgtp, NULL);
+			}
+		}
+		set_nettime();
+	}
+
+	rc = curl_easy_perform(curl);
+	return json_rpc_result(&call, curl, rc, rolltime);
+}
+
+/* Non blocking counterparts of json_rpc_call for a curl multi handle. The
+ * caller adds curl to its multi handle after json_rpc_start and passes the
+ * result of the finished transfer to json_rpc_finish. Nothing waits here, so
+ * --net-delay only keeps track of the nettime. */
+struct rpc_call *json_rpc_start(CURL *curl, const char *url, const char *userpass,
+				const char *rpc_req, bool longpoll, struct pool *pool, bool share)
+{
+	struct rpc_call *call = calloc(1, sizeof(*call));
+
+	if (unlikely(!call))
+		quit(1, "Failed to calloc rpc_call in json_rpc_start");
+	call->req = strdup(rpc_req);
+	if (unlikely(!call->req))
+		quit(1, "Failed to strdup req in json_rpc_start");
+	json_rpc_setup(call, curl, url, userpass, call->req, false, longpoll, pool, share);
+	if (opt_delaynet)
+		set_nettime();
+	return call;
+}
+
+json_t *json_rpc_finish(struct rpc_call *call, CURL *curl, int rc, int *rolltime)
+{
+	json_t *val = json_rpc_result(call, curl, rc, rolltime);
+
+	free(call->req);
+	free(call);
+	return val;
+}
+
 #if (LIBCURL_VERSION_MAJOR == 7 && LIBCURL_VERSION_MINOR >= 10) || (LIBCURL_VERSION_MAJOR > 7)
 static struct {
 	const char *name;
@@ -575,12 +639,25 @@ char *get_proxy(char *url, struct pool *pool)
 	return url;
 }
 
+/* Writes the hex string of a binary value into s, which must have room for
+ * len * 2 + 1 chars */
+void __bin2hex(char *s, const unsigned char *p, size_t len)
+{
+	static const char hex[] = "0123456789abcdef";
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		s[i * 2] = hex[p[i] >> 4];
+		s[i * 2 + 1] = hex[p[i] & 0xf];
+	}
+	s[len * 2] = '\0';
+}
+
 /* Returns a malloced array string of a binary value of arbitrary length. The
  * array is rounded up to a 4 byte size to appease architectures that need
  * aligned array  sizes */
 char *bin2hex(const unsigned char *p, size_t len)
 {
-	unsigned int i;
 	ssize_t slen;
 	char *s;
 
@@ -588,36 +665,42 @@ char *bin2hex(const unsigned char *p, size_t len)
 	if (slen % 4)
 		slen += 4 - (slen % 4);
     s = safe_calloc(slen, 1, "s in bin2hex");
-	for (i = 0; i < len; i++)
-		sprintf(s + (i * 2), "%02x", (unsigned int) p[i]);
+	__bin2hex(s, p, len);
 
 	return s;
 }
 
+static inline int hex_nibble(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	c |= 0x20;
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	return -1;
+}
+
 /* Does the reverse of bin2hex but does not allocate any ram */
 bool hex2bin(unsigned char *p, const char *hexstr, size_t len)
 {
 	bool ret = false;
 
 	while (*hexstr && len) {
-		char hex_byte[4];
-		unsigned int v;
+		int hi, lo;
 
 		if (unlikely(!hexstr[1])) {
 			applog(LOG_ERR, "hex2bin str truncated");
 			return ret;
 		}
 
-		memset(hex_byte, 0, 4);
-		hex_byte[0] = hexstr[0];
-		hex_byte[1] = hexstr[1];
-
-		if (unlikely(sscanf(hex_byte, "%x", &v) != 1)) {
-			applog(LOG_INFO, "hex2bin sscanf '%s' failed", hex_byte);
+		hi = hex_nibble(hexstr[0]);
+		lo = hex_nibble(hexstr[1]);
+		if (unlikely(hi < 0 || lo < 0)) {
+			applog(LOG_INFO, "hex2bin invalid hex '%.2s'", hexstr);
 			return ret;
 		}
 
-		*p = (unsigned char) v;
+		*p = (unsigned char)(hi << 4 | lo);
 
 		p++;
 		hexstr += 2;
@@ -947,19 +1030,17 @@ enum send_ret {
 	SEND_OK,
 	SEND_SELECTFAIL,
 	SEND_SENDFAIL,
-	SEND_INACTIVE
+	SEND_INACTIVE,
+	SEND_FULL
 };
 
-/* Send a single command across a socket, appending \n to it. This should all
- * be done under stratum lock except when first establishing the socket */
-static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
+/* Write len bytes across the socket as they are. This should all be done
+ * under stratum lock except when first establishing the socket */
+static enum send_ret __stratum_write(struct pool *pool, const char *s, ssize_t len)
 {
 	SOCKETTYPE sock = pool->sock;
 	ssize_t ssent = 0;
 
-	strcat(s, "\n");
-	len++;
-
 	while (len > 0 ) {
 		struct timeval timeout = {1, 0};
 		ssize_t sent;
@@ -991,18 +1072,66 @@ static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
 	return SEND_OK;
 }
 
-bool stratum_send(struct pool *pool, char *s, ssize_t len)
+#ifdef HAVE_SYS_EPOLL_H
+/* Most a pool's output buffer holds before sends count as failed */
+#define NET_OUT_MAX (64 * 1024)
+
+/* The network reactor never waits for a socket to take a write. What it
+ * doesn't take at once is kept in the pool's output buffer, for the reactor
+ * to write out with stratum_flush once epoll reports room. Under
+ * stratum_lock. */
+static enum send_ret __stratum_queue(struct pool *pool, const char *s, ssize_t len)
 {
-	enum send_ret ret = SEND_INACTIVE;
+	ssize_t sent = 0;
 
-	if (opt_protocol)
-		applog(LOG_DEBUG, "SEND: %s", s);
+	if (pool->net_out_len + len > NET_OUT_MAX)
+		return SEND_FULL;
+	if (!pool->net_out_len) {
+		sent = send(pool->sock, s, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent < 0) {
+			if (!sock_blocks())
+				return SEND_SENDFAIL;
+			sent = 0;
+		}
+	}
+	if (sent < len) {
+		if (pool->net_out_size < pool->net_out_len + len - sent) {
+			pool->net_out_size = pool->net_out_len + len - sent + RBUFSIZE;
+			pool->net_out = realloc(pool->net_out, pool->net_out_size);
+			if (unlikely(!pool->net_out))
+				quit(1, "Failed to realloc pool net_out in __stratum_queue");
+		}
+		memcpy(pool->net_out + pool->net_out_len, s + sent, len - sent);
+		pool->net_out_len += len - sent;
+	}
 
-	mutex_lock(&pool->stratum_lock);
-	if (pool->stratum_active)
-		ret = __stratum_send(pool, s, len);
-	mutex_unlock(&pool->stratum_lock);
+	pool->cgminer_pool_stats.times_sent++;
+	pool->cgminer_pool_stats.bytes_sent += len;
+	pool->cgminer_pool_stats.net_bytes_sent += len;
+	return SEND_OK;
+}
+#endif
+
+/* Writes to a connection the reactor owns are queued, anything else waits
+ * for the socket */
+static enum send_ret __stratum_out(struct pool *pool, const char *s, ssize_t len)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	if (pool->net_state == NET_LIVE && pool->net_gen == pool->sock_gen)
+		return __stratum_queue(pool, s, len);
+#endif
+	return __stratum_write(pool, s, len);
+}
+
+/* Send a single command across a socket, appending \n to it */
+static enum send_ret __stratum_send(struct pool *pool, char *s, ssize_t len)
+{
+	strcat(s, "\n");
+	return __stratum_write(pool, s, len + 1);
+}
 
+static bool stratum_sent(struct pool *pool, enum send_ret ret)
+{
 	/* This is to avoid doing applog under stratum_lock */
 	switch (ret) {
 		default:
@@ -1019,10 +1148,69 @@ bool stratum_send(struct pool *pool, char *s, ssize_t len)
 		case SEND_INACTIVE:
 			applog(LOG_DEBUG, "Stratum send failed due to no pool stratum_active");
 			break;
+		case SEND_FULL:
+			applog(LOG_DEBUG, "Pool %d sock not taking writes, output buffer full", pool->pool_no);
+			break;
 	}
 	return (ret == SEND_OK);
 }
 
+bool stratum_send(struct pool *pool, char *s, ssize_t len)
+{
+	enum send_ret ret = SEND_INACTIVE;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "SEND: %s", s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active) {
+		strcat(s, "\n");
+		ret = __stratum_out(pool, s, len + 1);
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	return stratum_sent(pool, ret);
+}
+
+/* Send several commands, each already terminated by \n, in one write */
+bool stratum_send_lines(struct pool *pool, const char *s, ssize_t len)
+{
+	enum send_ret ret = SEND_INACTIVE;
+
+	if (opt_protocol)
+		applog(LOG_DEBUG, "SEND: %.*s", (int)len - 1, s);
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->stratum_active)
+		ret = __stratum_out(pool, s, len);
+	mutex_unlock(&pool->stratum_lock);
+
+	return stratum_sent(pool, ret);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Writes out as much of the pool's output buffer as the sock takes without
+ * blocking, false once the connection has failed */
+bool stratum_flush(struct pool *pool)
+{
+	enum send_ret ret = SEND_OK;
+	ssize_t sent;
+
+	mutex_lock(&pool->stratum_lock);
+	if (pool->net_out_len) {
+		sent = send(pool->sock, pool->net_out, pool->net_out_len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (sent > 0) {
+			pool->net_out_len -= sent;
+			memmove(pool->net_out, pool->net_out + sent, pool->net_out_len);
+		} else if (sent < 0 && !sock_blocks())
+			ret = SEND_SENDFAIL;
+	}
+	mutex_unlock(&pool->stratum_lock);
+
+	return stratum_sent(pool, ret);
+}
+#endif
+
 static bool socket_full(struct pool *pool, bool wait)
 {
 	SOCKETTYPE sock = pool->sock;
@@ -1044,7 +1232,7 @@ static bool socket_full(struct pool *pool, bool wait)
 /* Check to see if Santa's been good to you */
 bool sock_full(struct pool *pool)
 {
-	if (strlen(pool->sockbuf))
+	if (pool->sockbuf_tail > pool->sockbuf_head)
 		return true;
 
 	return (socket_full(pool, false));
@@ -1052,7 +1240,7 @@ bool sock_full(struct pool *pool)
 
 static void clear_sockbuf(struct pool *pool)
 {
-	strcpy(pool->sockbuf, "");
+	pool->sockbuf_head = pool->sockbuf_scan = pool->sockbuf_tail = 0;
 }
 
 static void clear_sock(struct pool *pool)
@@ -1071,35 +1259,116 @@ static void clear_sock(struct pool *pool)
 	clear_sockbuf(pool);
 }
 
-/* Make sure the pool sockbuf is large enough to cope with any coinbase size
- * by reallocing it to a large enough size rounded up to a multiple of RBUFSIZE
- * and zeroing the new memory */
-static void recalloc_sock(struct pool *pool, size_t len)
+/* Makes room to recv at least RECVSIZE more bytes at the sockbuf tail. The
+ * unconsumed partial line is moved to the front once the tail reaches the
+ * end, the buffer only grows, rounded up to RBUFSIZE, for a line that does
+ * not fit */
+static void recalloc_sock(struct pool *pool)
 {
-	size_t old, new;
+	size_t used, new;
 
-	old = strlen(pool->sockbuf);
-	new = old + len + 1;
-	if (new < pool->sockbuf_size)
+	if (pool->sockbuf_size - pool->sockbuf_tail >= RECVSIZE)
 		return;
+	used = pool->sockbuf_tail - pool->sockbuf_head;
+	if (pool->sockbuf_head) {
+		memmove(pool->sockbuf, pool->sockbuf + pool->sockbuf_head, used);
+		pool->sockbuf_scan -= pool->sockbuf_head;
+		pool->sockbuf_tail = used;
+		pool->sockbuf_head = 0;
+		if (pool->sockbuf_size - used >= RECVSIZE)
+			return;
+	}
+	new = used + RECVSIZE;
 	new = new + (RBUFSIZE - (new % RBUFSIZE));
 	// Avoid potentially recursive locking
 	// applog(LOG_DEBUG, "Recallocing pool sockbuf to %d", new);
 	pool->sockbuf = realloc(pool->sockbuf, new);
 	if (!pool->sockbuf)
 		quit(1, "Failed to realloc pool sockbuf in recalloc_sock");
-	memset(pool->sockbuf + old, 0, new - old);
 	pool->sockbuf_size = new;
 }
 
-/* Peeks at a socket to find the first end of line and then reads just that
- * from the socket and returns that as a malloced char */
+/* Returns the next complete line in sockbuf with its \n replaced by \0, or
+ * NULL. Every byte is searched for \n once, memchr resumes where the last
+ * search stopped */
+static char *sockbuf_line(struct pool *pool)
+{
+	char *buf = pool->sockbuf, *eol;
+
+	while ((eol = memchr(buf + pool->sockbuf_scan, '\n', pool->sockbuf_tail - pool->sockbuf_scan))) {
+		char *line = buf + pool->sockbuf_head;
+
+		*eol = '\0';
+		pool->sockbuf_head = pool->sockbuf_scan = eol + 1 - buf;
+		/* Skip empty lines */
+		if (eol > line)
+			return line;
+	}
+	pool->sockbuf_scan = pool->sockbuf_tail;
+	return NULL;
+}
+
+static void line_received(struct pool *pool, char *line)
+{
+	size_t len = strlen(line);
+
+	pool->cgminer_pool_stats.times_received++;
+	pool->cgminer_pool_stats.bytes_received += len;
+	pool->cgminer_pool_stats.net_bytes_received += len;
+	if (opt_protocol)
+		applog(LOG_DEBUG, "RECVD: %s", line);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Non blocking counterparts of recv_line for the network reactor, which
+ * waits on the socket itself. recv_sock reads whatever has arrived and
+ * returns false once the connection is gone, read_line then hands out the
+ * complete lines received, valid until the next recv_sock */
+bool recv_sock(struct pool *pool)
+{
+	ssize_t n;
+
+	if (pool->sockbuf_head == pool->sockbuf_tail)
+		clear_sockbuf(pool);
+	recalloc_sock(pool);
+	n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+		 pool->sockbuf_size - pool->sockbuf_tail, MSG_DONTWAIT);
+	if (n > 0) {
+		pool->sockbuf_tail += n;
+		return true;
+	}
+	if (!n) {
+		applog(LOG_DEBUG, "Socket closed on pool %d", pool->pool_no);
+		return false;
+	}
+	return sock_blocks();
+}
+
+char *read_line(struct pool *pool)
+{
+	char *line = sockbuf_line(pool);
+
+	if (line)
+		line_received(pool, line);
+	return line;
+}
+#endif
+
+/* Returns the next \n terminated line received on the pool's socket, with
+ * the \n stripped. The line is not copied, it points into the pool sockbuf
+ * and is only valid until the next recv_line on this pool. Space in the
+ * sockbuf is reclaimed once all lines received are consumed */
 char *recv_line(struct pool *pool)
 {
-	ssize_t len, buflen;
-	char *tok, *sret = NULL;
+	char *sret;
 
-	if (!strstr(pool->sockbuf, "\n")) {
+	/* Everything handed out before has been consumed now */
+	if (pool->sockbuf_head == pool->sockbuf_tail)
+		clear_sockbuf(pool);
+
+	pool->sock_closed = false;
+	sret = sockbuf_line(pool);
+	if (!sret) {
 		struct timeval rstart, now;
 
 		cgtime(&rstart);
@@ -1109,59 +1378,165 @@ char *recv_line(struct pool *pool)
 		}
 
 		do {
-			char s[RBUFSIZE];
-			size_t slen;
 			ssize_t n;
 
-			memset(s, 0, RBUFSIZE);
-			n = recv(pool->sock, s, RECVSIZE, 0);
+			recalloc_sock(pool);
+			n = recv(pool->sock, pool->sockbuf + pool->sockbuf_tail,
+				 pool->sockbuf_size - pool->sockbuf_tail, 0);
 			if (!n) {
 				applog(LOG_DEBUG, "Socket closed waiting in recv_line");
+				pool->sock_closed = true;
 				suspend_stratum(pool);
 				break;
 			}
 			if (n < 0) {
+				if (sock_reset())
+					pool->sock_closed = true;
 				if (!sock_blocks() || !socket_full(pool, false)) {
 					applog(LOG_DEBUG, "Failed to recv sock in recv_line");
 					suspend_stratum(pool);
 					break;
 				}
 			} else {
-				slen = strlen(s);
-				recalloc_sock(pool, slen);
-				strcat(pool->sockbuf, s);
+				pool->sockbuf_tail += n;
+				sret = sockbuf_line(pool);
 			}
 			cgtime(&now);
-		} while (tdiff(&now, &rstart) < 60 && !strstr(pool->sockbuf, "\n"));
+		} while (!sret && tdiff(&now, &rstart) < 60);
 	}
 
-	buflen = strlen(pool->sockbuf);
-	tok = strtok(pool->sockbuf, "\n");
-	if (!tok) {
+	if (!sret) {
 		applog(LOG_DEBUG, "Failed to parse a \\n terminated string in recv_line");
 		goto out;
 	}
-	sret = strdup(tok);
-	len = strlen(sret);
-
-	/* Copy what's left in the buffer after the \n, including the
-	 * terminating \0 */
-	if (buflen > len + 1)
-		memmove(pool->sockbuf, pool->sockbuf + len + 1, buflen - len + 1);
-	else
-		strcpy(pool->sockbuf, "");
-
-	pool->cgminer_pool_stats.times_received++;
-	pool->cgminer_pool_stats.bytes_received += len;
-	pool->cgminer_pool_stats.net_bytes_received += len;
+	line_received(pool, sret);
 out:
 	if (!sret)
 		clear_sock(pool);
-	else if (opt_protocol)
-		applog(LOG_DEBUG, "RECVD: %s", sret);
 	return sret;
 }
 
+static const char *scan_ws(const char *p)
+{
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')
+		p++;
+	return p;
+}
+
+/* Scans the string or literal at p into tok, returns the end of it or NULL
+ * for anything else. Strings with escapes are left to jansson too. */
+static const char *scan_value(const char *p, struct stratum_tok *tok)
+{
+	if (*p == '"') {
+		const char *end = strchr(p + 1, '"');
+
+		if (!end || memchr(p + 1, '\\', end - p - 1))
+			return NULL;
+		tok->s = p + 1;
+		tok->len = end - p - 1;
+		tok->str = true;
+		return end + 1;
+	}
+	tok->s = p;
+	while (isalnum((unsigned char)*p) || *p == '-' || *p == '+' || *p == '.')
+		p++;
+	tok->len = p - tok->s;
+	tok->str = false;
+	return tok->len ? p : NULL;
+}
+
+/* Scans the array at p into toks, taking nested as the position of a nested
+ * array of values to scan into sc->array, or NULL where none may be */
+static const char *scan_array(const char *p, struct stratum_tok *toks, int max, int *n,
+			      struct stratum_scan *sc, int *nested)
+{
+	*n = 0;
+	p = scan_ws(p + 1);
+	if (*p == ']')
+		return p + 1;
+	while (42) {
+		struct stratum_tok *tok;
+
+		if (*n == max)
+			return NULL;
+		tok = &toks[(*n)++];
+		if (*p == '[') {
+			if (!nested || *nested >= 0)
+				return NULL;
+			*nested = *n - 1;
+			tok->s = p;
+			tok->str = false;
+			p = scan_array(p, sc->array, STRATUM_SCAN_ARRAY, &sc->narray, NULL, NULL);
+			if (p)
+				tok->len = p - tok->s;
+		} else
+			p = scan_value(p, tok);
+		if (!p)
+			return NULL;
+		p = scan_ws(p);
+		if (*p == ']')
+			return p + 1;
+		if (*p != ',')
+			return NULL;
+		p = scan_ws(p + 1);
+	}
+}
+
+/* Finds the values of a stratum line in place without allocating. Returns
+ * false for anything but an object of string and literal values with a flat
+ * params array, to be parsed with jansson instead. */
+bool stratum_scan(struct stratum_scan *sc, const char *s)
+{
+	const char *p = scan_ws(s);
+
+	sc->id.s = sc->method.s = sc->result.s = sc->error.s = NULL;
+	sc->nparams = sc->narray = 0;
+	sc->array_param = -1;
+
+	if (*p != '{')
+		return false;
+	p = scan_ws(p + 1);
+	while (*p != '}') {
+		struct stratum_tok key, other, *val = &other;
+
+		p = scan_value(p, &key);
+		if (!p || !key.str)
+			return false;
+		p = scan_ws(p);
+		if (*p != ':')
+			return false;
+		p = scan_ws(p + 1);
+
+		if (*p == '[' && stratum_tok_is(&key, "params")) {
+			p = scan_array(p, sc->params, STRATUM_SCAN_PARAMS, &sc->nparams,
+				       sc, &sc->array_param);
+		} else {
+			if (stratum_tok_is(&key, "id"))
+				val = &sc->id;
+			else if (stratum_tok_is(&key, "method"))
+				val = &sc->method;
+			else if (stratum_tok_is(&key, "result"))
+				val = &sc->result;
+			else if (stratum_tok_is(&key, "error"))
+				val = &sc->error;
+			p = scan_value(p, val);
+		}
+		if (!p)
+			return false;
+		p = scan_ws(p);
+		if (*p == ',')
+			p = scan_ws(p + 1);
+		else if (*p != '}')
+			return false;
+	}
+	return true;
+}
+
+bool stratum_tok_is(const struct stratum_tok *tok, const char *s)
+{
+	return tok->s && !strncmp(tok->s, s, tok->len) && !s[tok->len];
+}
+
 /* Extracts a string value from a json array with error checking. To be used
  * when the value of the string returned is only examined and not to be stored.
  * See json_array_string below */
@@ -1192,114 +1567,227 @@ static char *json_array_string(json_t *val, unsigned int entry)
 	return NULL;
 }
 
-static bool parse_notify(struct pool *pool, json_t *val)
+/* Compile hex strings of the current job into binary template, so work generation
+ * only patches nonce2 and merkle root. Rebuilt on every notify and whenever nonce1
+ * or n2size change. Must hold data_lock write lock. */
+static bool stratum_template(struct pool *pool)
 {
-	char *job_id, *prev_hash, *coinbase1, *coinbase2, *bbversion, *nbit, *ntime;
-	bool clean, ret = false;
-	int merkles, i;
-	json_t *arr;
+	struct stratum_work *swork = &pool->swork;
+	unsigned char *hdr = swork->header_bin;
+	size_t tail;
+	uint64_t bits;
+	int i;
 
-	arr = json_array_get(val, 4);
-	if (!arr || !json_is_array(arr))
-		goto out;
+	/* Works hold references to the job, only a new job_id or nonce1
+	 * needs new shared strings */
+	if (!swork->job || strcmp(swork->job->job_id, swork->job_id) ||
+	    !swork->job->nonce1 || strcmp(swork->job->nonce1, pool->nonce1)) {
+		free_work_job(swork->job);
+		swork->job = make_work_job(swork->job_id, pool->nonce1);
+	}
 
-	merkles = json_array_size(arr);
+	swork->cb_len = swork->cb1_len + pool->n1_len + pool->n2size + swork->cb2_len;
+	swork->nonce2_offset = swork->cb1_len + pool->n1_len;
+	swork->cb_bin = realloc(swork->cb_bin, swork->cb_len);
+	if (unlikely(!swork->cb_bin))
+		quit(1, "Failed to realloc cb_bin in stratum_template");
+	memset(swork->cb_bin + swork->nonce2_offset, 0, pool->n2size);
+	if (!hex2bin(swork->cb_bin, swork->coinbase1, swork->cb1_len) ||
+	    !hex2bin(swork->cb_bin + swork->cb1_len, pool->nonce1, pool->n1_len) ||
+	    !hex2bin(swork->cb_bin + swork->nonce2_offset + pool->n2size, swork->coinbase2, swork->cb2_len))
+		return false;
+	/* Prefix is the same for every work of the job, hash it once */
+	sha2_starts(&swork->cb_ctx);
+	sha2_update(&swork->cb_ctx, swork->cb_bin, swork->nonce2_offset);
+
+	/* The rest, with the buffered part of the prefix, as final sha256 blocks */
+	swork->cb_tail_n2 = swork->nonce2_offset % 64;
+	tail = swork->cb_len - (swork->nonce2_offset - swork->cb_tail_n2);
+	swork->cb_tail_len = (tail + 1 + 8 + 63) / 64 * 64;
+	swork->cb_tail = realloc(swork->cb_tail, swork->cb_tail_len);
+	if (unlikely(!swork->cb_tail))
+		quit(1, "Failed to realloc cb_tail in stratum_template");
+	memset(swork->cb_tail, 0, swork->cb_tail_len);
+	memcpy(swork->cb_tail, swork->cb_bin + swork->cb_len - tail, tail);
+	swork->cb_tail[tail] = 0x80;
+	bits = htobe64((uint64_t)swork->cb_len * 8);
+	memcpy(swork->cb_tail + swork->cb_tail_len - 8, &bits, 8);
+
+	if (swork->merkles) {
+		swork->merkle_bin = realloc(swork->merkle_bin, 32 * swork->merkles);
+		if (unlikely(!swork->merkle_bin))
+			quit(1, "Failed to realloc merkle_bin in stratum_template");
+	}
+	for (i = 0; i < swork->merkles; i++) {
+		if (!hex2bin(swork->merkle_bin + 32 * i, swork->merkle[i], 32))
+			return false;
+	}
 
-	job_id = json_array_string(val, 0);
-	prev_hash = json_array_string(val, 1);
-	coinbase1 = json_array_string(val, 2);
-	coinbase2 = json_array_string(val, 3);
-	bbversion = json_array_string(val, 5);
-	nbit = json_array_string(val, 6);
-	ntime = json_array_string(val, 7);
-	clean = json_is_true(json_array_get(val, 8));
-
-	if (!job_id || !prev_hash || !coinbase1 || !coinbase2 || !bbversion || !nbit || !ntime) {
-		/* Annoying but we must not leak memory */
-		if (job_id)
-			free(job_id);
-		if (prev_hash)
-			free(prev_hash);
-		if (coinbase1)
-			free(coinbase1);
-		if (coinbase2)
-			free(coinbase2);
-		if (bbversion)
-			free(bbversion);
-		if (nbit)
-			free(nbit);
-		if (ntime)
-			free(ntime);
-		goto out;
+	memset(hdr, 0, 128);
+	if (!hex2bin(hdr, swork->bbversion, 4) ||
+	    !hex2bin(hdr + 4, swork->prev_hash, 32) ||
+	    !hex2bin(hdr + STRATUM_HDR_NTIME, swork->ntime, 4) ||
+	    !hex2bin(hdr + STRATUM_HDR_NTIME + 4, swork->nbit, 4))
+		return false;
+	/* Same sha256 padding of the 80 byte header as workpadding */
+	hdr[83] = 0x80;
+	hdr[124] = 0x80;
+	hdr[125] = 0x02;
+	return true;
+}
+
+static char *tok_copy(char **buf, const struct stratum_tok *tok)
+{
+	char *s = *buf;
+
+	memcpy(s, tok->s, tok->len);
+	s[tok->len] = '\0';
+	*buf += tok->len + 1;
+	return s;
+}
+
+/* Takes the job of a notify, param holding its first 8 params, into swork
+ * and compiles its template. The strings are copied into job_buf which is
+ * only grown, so only a new job_id or nonce1 allocates, for the job strings
+ * the works share. */
+static bool stratum_notify(struct pool *pool, const struct stratum_tok *param,
+			   const struct stratum_tok *merkle, int merkles, bool clean)
+{
+	struct stratum_work *swork = &pool->swork;
+	size_t len = 0;
+	char *buf;
+	int i;
+
+	for (i = 0; i < 8; i++) {
+		if (i != 4)
+			len += param[i].len + 1;
 	}
+	for (i = 0; i < merkles; i++)
+		len += merkle[i].len + 1;
 
 	cg_wlock(&pool->data_lock);
-	free(pool->swork.job_id);
-	free(pool->swork.prev_hash);
-	free(pool->swork.coinbase1);
-	free(pool->swork.coinbase2);
-	free(pool->swork.bbversion);
-	free(pool->swork.nbit);
-	free(pool->swork.ntime);
-	pool->swork.job_id = job_id;
-	pool->swork.prev_hash = prev_hash;
-	pool->swork.coinbase1 = coinbase1;
-	pool->swork.cb1_len = strlen(coinbase1) / 2;
-	pool->swork.coinbase2 = coinbase2;
-	pool->swork.cb2_len = strlen(coinbase2) / 2;
-	pool->swork.bbversion = bbversion;
-	pool->swork.nbit = nbit;
-	pool->swork.ntime = ntime;
-	pool->swork.clean = clean;
-	pool->swork.cb_len = pool->swork.cb1_len + pool->n1_len + pool->n2size + pool->swork.cb2_len;
-
-	for (i = 0; i < pool->swork.merkles; i++)
-		free(pool->swork.merkle[i]);
-	if (merkles) {
-		pool->swork.merkle = realloc(pool->swork.merkle, sizeof(char *) * merkles + 1);
-		for (i = 0; i < merkles; i++)
-			pool->swork.merkle[i] = json_array_string(arr, i);
+	if (len > swork->job_size) {
+		swork->job_buf = realloc(swork->job_buf, len);
+		if (unlikely(!swork->job_buf))
+			quit(1, "Failed to realloc job_buf in stratum_notify");
+		swork->job_size = len;
+	}
+	if (merkles > swork->merkles_size) {
+		swork->merkle = realloc(swork->merkle, sizeof(char *) * merkles);
+		if (unlikely(!swork->merkle))
+			quit(1, "Failed to realloc merkle in stratum_notify");
+		swork->merkles_size = merkles;
 	}
-	pool->swork.merkles = merkles;
-	if (clean)
+	buf = swork->job_buf;
+	swork->job_id = tok_copy(&buf, &param[0]);
+	swork->prev_hash = tok_copy(&buf, &param[1]);
+	swork->coinbase1 = tok_copy(&buf, &param[2]);
+	swork->cb1_len = param[2].len / 2;
+	swork->coinbase2 = tok_copy(&buf, &param[3]);
+	swork->cb2_len = param[3].len / 2;
+	swork->bbversion = tok_copy(&buf, &param[5]);
+	swork->nbit = tok_copy(&buf, &param[6]);
+	swork->ntime = tok_copy(&buf, &param[7]);
+	for (i = 0; i < merkles; i++)
+		swork->merkle[i] = tok_copy(&buf, &merkle[i]);
+	swork->merkles = merkles;
+	swork->clean = clean;
+	if (clean) {
 		pool->nonce2 = 0;
-	pool->swork.header_len = strlen(pool->swork.bbversion) +
-				 strlen(pool->swork.prev_hash) +
-				 strlen(pool->swork.ntime) +
-				 strlen(pool->swork.nbit) +
-	/* merkle_hash */	 32 +
-	/* nonce */		 8 +
-	/* workpadding */	 96;
-	pool->swork.header_len = pool->swork.header_len * 2 + 1;
-	align_len(&pool->swork.header_len);
+		pool->nonce2_epoch++;
+	}
+	if (unlikely(!stratum_template(pool))) {
+		cg_wunlock(&pool->data_lock);
+		applog(LOG_INFO, "Malformed mining.notify from pool %d", pool->pool_no);
+		return false;
+	}
 	cg_wunlock(&pool->data_lock);
 
+	/* Only this pool's reader changes the strings */
 	if (opt_protocol) {
-		applog(LOG_DEBUG, "job_id: %s", job_id);
-		applog(LOG_DEBUG, "prev_hash: %s", prev_hash);
-		applog(LOG_DEBUG, "coinbase1: %s", coinbase1);
-		applog(LOG_DEBUG, "coinbase2: %s", coinbase2);
+		applog(LOG_DEBUG, "job_id: %s", swork->job_id);
+		applog(LOG_DEBUG, "prev_hash: %s", swork->prev_hash);
+		applog(LOG_DEBUG, "coinbase1: %s", swork->coinbase1);
+		applog(LOG_DEBUG, "coinbase2: %s", swork->coinbase2);
 		for (i = 0; i < merkles; i++)
-			applog(LOG_DEBUG, "merkle%d: %s", i, pool->swork.merkle[i]);
-		applog(LOG_DEBUG, "bbversion: %s", bbversion);
-		applog(LOG_DEBUG, "nbit: %s", nbit);
-		applog(LOG_DEBUG, "ntime: %s", ntime);
+			applog(LOG_DEBUG, "merkle%d: %s", i, swork->merkle[i]);
+		applog(LOG_DEBUG, "bbversion: %s", swork->bbversion);
+		applog(LOG_DEBUG, "nbit: %s", swork->nbit);
+		applog(LOG_DEBUG, "ntime: %s", swork->ntime);
 		applog(LOG_DEBUG, "clean: %s", clean ? "yes" : "no");
 	}
 
 	/* A notify message is the closest stratum gets to a getwork */
 	pool->getwork_requested++;
 	total_getworks++;
-	ret = true;
+	return true;
+}
+
+static bool json_tok(struct stratum_tok *tok, json_t *val, unsigned int entry)
+{
+	tok->s = __json_array_string(val, entry);
+	if (!tok->s)
+		return false;
+	tok->len = strlen(tok->s);
+	tok->str = true;
+	return true;
+}
+
+static bool parse_notify(struct pool *pool, json_t *val)
+{
+	struct stratum_tok param[8], *merkle;
+	bool ret = false;
+	int merkles, i;
+	json_t *arr;
+
+	arr = json_array_get(val, 4);
+	if (!arr || !json_is_array(arr))
+		return false;
+
+	for (i = 0; i < 8; i++) {
+		if (i != 4 && !json_tok(&param[i], val, i))
+			return false;
+	}
+
+	merkles = json_array_size(arr);
+	merkle = calloc(merkles + 1, sizeof(*merkle));
+	if (unlikely(!merkle))
+		quit(1, "Failed to calloc merkle in parse_notify");
+	for (i = 0; i < merkles; i++) {
+		if (!json_tok(&merkle[i], arr, i))
+			goto out;
+	}
+	ret = stratum_notify(pool, param, merkle, merkles, json_is_true(json_array_get(val, 8)));
 out:
+	free(merkle);
 	return ret;
 }
 
-static bool parse_diff(struct pool *pool, json_t *val)
+/* The notify shape stratum_scan understands: string params with the merkle
+ * branch as an array of strings at 4 and clean as an optional literal at 8 */
+static bool scan_notify(struct pool *pool, struct stratum_scan *sc)
 {
-	double old_diff, diff;
+	bool clean;
+	int i;
+
+	if (sc->nparams < 8 || sc->array_param != 4)
+		return false;
+	for (i = 0; i < 8; i++) {
+		if (i != 4 && !sc->params[i].str)
+			return false;
+	}
+	for (i = 0; i < sc->narray; i++) {
+		if (!sc->array[i].str)
+			return false;
+	}
+	clean = sc->nparams > 8 && !sc->params[8].str && stratum_tok_is(&sc->params[8], "true");
+	return stratum_notify(pool, sc->params, sc->array, sc->narray, clean);
+}
+
+static bool stratum_diff(struct pool *pool, double diff)
+{
+	double old_diff;
 
-	diff = json_number_value(json_array_get(val, 0));
 	if (diff == 0)
 		return false;
 
@@ -1324,6 +1812,11 @@ static bool parse_diff(struct pool *pool, json_t *val)
 	return true;
 }
 
+static bool parse_diff(struct pool *pool, json_t *val)
+{
+	return stratum_diff(pool, json_number_value(json_array_get(val, 0)));
+}
+
 static bool parse_reconnect(struct pool *pool, json_t *val)
 {
 	char *url, *port, address[256];
@@ -1346,8 +1839,14 @@ static bool parse_reconnect(struct pool *pool, json_t *val)
 
 	applog(LOG_NOTICE, "Reconnect requested from pool %d to %s", pool->pool_no, address);
 
+#ifdef HAVE_SYS_EPOLL_H
+	/* The network reactor serving every pool must not block on the
+	 * connect, it hands the pool to a connect thread instead */
+	pool->net_reconnect = true;
+#else
 	if (!restart_stratum(pool))
 		return false;
+#endif
 
 	return true;
 }
@@ -1367,6 +1866,81 @@ static bool send_version(struct pool *pool, json_t *val)
 	return true;
 }
 
+/* Pool changed the version bits we may roll, used from the next work on */
+static bool parse_version_mask(struct pool *pool, json_t *val)
+{
+	const char *mask;
+	uint32_t vmask;
+
+	mask = json_string_value(json_array_get(val, 0));
+	if (!mask || sscanf(mask, "%x", &vmask) != 1)
+		return false;
+
+	vmask &= VERSION_ROLLING_MASK;
+	cg_wlock(&pool->data_lock);
+	pool->version_mask = vmask;
+	cg_wunlock(&pool->data_lock);
+
+	applog(LOG_INFO, "Pool %d version rolling mask set to %08x", pool->pool_no, vmask);
+	return true;
+}
+
+/* Reply to our BIP310 mining.configure, a pool not knowing it answers with
+ * an error and we just mine without version rolling */
+static void parse_configure(struct pool *pool, json_t *val)
+{
+	json_t *res_val = json_object_get(val, "result");
+	const char *mask;
+	uint32_t vmask;
+
+	if (!json_is_object(res_val) || !json_is_true(json_object_get(res_val, "version-rolling"))) {
+		applog(LOG_DEBUG, "Pool %d does not support version rolling", pool->pool_no);
+		return;
+	}
+	mask = json_string_value(json_object_get(res_val, "version-rolling.mask"));
+	if (!mask || sscanf(mask, "%x", &vmask) != 1) {
+		applog(LOG_INFO, "Pool %d sent no version rolling mask", pool->pool_no);
+		return;
+	}
+
+	vmask &= VERSION_ROLLING_MASK;
+	cg_wlock(&pool->data_lock);
+	pool->version_mask = vmask;
+	cg_wunlock(&pool->data_lock);
+
+	applog(LOG_INFO, "Pool %d version rolling mask %08x", pool->pool_no, vmask);
+}
+
+/* Takes the configure reply if it comes before or after the subscribe reply
+ * or ahead of the authorise one. stratum_scan rules out most other lines,
+ * only one with the configure id or one it can't scan, like the reply with
+ * its result object, goes to jansson. */
+static bool configure_reply(struct pool *pool, char *s)
+{
+	struct stratum_scan sc;
+	json_error_t err;
+	json_t *val;
+	char *end;
+	bool ret;
+
+	if (stratum_scan(&sc, s)) {
+		if (sc.method.s || !sc.id.s || sc.id.str ||
+		    strtol(sc.id.s, &end, 10) != pool->configure_id || end != sc.id.s + sc.id.len)
+			return false;
+	}
+	val = JSON_LOADS(s, &err);
+	if (!val)
+		return false;
+	ret = json_is_integer(json_object_get(val, "id")) &&
+	      json_integer_value(json_object_get(val, "id")) == pool->configure_id;
+	if (ret) {
+		pool->configure_pending = false;
+		parse_configure(pool, val);
+	}
+	json_decref(val);
+	return ret;
+}
+
 static bool show_message(struct pool *pool, json_t *val)
 {
 	char *msg;
@@ -1380,16 +1954,13 @@ static bool show_message(struct pool *pool, json_t *val)
 	return true;
 }
 
-bool parse_method(struct pool *pool, char *s)
+static bool parse_method_json(struct pool *pool, char *s)
 {
 	json_t *val = NULL, *method, *err_val, *params;
 	json_error_t err;
 	bool ret = false;
 	char *buf;
 
-	if (!s)
-		goto out;
-
 	val = JSON_LOADS(s, &err);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
@@ -1448,6 +2019,11 @@ bool parse_method(struct pool *pool, char *s)
 		ret = true;
 		goto out;
 	}
+
+	if (!strncasecmp(buf, "mining.set_version_mask", 23) && parse_version_mask(pool, params)) {
+		ret = true;
+		goto out;
+	}
 out:
 	if (val)
 		json_decref(val);
@@ -1455,6 +2031,36 @@ out:
 	return ret;
 }
 
+/* Notify and set_difficulty, most of what pools send, are taken straight
+ * from the line as stratum_scan finds them. Other methods and unusual forms
+ * of these go through jansson. */
+bool parse_method(struct pool *pool, char *s)
+{
+	struct stratum_scan sc;
+
+	if (!s)
+		return false;
+	if (unlikely(pool->configure_pending) && configure_reply(pool, s))
+		return true;
+	if (!stratum_scan(&sc, s))
+		return parse_method_json(pool, s);
+	/* Responses, for parse_stratum_response */
+	if (!sc.method.s || !sc.method.str)
+		return false;
+	if (sc.error.s && !stratum_tok_is(&sc.error, "null"))
+		return parse_method_json(pool, s);
+
+	if (stratum_tok_is(&sc.method, "mining.notify") && sc.array_param == 4) {
+		pool->stratum_notify = scan_notify(pool, &sc);
+		return pool->stratum_notify;
+	}
+	if (stratum_tok_is(&sc.method, "mining.set_difficulty") && sc.nparams == 1 &&
+	    !sc.params[0].str)
+		return stratum_diff(pool, strtod(sc.params[0].s, NULL));
+
+	return parse_method_json(pool, s);
+}
+
 bool auth_stratum(struct pool *pool)
 {
 	json_t *val = NULL, *res_val, *err_val;
@@ -1473,14 +2079,18 @@ bool auth_stratum(struct pool *pool)
 		sret = recv_line(pool);
 		if (!sret)
 			goto out;
-		if (parse_method(pool, sret))
-			free(sret);
-		else
+		if (!parse_method(pool, sret))
 			break;
 	}
 
+	/* A pool that answers authorise before configure ignores it, stop
+	 * looking for the reply on every line */
+	if (pool->configure_pending) {
+		applog(LOG_INFO, "Pool %d did not answer mining.configure", pool->pool_no);
+		pool->configure_pending = false;
+	}
+
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	res_val = json_object_get(val, "result");
 	err_val = json_object_get(val, "error");
 
@@ -1508,6 +2118,32 @@ out:
 	return ret;
 }
 
+#define STRATUM_CONNECT_TIMEOUT 10
+
+/* Waits for a non blocking connect in progress, true once it succeeded */
+static bool connect_wait(SOCKETTYPE sockd)
+{
+	struct timeval timeout = {STRATUM_CONNECT_TIMEOUT, 0};
+	socklen_t len = sizeof(int);
+	int err = 0, ret;
+	fd_set wd;
+
+	if (!sock_connecting())
+		return false;
+	do {
+		FD_ZERO(&wd);
+		FD_SET(sockd, &wd);
+		ret = select(sockd + 1, NULL, &wd, NULL, &timeout);
+	} while (ret < 0 && errno == EINTR);
+	if (ret < 1) {
+		applog(LOG_DEBUG, "Timed out connecting");
+		return false;
+	}
+	if (getsockopt(sockd, SOL_SOCKET, SO_ERROR, (void *)&err, &len) || err)
+		return false;
+	return true;
+}
+
 static bool setup_stratum_socket(struct pool *pool)
 {
 	struct addrinfo *servinfo, *hints, *p;
@@ -1543,7 +2179,10 @@ static bool setup_stratum_socket(struct pool *pool)
 			continue;
 		}
 
-		if (connect(sockd, p->ai_addr, p->ai_addrlen) == -1) {
+		/* Connect without blocking so an address that never answers
+		 * holds us up for STRATUM_CONNECT_TIMEOUT seconds only */
+		noblock_socket(sockd);
+		if (connect(sockd, p->ai_addr, p->ai_addrlen) == -1 && !connect_wait(sockd)) {
 			CLOSESOCKET(sockd);
 			applog(LOG_DEBUG, "Failed connect");
 			continue;
@@ -1567,6 +2206,7 @@ static bool setup_stratum_socket(struct pool *pool)
 	}
 
 	pool->sock = sockd;
+	pool->sock_gen++;
 	keep_sockalive(sockd);
 	return true;
 }
@@ -1609,18 +2249,23 @@ void suspend_stratum(struct pool *pool)
 	if (pool->sock)
 		CLOSESOCKET(pool->sock);
 	pool->sock = 0;
+	pool->net_out_len = 0;
 	mutex_unlock(&pool->stratum_lock);
 }
 
 bool initiate_stratum(struct pool *pool)
 {
-	bool ret = false, recvd = false, noresume = false, sockd = false;
+	bool ret = false, recvd = false, noresume = false, sockd = false, recompiled = true;
+	bool sock_recvd;
 	char s[RBUFSIZE], *sret = NULL, *nonce1, *sessionid;
 	json_t *val = NULL, *res_val, *err_val;
 	json_error_t err;
 	int n2size;
 
 resend:
+	pool->configure_pending = false;
+	pool->sock_closed = false;
+	sock_recvd = false;
 	if (!setup_stratum_socket(pool)) {
 		sockd = false;
 		goto out;
@@ -1628,11 +2273,31 @@ resend:
 
 	sockd = true;
 
-	if (recvd) {
-		/* Get rid of any crap lying around if we're resending */
+	cg_wlock(&pool->data_lock);
+	pool->version_mask = 0;
+	cg_wunlock(&pool->data_lock);
+
+	/* Get rid of any crap lying around if we're resending */
+	if (recvd)
 		clear_sock(pool);
+
+	/* Version rolling is negotiated ahead of subscribing, as BIP310 asks,
+	 * on every fresh socket */
+	if (opt_version_rolling && !pool->no_configure) {
+		pool->configure_id = swork_id++;
+		sprintf(s, "{\"id\": %d, \"method\": \"mining.configure\", \"params\": [[\"version-rolling\"], "
+			"{\"version-rolling.mask\": \"%08x\", \"version-rolling.min-bit-count\": 2}]}",
+			pool->configure_id, VERSION_ROLLING_MASK);
+		if (__stratum_send(pool, s, strlen(s)) != SEND_OK) {
+			applog(LOG_DEBUG, "Failed to send configure in initiate_stratum");
+			goto out;
+		}
+		pool->configure_pending = true;
+	}
+
+	if (recvd)
 		sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": []}", swork_id++);
-	} else {
+	else {
 		if (pool->sessionid)
 			sprintf(s, "{\"id\": %d, \"method\": \"mining.subscribe\", \"params\": [\""PACKAGE"/"VERSION"\", \"%s\"]}", swork_id++, pool->sessionid);
 		else
@@ -1649,14 +2314,20 @@ resend:
 		goto out;
 	}
 
-	sret = recv_line(pool);
-	if (!sret)
-		goto out;
+	while (42) {
+		sret = recv_line(pool);
+		if (!sret)
+			goto out;
+
+		recvd = sock_recvd = true;
 
-	recvd = true;
+		/* The configure reply usually comes ahead of the subscribe
+		 * one, one coming later is taken by parse_method */
+		if (!pool->configure_pending || !configure_reply(pool, sret))
+			break;
+	}
 
 	val = JSON_LOADS(sret, &err);
-	free(sret);
 	if (!val) {
 		applog(LOG_INFO, "JSON decode failed(%d): %s", err.line, err.text);
 		goto out;
@@ -1691,7 +2362,7 @@ resend:
 		goto out;
 	}
 	n2size = json_integer_value(json_array_get(res_val, 2));
-	if (!n2size) {
+	if (!n2size || n2size > MAX_N2SIZE) {
 		applog(LOG_INFO, "Failed to get n2size in initiate_stratum");
 		free(sessionid);
 		free(nonce1);
@@ -1703,7 +2374,12 @@ resend:
 	pool->nonce1 = nonce1;
 	pool->n1_len = strlen(nonce1) / 2;
 	pool->n2size = n2size;
+	/* Job kept from the previous session must use the new extranonce */
+	if (pool->swork.cb_bin)
+		recompiled = stratum_template(pool);
 	cg_wunlock(&pool->data_lock);
+	if (!recompiled)
+		applog(LOG_INFO, "Pool %d job template does not fit new extranonce1", pool->pool_no);
 
 	if (sessionid)
 		applog(LOG_DEBUG, "Pool %d stratum session id: %s", pool->pool_no, pool->sessionid);
@@ -1723,6 +2399,16 @@ out:
 			       pool->pool_no, pool->nonce1, pool->n2size);
 		}
 	} else {
+		/* Closed or reset without a word after mining.configure,
+		 * subscribe again without it and never send it to this pool
+		 * again. A timeout or other error is no sign of that. */
+		if (pool->configure_pending && !sock_recvd && pool->sock_closed) {
+			applog(LOG_INFO, "Pool %d disconnected on mining.configure, version rolling disabled", pool->pool_no);
+			pool->no_configure = true;
+			if (sockd)
+				suspend_stratum(pool);
+			goto resend;
+		}
 		if (recvd && !noresume) {
 			/* Reset the sessionid used for stratum resuming in case the pool
 			* does not support it, or does not know how to respond to the
@@ -1747,12 +2433,17 @@ out:
 
 bool restart_stratum(struct pool *pool)
 {
+	struct timeval tv_start, tv_end;
+
 	if (pool->stratum_active)
 		suspend_stratum(pool);
+	cgtime(&tv_start);
 	if (!initiate_stratum(pool))
 		return false;
 	if (!auth_stratum(pool))
 		return false;
+	cgtime(&tv_end);
+	pool->cgminer_pool_stats.cnx_setup = tdiff(&tv_end, &tv_start);
 	return true;
 }
 
@@ -20,6 +20,14 @@
 	{
 		return (errno == EAGAIN || errno == EWOULDBLOCK);
 	}
+	static inline bool sock_reset(void)
+	{
+		return (errno == ECONNRESET);
+	}
+	static inline bool sock_connecting(void)
+	{
+		return (errno == EINPROGRESS);
+	}
 #elif defined WIN32
 	#include <ws2tcpip.h>
 	#include <winsock2.h>
@@ -37,6 +45,14 @@
 	{
 		return (WSAGetLastError() == WSAEWOULDBLOCK);
 	}
+	static inline bool sock_reset(void)
+	{
+		return (WSAGetLastError() == WSAECONNRESET);
+	}
+	static inline bool sock_connecting(void)
+	{
+		return (WSAGetLastError() == WSAEWOULDBLOCK);
+	}
 	#ifndef SHUT_RDWR
 	#define SHUT_RDWR SD_BOTH
 	#endif
@@ -52,6 +68,29 @@
 #define JSON_LOADS(str, err_ptr) json_loads((str), (err_ptr))
 #endif
 
+/* A value in a stratum line: string without its quotes, or a number, true,
+ * false or null literal. s is NULL for a key the line doesn't have. */
+struct stratum_tok {
+	const char *s;
+	int len;
+	bool str;
+};
+
+#define STRATUM_SCAN_PARAMS 12
+#define STRATUM_SCAN_ARRAY 32
+
+/* Spans of the values of a stratum line in the line itself, for the flat
+ * shapes of notify, set_difficulty and submit responses. params may hold one
+ * array of strings and literals, the merkle branch of a notify. */
+struct stratum_scan {
+	struct stratum_tok id, method, result, error;
+	struct stratum_tok params[STRATUM_SCAN_PARAMS];
+	int nparams;
+	struct stratum_tok array[STRATUM_SCAN_ARRAY];
+	int narray;
+	int array_param;	/* index in params of the array, -1 without */
+};
+
 /* cgminer specific unnamed semaphore implementations to cope with osx not
  * implementing them. */
 #ifdef __APPLE__
@@ -81,8 +120,16 @@ void copy_time(struct timeval *dest, const struct timeval *src);
 double us_tdiff(struct timeval *end, struct timeval *start);
 double tdiff(struct timeval *end, struct timeval *start);
 bool stratum_send(struct pool *pool, char *s, ssize_t len);
+bool stratum_send_lines(struct pool *pool, const char *s, ssize_t len);
 bool sock_full(struct pool *pool);
 char *recv_line(struct pool *pool);
+#ifdef HAVE_SYS_EPOLL_H
+bool recv_sock(struct pool *pool);
+char *read_line(struct pool *pool);
+bool stratum_flush(struct pool *pool);
+#endif
+bool stratum_scan(struct stratum_scan *sc, const char *s);
+bool stratum_tok_is(const struct stratum_tok *tok, const char *s);
 bool parse_method(struct pool *pool, char *s);
 bool extract_sockaddr(struct pool *pool, char *url);
 bool auth_stratum(struct pool *pool);